@@ -0,0 +1,174 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Benchmark bookkeeping for --bench
+// A run is one scene on one backend for a fixed number of frames. Every
+// frame records how long each stage of the pipeline took, and the run
+// reports the minimum, median and 99th percentile of each, which say
+// more about stutter than an average does. Reports come out as JSON or
+// CSV, so results from different builds and machines can be compared
+// by a script
+
+enum {
+    BENCH_INPUT,     // Reading input, or following the camera path
+    BENCH_TRANSFORM, // Matrices, culling, levels of detail, sorting draws
+    BENCH_DRAW,      // Drawing, until the pixels are done
+    BENCH_READBACK,  // Getting the pixels out of GL
+    BENCH_BLIT,      // Converting and writing them to the framebuffer
+    BENCH_STAGES
+};
+
+static const char *bench_stage_names[BENCH_STAGES] = {"input", "transform", "draw", "readback", "blit"};
+
+typedef struct BenchRun {
+    const char *scene;
+    const char *backend;
+    int width, height; // Rendered, before scaling up to the framebuffer
+    int num_frames;
+    int frames; // Recorded so far
+
+    float *samples[BENCH_STAGES]; // ms, one per frame
+    double total_ms; // Wall time of every recorded frame
+    unsigned long long bytes_written; // To the framebuffer
+} BenchRun;
+
+typedef struct BenchSummary {
+    double min_ms;
+    double median_ms;
+    double p99_ms;
+} BenchSummary;
+
+static inline long long bench_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int bench_run_init(BenchRun *run, const char *scene, const char *backend, int width, int height, int num_frames) {
+    memset(run, 0, sizeof(BenchRun));
+    run->scene = scene;
+    run->backend = backend;
+    run->width = width;
+    run->height = height;
+    run->num_frames = num_frames;
+    for (int s = 0; s < BENCH_STAGES; s++) {
+        run->samples[s] = (float*)calloc(num_frames > 0 ? num_frames : 1, sizeof(float));
+        if (!run->samples[s]) {
+            fprintf(stderr, "Failed to allocate benchmark samples\n");
+            for (int i = 0; i < s; i++) free(run->samples[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void bench_run_destroy(BenchRun *run) {
+    for (int s = 0; s < BENCH_STAGES; s++) free(run->samples[s]);
+    memset(run, 0, sizeof(BenchRun));
+}
+
+// stage_ns holds the time of each stage of one frame, 0 for stages the
+// backend doesn't have
+void bench_run_record(BenchRun *run, const long long stage_ns[BENCH_STAGES], size_t bytes_written) {
+    if (run->frames >= run->num_frames) return;
+    for (int s = 0; s < BENCH_STAGES; s++) {
+        run->samples[s][run->frames] = stage_ns[s] / 1e6f;
+        run->total_ms += stage_ns[s] / 1e6;
+    }
+    run->bytes_written += bytes_written;
+    run->frames++;
+}
+
+static int bench_compare_float(const void *a, const void *b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+BenchSummary bench_summarize(const BenchRun *run, int stage) {
+    BenchSummary summary = {0, 0, 0};
+    int n = run->frames;
+    if (n == 0) return summary;
+    float *sorted = (float*)malloc(n * sizeof(float));
+    if (!sorted) return summary;
+    memcpy(sorted, run->samples[stage], n * sizeof(float));
+    qsort(sorted, n, sizeof(float), bench_compare_float);
+
+    summary.min_ms = sorted[0];
+    summary.median_ms = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) * 0.5;
+    // Nearest rank: the smallest sample at least 99% of them are under
+    int rank = (int)((n * 99 + 99) / 100);
+    summary.p99_ms = sorted[rank - 1];
+    free(sorted);
+    return summary;
+}
+
+static double bench_fps(const BenchRun *run) {
+    return run->total_ms > 0 ? run->frames * 1000.0 / run->total_ms : 0;
+}
+
+static double bench_mb_per_s(const BenchRun *run) {
+    return run->total_ms > 0 ? run->bytes_written / 1e6 / (run->total_ms / 1000.0) : 0;
+}
+
+// Prints a string for JSON, escaping what has to be
+static void bench_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; s && *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(out, "\\u%04x", *s);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+// info is a list of name/value string pairs describing the machine and
+// settings, ending with a NULL name
+void bench_write_json(FILE *out, const char *const *info, const BenchRun *runs, int num_runs) {
+    fprintf(out, "{\n");
+    for (int i = 0; info[i * 2]; i++) {
+        fprintf(out, "  ");
+        bench_json_string(out, info[i * 2]);
+        fprintf(out, ": ");
+        bench_json_string(out, info[i * 2 + 1]);
+        fprintf(out, ",\n");
+    }
+    fprintf(out, "  \"runs\": [\n");
+    for (int r = 0; r < num_runs; r++) {
+        const BenchRun *run = &runs[r];
+        fprintf(out, "    {\"scene\": ");
+        bench_json_string(out, run->scene);
+        fprintf(out, ", \"backend\": ");
+        bench_json_string(out, run->backend);
+        fprintf(out, ", \"width\": %d, \"height\": %d, \"frames\": %d, \"fps\": %.2f, \"mb_per_s\": %.2f,\n",
+                run->width, run->height, run->frames, bench_fps(run), bench_mb_per_s(run));
+        fprintf(out, "     \"stages\": {");
+        for (int s = 0; s < BENCH_STAGES; s++) {
+            BenchSummary summary = bench_summarize(run, s);
+            fprintf(out, "%s\"%s\": {\"min_ms\": %.4f, \"median_ms\": %.4f, \"p99_ms\": %.4f}",
+                    s ? ", " : "", bench_stage_names[s], summary.min_ms, summary.median_ms, summary.p99_ms);
+        }
+        fprintf(out, "}}%s\n", r + 1 < num_runs ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+// One row per stage of every run, the run's totals repeated on each
+void bench_write_csv(FILE *out, const BenchRun *runs, int num_runs) {
+    fprintf(out, "scene,backend,width,height,frames,fps,mb_per_s,stage,min_ms,median_ms,p99_ms\n");
+    for (int r = 0; r < num_runs; r++) {
+        const BenchRun *run = &runs[r];
+        for (int s = 0; s < BENCH_STAGES; s++) {
+            BenchSummary summary = bench_summarize(run, s);
+            fprintf(out, "%s,%s,%d,%d,%d,%.2f,%.2f,%s,%.4f,%.4f,%.4f\n", run->scene, run->backend,
+                    run->width, run->height, run->frames, bench_fps(run), bench_mb_per_s(run),
+                    bench_stage_names[s], summary.min_ms, summary.median_ms, summary.p99_ms);
+        }
+    }
+}
+
+#endif // BENCH_H
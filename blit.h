@@ -0,0 +1,774 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/fb.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLIT_X86 1
+#endif
+
+// Framebuffer blitting
+// The rendered image is always RGBA bytes with the bottom row first
+// (that's what glReadPixels gives us). The framebuffer can be pretty
+// much anything, so blitter_init() looks at fb_var_screeninfo once and
+// picks a row function for that exact layout. Copying a frame is then
+// just one call per row, no per-pixel format checks
+//
+// With damage tracking on, the blitter also keeps the last frame it
+// wrote and only converts the span of each row that actually changed.
+// Framebuffer memory is often uncached or write-combined, so reading
+// our own copy and skipping the writes is a lot cheaper than rewriting
+// the whole screen around a model that covers a fraction of it
+//
+// The image can also be smaller than the screen by an integer scale.
+// Nearest upscaling converts each source row once, replicates the pixels
+// in framebuffer format and writes the result to scale rows. Bilinear
+// filters every output pixel, so it costs about as much as a full
+// resolution copy and always writes the whole frame
+//
+// A renderer that can produce the framebuffer's own pixel format (GL
+// reading back BGRA or RGB565, rendered upside down) can switch the
+// blitter to native input. Rows are then top first and only get copied.
+// Native input is always scaled nearest, bilinear needs RGBA to filter
+
+enum {
+    BLIT_FILTER_NEAREST,
+    BLIT_FILTER_BILINEAR,
+};
+
+struct Blitter;
+typedef void (*blit_row_fn)(const struct Blitter *b, uint8_t *dst, const uint8_t *src, int width);
+// Repeats count pixels scale times each, may write up to 3 pixels past the end
+typedef void (*blit_replicate_fn)(uint8_t *dst, const uint8_t *src, int count, int scale, int bytes_per_pixel);
+
+typedef struct Blitter {
+    blit_row_fn row;
+    const char *name;
+
+    // Visible framebuffer
+    int fb_width;
+    int fb_height;
+    int line_length;
+    int bytes_per_pixel;
+
+    // For the generic paths: every channel is cut down to its length
+    // and moved to its offset. R, G, B, A order
+    int drop[4];
+    int shift[4];
+
+    // Input is already in framebuffer format, top row first
+    int native;
+
+    // pshufb control for layouts where every channel is a whole byte
+    // Same pattern for every pixel, repeated over 32 bytes
+    uint8_t shuffle[32];
+
+    // Upscaling
+    int scale; // Framebuffer pixels per image pixel, both ways
+    int filter;
+    blit_replicate_fn replicate;
+    uint8_t *scratch; // One converted source row
+    uint8_t *scratch_wide; // One scaled row, room for 2 * fb_width + padding
+    uint16_t *scratch_vertical; // Bilinear: a source row blended with the next one
+    int *bilinear_x; // Bilinear: sample position of every output column
+
+    // Damage tracking
+    int track_damage;
+    unsigned char *previous; // Last frame written, same layout as the input
+    int previous_width;
+    int previous_height;
+    int previous_valid; // Cleared when the screen may not match previous
+    size_t bytes_written; // Framebuffer bytes written by the last copy
+} Blitter;
+
+// Generic paths, any bit layout
+
+static inline uint32_t blit_pack_pixel(const Blitter *b, const uint8_t *src) {
+    return ((uint32_t)(src[0] >> b->drop[0]) << b->shift[0]) |
+           ((uint32_t)(src[1] >> b->drop[1]) << b->shift[1]) |
+           ((uint32_t)(src[2] >> b->drop[2]) << b->shift[2]) |
+           ((uint32_t)(src[3] >> b->drop[3]) << b->shift[3]);
+}
+
+static void blit_row_generic32(const Blitter *b, uint8_t *dst, const uint8_t *src, int width) {
+    uint32_t *out = (uint32_t*)dst;
+    for (int x = 0; x < width; x++) {
+        out[x] = blit_pack_pixel(b, src + x * 4);
+    }
+}
+
+static void blit_row_generic24(const Blitter *b, uint8_t *dst, const uint8_t *src, int width) {
+    for (int x = 0; x < width; x++) {
+        uint32_t value = blit_pack_pixel(b, src + x * 4);
+        dst[x * 3] = value;
+        dst[x * 3 + 1] = value >> 8;
+        dst[x * 3 + 2] = value >> 16;
+    }
+}
+
+static void blit_row_generic16(const Blitter *b, uint8_t *dst, const uint8_t *src, int width) {
+    uint16_t *out = (uint16_t*)dst;
+    for (int x = 0; x < width; x++) {
+        out[x] = (uint16_t)blit_pack_pixel(b, src + x * 4);
+    }
+}
+
+// Native input, nothing to convert
+static void blit_row_native(const Blitter *b, uint8_t *dst, const uint8_t *src, int width) {
+    memcpy(dst, src, (size_t)width * b->bytes_per_pixel);
+}
+
+// Framebuffer is RGBA (or RGBX) already
+static void blit_row_memcpy(const Blitter *b, uint8_t *dst, const uint8_t *src, int width) {
+    memcpy(dst, src, (size_t)width * 4);
+}
+
+#ifdef BLIT_X86
+// Byte-aligned 32bpp layouts (BGRA, ARGB, XRGB...), 4 or 8 pixels per shuffle
+__attribute__((target("ssse3")))
+static void blit_row_shuffle32_ssse3(const Blitter *b, uint8_t *dst, const uint8_t *src, int width) {
+    __m128i control = _mm_loadu_si128((const __m128i*)b->shuffle);
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i in = _mm_loadu_si128((const __m128i*)(src + x * 4));
+        _mm_storeu_si128((__m128i*)(dst + x * 4), _mm_shuffle_epi8(in, control));
+    }
+    blit_row_generic32(b, dst + x * 4, src + x * 4, width - x);
+}
+
+__attribute__((target("avx2")))
+static void blit_row_shuffle32_avx2(const Blitter *b, uint8_t *dst, const uint8_t *src, int width) {
+    __m256i control = _mm256_loadu_si256((const __m256i*)b->shuffle);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i in = _mm256_loadu_si256((const __m256i*)(src + x * 4));
+        _mm256_storeu_si256((__m256i*)(dst + x * 4), _mm256_shuffle_epi8(in, control));
+    }
+    blit_row_generic32(b, dst + x * 4, src + x * 4, width - x);
+}
+
+// Byte-aligned 24bpp, 4 pixels in, 12 bytes out
+// Every store writes 16 bytes, the extra 4 get overwritten by the next
+// one, so the loop stops early enough to stay inside the row
+__attribute__((target("ssse3")))
+static void blit_row_pack24_ssse3(const Blitter *b, uint8_t *dst, const uint8_t *src, int width) {
+    __m128i control = _mm_loadu_si128((const __m128i*)b->shuffle);
+    int x = 0;
+    for (; x + 6 <= width; x += 4) {
+        __m128i in = _mm_loadu_si128((const __m128i*)(src + x * 4));
+        _mm_storeu_si128((__m128i*)(dst + x * 3), _mm_shuffle_epi8(in, control));
+    }
+    blit_row_generic24(b, dst + x * 3, src + x * 4, width - x);
+}
+
+// RGB565, 8 pixels at a time
+__attribute__((target("sse2")))
+static void blit_row_565_sse2(const Blitter *b, uint8_t *dst, const uint8_t *src, int width) {
+    const __m128i byte = _mm_set1_epi32(0xff);
+    const __m128i bias = _mm_set1_epi32(0x8000);
+    const __m128i unbias = _mm_set1_epi16((short)0x8000);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i packed[2];
+        for (int h = 0; h < 2; h++) {
+            __m128i in = _mm_loadu_si128((const __m128i*)(src + (x + h * 4) * 4));
+            __m128i r = _mm_and_si128(in, byte);
+            __m128i g = _mm_and_si128(_mm_srli_epi32(in, 8), byte);
+            __m128i bl = _mm_and_si128(_mm_srli_epi32(in, 16), byte);
+            __m128i value = _mm_or_si128(_mm_or_si128(
+                _mm_slli_epi32(_mm_srli_epi32(r, 3), 11),
+                _mm_slli_epi32(_mm_srli_epi32(g, 2), 5)),
+                _mm_srli_epi32(bl, 3));
+            // packs saturates signed values, so shift the range down first
+            packed[h] = _mm_sub_epi32(value, bias);
+        }
+        __m128i out = _mm_xor_si128(_mm_packs_epi32(packed[0], packed[1]), unbias);
+        _mm_storeu_si128((__m128i*)(dst + x * 2), out);
+    }
+    blit_row_generic16(b, dst + x * 2, src + x * 4, width - x);
+}
+#endif
+
+// Pixel replication for nearest upscaling, works on converted pixels
+static void blit_replicate_generic(uint8_t *dst, const uint8_t *src, int count, int scale, int bytes_per_pixel) {
+    for (int x = 0; x < count; x++) {
+        for (int i = 0; i < scale; i++) {
+            memcpy(dst, src, bytes_per_pixel);
+            dst += bytes_per_pixel;
+        }
+        src += bytes_per_pixel;
+    }
+}
+
+#ifdef BLIT_X86
+__attribute__((target("sse2")))
+static void blit_replicate32_sse2(uint8_t *dst, const uint8_t *src, int count, int scale, int bytes_per_pixel) {
+    const uint32_t *in = (const uint32_t*)src;
+    if (scale == 2) {
+        int x = 0;
+        for (; x + 4 <= count; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(in + x));
+            _mm_storeu_si128((__m128i*)(dst + x * 8), _mm_unpacklo_epi32(v, v));
+            _mm_storeu_si128((__m128i*)(dst + x * 8 + 16), _mm_unpackhi_epi32(v, v));
+        }
+        blit_replicate_generic(dst + x * 8, src + x * 4, count - x, 2, 4);
+        return;
+    }
+
+    // Broadcast every pixel and store it 4 at a time. The last store of
+    // a pixel can spill into the next one's, which then overwrites it
+    for (int x = 0; x < count; x++) {
+        __m128i v = _mm_set1_epi32((int)in[x]);
+        uint8_t *out = dst + (size_t)x * scale * 4;
+        for (int i = 0; i < scale; i += 4) {
+            _mm_storeu_si128((__m128i*)(out + i * 4), v);
+        }
+    }
+}
+#endif
+
+static int blit_channel_is_byte(const struct fb_bitfield *field) {
+    return field->length == 8 && field->offset % 8 == 0 && !field->msb_right;
+}
+
+void blitter_destroy(Blitter *b);
+
+// Picks the row function for this framebuffer, returns -1 if the
+// pixel format isn't supported
+int blitter_init(Blitter *b, const struct fb_var_screeninfo *vinfo, const struct fb_fix_screeninfo *finfo) {
+    memset(b, 0, sizeof(Blitter));
+    b->fb_width = vinfo->xres;
+    b->fb_height = vinfo->yres;
+    b->line_length = finfo->line_length;
+    b->bytes_per_pixel = vinfo->bits_per_pixel / 8;
+
+    b->scale = 1;
+    b->filter = BLIT_FILTER_NEAREST;
+    b->replicate = blit_replicate_generic;
+    b->scratch = (uint8_t*)malloc((size_t)b->fb_width * 4 + 64);
+    b->scratch_wide = (uint8_t*)malloc(((size_t)b->fb_width * 2 + 16) * 4);
+    b->scratch_vertical = (uint16_t*)malloc((size_t)b->fb_width * 4 * sizeof(uint16_t));
+    b->bilinear_x = (int*)malloc((size_t)b->fb_width * sizeof(int));
+    if (!b->scratch || !b->scratch_wide || !b->scratch_vertical || !b->bilinear_x) {
+        fprintf(stderr, "Failed to allocate blit buffers\n");
+        blitter_destroy(b);
+        return -1;
+    }
+
+    const struct fb_bitfield *fields[4] = {&vinfo->red, &vinfo->green, &vinfo->blue, &vinfo->transp};
+    for (int c = 0; c < 4; c++) {
+        int length = fields[c]->length > 8 ? 8 : fields[c]->length;
+        // A missing channel (usually alpha) just packs to nothing
+        b->drop[c] = length ? 8 - length : 8;
+        b->shift[c] = length ? fields[c]->offset + fields[c]->length - length : 0;
+    }
+
+    int byte_aligned = blit_channel_is_byte(&vinfo->red) &&
+                       blit_channel_is_byte(&vinfo->green) &&
+                       blit_channel_is_byte(&vinfo->blue) &&
+                       (vinfo->transp.length == 0 || blit_channel_is_byte(&vinfo->transp));
+
+    // Where every framebuffer byte comes from, 0x80 zeroes it
+    if (byte_aligned) {
+        int bpp = b->bytes_per_pixel;
+        int pixels_per_16 = bpp == 3 ? 4 : 16 / bpp;
+        memset(b->shuffle, 0x80, sizeof(b->shuffle));
+        for (int p = 0; p < pixels_per_16 * 2 && p * bpp < 32; p++) {
+            for (int c = 0; c < 4; c++) {
+                if (fields[c]->length == 0) continue;
+                int out = p * bpp + fields[c]->offset / 8;
+                // pshufb works within 16 byte lanes
+                if (out < 32 && out / 16 == p / pixels_per_16) {
+                    b->shuffle[out] = (p % pixels_per_16) * 4 + c;
+                }
+            }
+        }
+    }
+
+#ifdef BLIT_X86
+    __builtin_cpu_init();
+    int has_sse2 = __builtin_cpu_supports("sse2");
+    int has_ssse3 = __builtin_cpu_supports("ssse3");
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    if (b->bytes_per_pixel == 4 && has_sse2) {
+        b->replicate = blit_replicate32_sse2;
+    }
+#endif
+
+    switch (vinfo->bits_per_pixel) {
+        case 32:
+            if (byte_aligned && vinfo->red.offset == 0 && vinfo->green.offset == 8 &&
+                vinfo->blue.offset == 16 && (vinfo->transp.length == 0 || vinfo->transp.offset == 24)) {
+                b->row = blit_row_memcpy;
+                b->name = "memcpy";
+                return 0;
+            }
+#ifdef BLIT_X86
+            if (byte_aligned && has_avx2) {
+                b->row = blit_row_shuffle32_avx2;
+                b->name = "shuffle32 avx2";
+                return 0;
+            }
+            if (byte_aligned && has_ssse3) {
+                b->row = blit_row_shuffle32_ssse3;
+                b->name = "shuffle32 ssse3";
+                return 0;
+            }
+#endif
+            b->row = blit_row_generic32;
+            b->name = "generic32";
+            return 0;
+        case 24:
+#ifdef BLIT_X86
+            if (byte_aligned && has_ssse3) {
+                b->row = blit_row_pack24_ssse3;
+                b->name = "pack24 ssse3";
+                return 0;
+            }
+#endif
+            b->row = blit_row_generic24;
+            b->name = "generic24";
+            return 0;
+        case 16:
+#ifdef BLIT_X86
+            if (has_sse2 && vinfo->red.offset == 11 && vinfo->red.length == 5 &&
+                vinfo->green.offset == 5 && vinfo->green.length == 6 &&
+                vinfo->blue.offset == 0 && vinfo->blue.length == 5) {
+                b->row = blit_row_565_sse2;
+                b->name = "rgb565 sse2";
+                return 0;
+            }
+#endif
+            b->row = blit_row_generic16;
+            b->name = "generic16";
+            return 0;
+    }
+
+    fprintf(stderr, "Unsupported framebuffer format: %d bits per pixel\n", vinfo->bits_per_pixel);
+    blitter_destroy(b);
+    return -1;
+}
+
+// Next copy_to_framebuffer() writes everything again
+void blitter_invalidate(Blitter *b) {
+    b->previous_valid = 0;
+}
+
+// Images handed to copy_to_framebuffer() are scale times smaller than
+// the screen (rounded up)
+void blitter_set_scale(Blitter *b, int scale, int filter) {
+    if (scale < 1) scale = 1;
+    if (scale > b->fb_width) scale = b->fb_width;
+    if (scale != b->scale || filter != b->filter) {
+        b->previous_valid = 0;
+    }
+    b->scale = scale;
+    b->filter = filter;
+
+    // Sample positions in 1/256 of a source pixel, at output pixel centers
+    for (int x = 0; x < b->fb_width; x++) {
+        int sx = ((2 * x + 1) * 256) / (2 * scale) - 128;
+        b->bilinear_x[x] = sx > 0 ? sx : 0;
+    }
+}
+
+// Switches between RGBA bottom up input and native input
+void blitter_set_native(Blitter *b, int native) {
+    if (native != b->native) {
+        // The saved frame is in the other layout
+        free(b->previous);
+        b->previous = NULL;
+        b->previous_width = 0;
+        b->previous_height = 0;
+        b->previous_valid = 0;
+    }
+    b->native = native;
+}
+
+void blitter_destroy(Blitter *b) {
+    free(b->previous);
+    free(b->scratch);
+    free(b->scratch_wide);
+    free(b->scratch_vertical);
+    free(b->bilinear_x);
+    b->previous = NULL;
+    b->scratch = NULL;
+    b->scratch_wide = NULL;
+    b->scratch_vertical = NULL;
+    b->bilinear_x = NULL;
+    b->previous_valid = 0;
+}
+
+// Finds the pixels [*first, *last) where two rows differ
+// Returns 0 if they're the same
+static int blit_diff_span(const uint8_t *a, const uint8_t *b, int width, int bytes_per_pixel, int *first, int *last) {
+    size_t bytes = (size_t)width * bytes_per_pixel;
+    if (memcmp(a, b, bytes) == 0) return 0;
+
+    if (bytes_per_pixel != 4) {
+        size_t x0 = 0;
+        while (a[x0] == b[x0]) x0++;
+        size_t x1 = bytes;
+        while (a[x1 - 1] == b[x1 - 1]) x1--;
+        *first = x0 / bytes_per_pixel;
+        *last = (x1 + bytes_per_pixel - 1) / bytes_per_pixel;
+        return 1;
+    }
+
+    const uint32_t *pa = (const uint32_t*)a;
+    const uint32_t *pb = (const uint32_t*)b;
+    int x0 = 0;
+    while (pa[x0] == pb[x0]) x0++;
+    int x1 = width;
+    while (pa[x1 - 1] == pb[x1 - 1]) x1--;
+    *first = x0;
+    *last = x1;
+    return 1;
+}
+
+// Converts source pixels [first, last) of a row and writes them to rows
+// framebuffer rows, scaled up. Returns the number of bytes written
+static size_t blit_scaled_span(Blitter *b, uint8_t *dst, int rows, const uint8_t *src, int first, int last, int out_width) {
+    int bpp = b->bytes_per_pixel;
+    int src_bpp = b->native ? bpp : 4;
+    blit_row_fn row = b->native ? blit_row_native : b->row;
+    if (b->scale == 1) {
+        row(b, dst + first * bpp, src + first * src_bpp, last - first);
+        return (size_t)(last - first) * bpp;
+    }
+
+    // Convert at the low resolution, then widen the converted pixels
+    int out_first = first * b->scale;
+    int out_last = last * b->scale < out_width ? last * b->scale : out_width;
+    const uint8_t *converted = src + first * src_bpp;
+    if (!b->native) {
+        b->row(b, b->scratch, converted, last - first);
+        converted = b->scratch;
+    }
+    b->replicate(b->scratch_wide, converted, last - first, b->scale, bpp);
+
+    size_t bytes = (size_t)(out_last - out_first) * bpp;
+    for (int r = 0; r < rows; r++) {
+        memcpy(dst + (size_t)r * b->line_length + out_first * bpp, b->scratch_wide, bytes);
+    }
+    return bytes * rows;
+}
+
+// Bilinear upscale, one output row at a time
+// Blends the two source rows vertically first, then across
+static size_t blit_bilinear(Blitter *b, const unsigned char *pixels, int width, int height,
+                            int out_width, int out_height, char *fbp) {
+    int scale = b->scale;
+    size_t stride = (size_t)width * 4;
+    uint16_t *vertical = b->scratch_vertical;
+    uint8_t *line = b->scratch_wide;
+    int draw_width = (out_width + scale - 1) / scale;
+    int last_x = draw_width < width ? draw_width : width - 1;
+
+    for (int y = 0; y < out_height; y++) {
+        int sy = ((2 * y + 1) * 256) / (2 * scale) - 128;
+        if (sy < 0) sy = 0;
+        int y0 = sy >> 8;
+        int y1 = y0 + 1 < height ? y0 + 1 : height - 1;
+        int fy = sy & 255;
+        // Bottom row first, so image row y is height - 1 - y in memory
+        const uint8_t *row0 = pixels + (size_t)(height - 1 - y0) * stride;
+        const uint8_t *row1 = pixels + (size_t)(height - 1 - y1) * stride;
+
+        // One extra pixel for the right edge samples
+        for (int i = 0; i < (last_x + 1) * 4; i++) {
+            vertical[i] = row0[i] * (256 - fy) + row1[i] * fy;
+        }
+
+        for (int x = 0; x < out_width; x++) {
+            int sx = b->bilinear_x[x];
+            int x0 = sx >> 8;
+            int x1 = x0 + 1 <= last_x ? x0 + 1 : last_x;
+            int fx = sx & 255;
+            for (int c = 0; c < 4; c++) {
+                uint32_t v = vertical[x0 * 4 + c] * (256 - fx) + vertical[x1 * 4 + c] * fx;
+                line[x * 4 + c] = (v + (1 << 15)) >> 16;
+            }
+        }
+        b->row(b, (uint8_t*)fbp + (size_t)y * b->line_length, line, out_width);
+    }
+    return (size_t)out_width * b->bytes_per_pixel * out_height;
+}
+
+// Copy rendered pixels to framebuffer with proper format conversion
+// Flips vertically, since the image comes bottom row first (unless the
+// input is native)
+void copy_to_framebuffer(Blitter *b, const unsigned char *pixels, int width, int height, char *fbp) {
+    int scale = b->scale;
+
+    // Calculate how much of the image to draw (don't exceed framebuffer dimensions)
+    int out_width = (width * scale < b->fb_width) ? width * scale : b->fb_width;
+    int out_height = (height * scale < b->fb_height) ? height * scale : b->fb_height;
+    int draw_width = (out_width + scale - 1) / scale;
+    int draw_height = (out_height + scale - 1) / scale;
+    int src_bpp = b->native ? b->bytes_per_pixel : 4;
+    size_t stride = (size_t)width * src_bpp;
+
+    if (scale > 1 && b->filter == BLIT_FILTER_BILINEAR && !b->native) {
+        b->bytes_written = blit_bilinear(b, pixels, width, height, out_width, out_height, fbp);
+        b->previous_valid = 0;
+        return;
+    }
+
+    if (b->track_damage && (b->previous_width != width || b->previous_height != height)) {
+        free(b->previous);
+        b->previous = (unsigned char*)malloc(stride * height);
+        b->previous_width = width;
+        b->previous_height = height;
+        b->previous_valid = 0;
+    }
+
+    // Without anything to compare against, write it all (and remember it)
+    int full = !b->track_damage || !b->previous || !b->previous_valid;
+    if (b->track_damage && b->previous && !b->previous_valid) {
+        memcpy(b->previous, pixels, stride * height);
+        b->previous_valid = 1;
+    }
+
+    // Start at the top row and walk down (native) or up (RGBA) from it
+    size_t top = b->native ? 0 : (size_t)(height - 1) * stride;
+    ptrdiff_t step = b->native ? (ptrdiff_t)stride : -(ptrdiff_t)stride;
+    const uint8_t *src = pixels + top;
+    uint8_t *prev = full ? NULL : b->previous + top;
+    uint8_t *dst = (uint8_t*)fbp;
+    size_t written = 0;
+    for (int y = 0; y < draw_height; y++) {
+        int rows = out_height - y * scale < scale ? out_height - y * scale : scale;
+        int first = 0, last = draw_width;
+        if (full || blit_diff_span(src, prev, draw_width, src_bpp, &first, &last)) {
+            written += blit_scaled_span(b, dst, rows, src, first, last, out_width);
+            if (!full) {
+                memcpy(prev + first * src_bpp, src + first * src_bpp, (size_t)(last - first) * src_bpp);
+            }
+        }
+        src += step;
+        if (prev) prev += step;
+        dst += (size_t)b->line_length * rows;
+    }
+    b->bytes_written = written;
+}
+
+// Times every row function that can handle a few common framebuffer
+// layouts at 1920x1080, and checks them against the generic path
+void blit_benchmark() {
+    static const struct {
+        const char *name;
+        int bpp;
+        struct fb_bitfield red, green, blue, transp;
+    } formats[] = {
+        {"RGBA8888", 32, {0, 8, 0}, {8, 8, 0}, {16, 8, 0}, {24, 8, 0}},
+        {"XRGB8888", 32, {16, 8, 0}, {8, 8, 0}, {0, 8, 0}, {0, 0, 0}},
+        {"ARGB8888", 32, {16, 8, 0}, {8, 8, 0}, {0, 8, 0}, {24, 8, 0}},
+        {"RGB888", 24, {16, 8, 0}, {8, 8, 0}, {0, 8, 0}, {0, 0, 0}},
+        {"RGB565", 16, {11, 5, 0}, {5, 6, 0}, {0, 5, 0}, {0, 0, 0}},
+    };
+    const int width = 1920, height = 1080;
+    const double min_seconds = 0.5;
+
+    unsigned char *pixels = (unsigned char*)malloc((size_t)width * height * 4);
+    char *fb = (char*)malloc((size_t)width * height * 4);
+    char *reference = (char*)malloc((size_t)width * height * 4);
+    if (!pixels || !fb || !reference) {
+        fprintf(stderr, "Failed to set up the blit benchmark\n");
+        free(pixels);
+        free(fb);
+        free(reference);
+        return;
+    }
+    unsigned int seed = 1;
+    for (size_t i = 0; i < (size_t)width * height * 4; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        pixels[i] = seed >> 24;
+    }
+
+    printf("Blit benchmark: %dx%d\n", width, height);
+    printf("%-10s %-16s %10s %10s %s\n", "format", "row function", "ms/frame", "MB/s", "output");
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        struct fb_var_screeninfo vinfo;
+        struct fb_fix_screeninfo finfo;
+        memset(&vinfo, 0, sizeof(vinfo));
+        memset(&finfo, 0, sizeof(finfo));
+        vinfo.xres = width;
+        vinfo.yres = height;
+        vinfo.bits_per_pixel = formats[f].bpp;
+        vinfo.red = formats[f].red;
+        vinfo.green = formats[f].green;
+        vinfo.blue = formats[f].blue;
+        vinfo.transp = formats[f].transp;
+        finfo.line_length = width * formats[f].bpp / 8;
+        size_t frame_bytes = (size_t)finfo.line_length * height;
+
+        Blitter blitter;
+        if (blitter_init(&blitter, &vinfo, &finfo) < 0) continue;
+
+        // What the plain per-pixel path would write
+        Blitter generic = blitter;
+        generic.row = formats[f].bpp == 32 ? blit_row_generic32 :
+                      formats[f].bpp == 24 ? blit_row_generic24 : blit_row_generic16;
+        copy_to_framebuffer(&generic, pixels, width, height, reference);
+
+        // Then the same frame handed over already converted and top row
+        // first, like a native GL readback, which only has to be copied
+        for (int native = 0; native < 2; native++) {
+            blitter_set_native(&blitter, native);
+            const unsigned char *input = native ? (const unsigned char*)reference : pixels;
+            memset(fb, 0, frame_bytes);
+
+            struct timespec start, end;
+            double seconds = 0;
+            int frames = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            while (seconds < min_seconds) {
+                copy_to_framebuffer(&blitter, input, width, height, fb);
+                frames++;
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            }
+
+            printf("%-10s %-16s %10.3f %10.0f %s\n", formats[f].name, native ? "native" : blitter.name,
+                   seconds * 1000.0 / frames, frame_bytes * frames / seconds / 1e6,
+                   memcmp(fb, reference, frame_bytes) == 0 ? "matches generic" : "MISMATCH");
+        }
+        blitter_destroy(&blitter);
+    }
+
+    // Damage tracking, with a 400x400 square changing every frame
+    // (about what the spinning model covers) on an XRGB8888 screen
+    {
+        struct fb_var_screeninfo vinfo;
+        struct fb_fix_screeninfo finfo;
+        memset(&vinfo, 0, sizeof(vinfo));
+        memset(&finfo, 0, sizeof(finfo));
+        vinfo.xres = width;
+        vinfo.yres = height;
+        vinfo.bits_per_pixel = 32;
+        vinfo.red = formats[1].red;
+        vinfo.green = formats[1].green;
+        vinfo.blue = formats[1].blue;
+        finfo.line_length = width * 4;
+        size_t frame_bytes = (size_t)finfo.line_length * height;
+
+        unsigned char *other = (unsigned char*)malloc((size_t)width * height * 4);
+        Blitter blitter;
+        if (other && blitter_init(&blitter, &vinfo, &finfo) == 0) {
+            memcpy(other, pixels, (size_t)width * height * 4);
+            for (int y = 340; y < 740; y++) {
+                for (int x = 760 * 4; x < 1160 * 4; x++) {
+                    other[(size_t)y * width * 4 + x] ^= 0xff;
+                }
+            }
+            blitter.track_damage = 1;
+
+            struct timespec start, end;
+            double seconds = 0;
+            int frames = 0;
+            size_t written = 0;
+            copy_to_framebuffer(&blitter, pixels, width, height, fb);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            while (seconds < min_seconds || frames % 2) {
+                copy_to_framebuffer(&blitter, frames % 2 ? pixels : other, width, height, fb);
+                written += blitter.bytes_written;
+                frames++;
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            }
+
+            // The last frame was pixels again
+            Blitter generic = blitter;
+            generic.track_damage = 0;
+            generic.row = blit_row_generic32;
+            copy_to_framebuffer(&generic, pixels, width, height, reference);
+            printf("%-10s %-16s %10.3f %10s %s, %.0f KB written per frame\n", "damage", blitter.name,
+                   seconds * 1000.0 / frames, "-",
+                   memcmp(fb, reference, frame_bytes) == 0 ? "matches generic" : "MISMATCH",
+                   written / 1024.0 / frames);
+            blitter_destroy(&blitter);
+        }
+        free(other);
+    }
+
+    // Upscaling a smaller image to XRGB8888. Nearest is checked against
+    // the same image scaled up beforehand and copied 1:1
+    static const struct { int scale; int filter; } scalings[] = {
+        {2, BLIT_FILTER_NEAREST}, {3, BLIT_FILTER_NEAREST}, {4, BLIT_FILTER_NEAREST},
+        {8, BLIT_FILTER_NEAREST}, {2, BLIT_FILTER_BILINEAR},
+    };
+    unsigned char *upscaled = (unsigned char*)malloc((size_t)width * height * 4);
+    for (size_t i = 0; upscaled && i < sizeof(scalings) / sizeof(scalings[0]); i++) {
+        struct fb_var_screeninfo vinfo;
+        struct fb_fix_screeninfo finfo;
+        memset(&vinfo, 0, sizeof(vinfo));
+        memset(&finfo, 0, sizeof(finfo));
+        vinfo.xres = width;
+        vinfo.yres = height;
+        vinfo.bits_per_pixel = 32;
+        vinfo.red = formats[1].red;
+        vinfo.green = formats[1].green;
+        vinfo.blue = formats[1].blue;
+        finfo.line_length = width * 4;
+        size_t frame_bytes = (size_t)finfo.line_length * height;
+
+        Blitter blitter;
+        if (blitter_init(&blitter, &vinfo, &finfo) < 0) continue;
+        int scale = scalings[i].scale;
+        blitter_set_scale(&blitter, scale, scalings[i].filter);
+        int small_width = (width + scale - 1) / scale;
+        int small_height = (height + scale - 1) / scale;
+
+        const char *output = "-";
+        if (scalings[i].filter == BLIT_FILTER_NEAREST) {
+            // Rows are stored bottom up in both images
+            for (int y = 0; y < height; y++) {
+                const uint8_t *src = pixels + (size_t)(small_height - 1 - y / scale) * small_width * 4;
+                uint8_t *dst = upscaled + (size_t)(height - 1 - y) * width * 4;
+                for (int x = 0; x < width; x++) {
+                    memcpy(dst + x * 4, src + (x / scale) * 4, 4);
+                }
+            }
+            Blitter generic = blitter;
+            generic.row = blit_row_generic32;
+            generic.scale = 1;
+            copy_to_framebuffer(&generic, upscaled, width, height, reference);
+        }
+
+        struct timespec start, end;
+        double seconds = 0;
+        int frames = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (seconds < min_seconds) {
+            copy_to_framebuffer(&blitter, pixels, small_width, small_height, fb);
+            frames++;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        }
+        if (scalings[i].filter == BLIT_FILTER_NEAREST) {
+            output = memcmp(fb, reference, frame_bytes) == 0 ? "matches generic" : "MISMATCH";
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "%s x%d", scalings[i].filter == BLIT_FILTER_NEAREST ? "nearest" : "bilinear", scale);
+        printf("%-10s %-16s %10.3f %10.0f %s\n", name, blitter.name,
+               seconds * 1000.0 / frames, frame_bytes * frames / seconds / 1e6, output);
+        blitter_destroy(&blitter);
+    }
+    free(upscaled);
+
+    free(pixels);
+    free(fb);
+    free(reference);
+}
+
+#endif // BLIT_H
@@ -113,7 +113,9 @@ camera setup_camera(camera camera)
 
 
 // Gets a pixel from the end of a ray projected to an axis
-vec4 get_pixel_from_projection(float t, int face, camera camera, vec3 focal_vector, light3 light)
+// Takes the camera and the light by pointer, so the raycaster's packets
+// don't copy both for every hit they shade
+vec4 shade_projection(float t, int face, const camera *camera, vec3 focal_vector, const light3 *light)
 {
     // If the point we end up in is behind our camera, don't "render" it
     if (t < 1)
@@ -122,13 +124,13 @@ vec4 get_pixel_from_projection(float t, int face, camera camera, vec3 focal_vect
     }
 
     // Then we multiply our focal vector by t and add our focal point to it 
-    vec3 intersection = add_vec3(scale_vec3(focal_vector, t), camera.focal_point);
+    vec3 intersection = add_vec3(scale_vec3(focal_vector, t), camera->focal_point);
     
 
     // Save necessary coordinates and normal vector
     // (different cube faces need different coords)
-    vec2 cam_coords;
-    vec3 normal;
+    vec2 cam_coords = {0, 0};
+    vec3 normal = {0, 0, 0};
     switch (face) 
     {
         case 0:
@@ -186,9 +188,9 @@ vec4 get_pixel_from_projection(float t, int face, camera camera, vec3 focal_vect
     {
         // Diffuse lighting
         double base_light = 0.2;
-        vec3 incident = normalize_vec3(subtract_vec3(light.position, intersection));
-        double dot = dot_product_vec3(incident, normal);
-        vec3 diffuse = scale_vec3(light.color, (fmin(dot,0)-base_light)/(-1-base_light));
+        vec3 incident = normalize_vec3(subtract_vec3(light->position, intersection));
+        double dot = dot_vec3(incident, normal);
+        vec3 diffuse = scale_vec3(light->color, (fmin(dot,0)-base_light)/(-1-base_light));
         pixel.x *= diffuse.x;
         pixel.y *= diffuse.y;
         pixel.z *= diffuse.z;
@@ -198,8 +200,8 @@ vec4 get_pixel_from_projection(float t, int face, camera camera, vec3 focal_vect
         {
             double smoothness = 0.2;
             vec3 reflected = subtract_vec3(incident, scale_vec3(normal, 2*dot));
-            vec3 highlight = scale_vec3(light.color, 
-                    (fmax(0,dot_product_vec3(normalize_vec3(focal_vector), reflected))));
+            vec3 highlight = scale_vec3(light->color, 
+                    (fmax(0,dot_vec3(normalize_vec3(focal_vector), reflected))));
             highlight.x = pow(highlight.x, smoothness * 100);
             highlight.y = pow(highlight.y, smoothness * 100);
             highlight.z = pow(highlight.z, smoothness * 100);
@@ -215,6 +217,11 @@ vec4 get_pixel_from_projection(float t, int face, camera camera, vec3 focal_vect
     return pixel;
 }
 
+vec4 get_pixel_from_projection(float t, int face, camera camera, vec3 focal_vector, light3 light)
+{
+    return shade_projection(t, face, &camera, focal_vector, &light);
+}
+
 // Combines colors using alpha
 // Got this from https://stackoverflow.com/questions/64701745/how-to-blend-colours-with-transparency
 // Not sure how it works honestly lol
@@ -0,0 +1,133 @@
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vectors.h"
+
+// Scripted camera movement, in place of the keyboard
+// A path is a list of keys, each a time in seconds, a position and a
+// pitch and yaw in degrees (the same angles as the camera rotation in
+// main(), yaw turning left from looking down -Z). The camera moves in a
+// straight line from one key to the next and stays at the last one.
+// Together with a fixed time step this makes every run render the same
+// frames, which is what benchmarks and regression tests need
+//
+// A path file has one key per line, "time x y z pitch yaw", and lines
+// starting with # are comments. Keys have to come in order of time
+
+typedef struct CameraKey {
+    float time;
+    vec3 position;
+    float pitch;
+    float yaw;
+} CameraKey;
+
+typedef struct CameraPath {
+    CameraKey *keys;
+    unsigned int num_keys;
+    float duration; // Time of the last key
+} CameraPath;
+
+// Built in path: starts where the interactive camera does, swings around
+// to one side, moves in close, then out the other side and back
+static const CameraKey camera_path_default_keys[] = {
+    {0.0f, {0.0f, 0.0f, 3.0f}, 0.0f, 0.0f},
+    {2.0f, {0.8f, 0.3f, 2.2f}, -5.0f, 20.0f},
+    {4.0f, {0.0f, 0.0f, 1.4f}, 0.0f, 0.0f},
+    {6.0f, {-0.8f, -0.3f, 2.2f}, 5.0f, -20.0f},
+    {8.0f, {0.0f, 0.0f, 3.0f}, 0.0f, 0.0f},
+};
+
+static int camera_path_set(CameraPath *path, const CameraKey *keys, unsigned int num_keys) {
+    path->keys = (CameraKey*)malloc(num_keys * sizeof(CameraKey));
+    if (!path->keys) return -1;
+    memcpy(path->keys, keys, num_keys * sizeof(CameraKey));
+    path->num_keys = num_keys;
+    path->duration = keys[num_keys - 1].time;
+    return 0;
+}
+
+int camera_path_default(CameraPath *path) {
+    memset(path, 0, sizeof(CameraPath));
+    return camera_path_set(path, camera_path_default_keys,
+                           sizeof(camera_path_default_keys) / sizeof(camera_path_default_keys[0]));
+}
+
+// Returns -1 (after printing why) if the file can't be read or has no keys
+int camera_path_load(CameraPath *path, const char *filename) {
+    memset(path, 0, sizeof(CameraPath));
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror("Error opening camera path");
+        return -1;
+    }
+
+    CameraKey *keys = NULL;
+    unsigned int num_keys = 0, capacity = 0;
+    char line[256];
+    int line_number = 0, result = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\r' || *start == '\0') continue;
+
+        CameraKey key;
+        if (sscanf(start, "%f %f %f %f %f %f", &key.time, &key.position.x, &key.position.y, &key.position.z,
+                   &key.pitch, &key.yaw) != 6 || (num_keys > 0 && key.time < keys[num_keys - 1].time)) {
+            fprintf(stderr, "%s:%d: expected \"time x y z pitch yaw\" after the last key's time\n",
+                    filename, line_number);
+            result = -1;
+            break;
+        }
+        if (num_keys == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            CameraKey *grown = (CameraKey*)realloc(keys, capacity * sizeof(CameraKey));
+            if (!grown) {
+                fprintf(stderr, "Failed to allocate camera path\n");
+                result = -1;
+                break;
+            }
+            keys = grown;
+        }
+        keys[num_keys++] = key;
+    }
+    fclose(file);
+
+    if (result == 0 && num_keys == 0) {
+        fprintf(stderr, "%s: no keys in camera path\n", filename);
+        result = -1;
+    }
+    if (result == 0) result = camera_path_set(path, keys, num_keys);
+    free(keys);
+    return result;
+}
+
+void camera_path_destroy(CameraPath *path) {
+    free(path->keys);
+    memset(path, 0, sizeof(CameraPath));
+}
+
+// Where the camera is at time. rotation gets the pitch in x and the yaw
+// in y, in radians like main() keeps them
+void camera_path_sample(const CameraPath *path, float time, vec3 *position, vec3 *rotation) {
+    const float to_radians = 3.14159265f / 180.0f;
+    unsigned int next = 0;
+    while (next < path->num_keys && path->keys[next].time <= time) next++;
+
+    CameraKey key;
+    if (next == 0 || next == path->num_keys) {
+        key = path->keys[next == 0 ? 0 : path->num_keys - 1];
+    } else {
+        const CameraKey *a = &path->keys[next - 1], *b = &path->keys[next];
+        float t = (time - a->time) / (b->time - a->time);
+        key.position = add_vec3(a->position, scale_vec3(subtract_vec3(b->position, a->position), t));
+        key.pitch = a->pitch + (b->pitch - a->pitch) * t;
+        key.yaw = a->yaw + (b->yaw - a->yaw) * t;
+    }
+    *position = key.position;
+    *rotation = (vec3){key.pitch * to_radians, key.yaw * to_radians, 0.0f};
+}
+
+#endif // CAMERA_PATH_H
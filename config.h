@@ -1,6 +1,8 @@
-#define FB_DEVICE "/dev/fb0"
+#define FB_DEVICE "/dev/fb0" // Default for --output
+#define VIRTUAL_FB_MODE "1280x720x32" // Screen made up for --output memory, memfd or a file | WIDTHxHEIGHT[xBPP][:R,G,B offsets], same as --output-mode
 #define RENDER_OVER_TEXT 1
 #define FRAME_LIMIT 60 // 0 to deactivate
+#define FRAME_SPIN_US 500 // Busy-wait the last bit before each frame, sleeping is less precise
 #define SHADING 1
 #define SPECULAR_HIGHLIGHT 1 // SHADING has to be on for this to work
 #define SPEED 1
@@ -9,6 +11,28 @@
 #define EDGE_COLOR (vec4){1,1,1,1}
 #define SHADER checker_pattern
 #define DOWNSCALING_FACTOR 8 // Preferably a number that divides your screen dimensions | 1 for no Down
+#define DYNAMIC_RESOLUTION 1 // Change the downscaling on the fly to stay under FRAME_BUDGET_MS | DOWNSCALING_FACTOR is where it starts
+#define MAX_DOWNSCALING_FACTOR 8 // Coarsest dynamic resolution is allowed to go
+#define FRAME_BUDGET_MS 12.0 // Render time to aim for with DYNAMIC_RESOLUTION, leave some room under 1000 / FRAME_LIMIT
+#define UPSCALE_FILTER BLIT_FILTER_NEAREST // How downscaled frames get back to full size | BLIT_FILTER_BILINEAR is smoother but slower
+#define CPU_RENDERING 0 // 1 to always use the software rasterizer (same as --cpu)
+#define GL_READBACK_TARGETS 2 // Frames in flight on the GPU before reading one back, 1 reads each right away (same as --sync-readback) | max 3
+#define GL_NATIVE_READBACK 1 // Read GL frames back in the framebuffer's pixel format when the driver can, so the blit is a plain copy
+#define GL_SOFTWARE_FALLBACK 0 // Without a DRM render node, use Mesa's software GL instead of the software rasterizer
+#define OBJ_PARSER_THREADS 0 // Threads for parsing OBJ files | 0 for one per core
+#define MESH_OPTIMIZE 1 // Reorder loaded meshes for the vertex cache and less overdraw, done once and kept in the mesh cache
+#define MESH_LODS 5 // Levels of detail made for loaded meshes, each with about 1/4 of the triangles of the last | 1 for none | max 8
+#define MESH_LOD_ERROR_PIXELS 1.0f // How far on screen a simplified level may be off before a finer one is drawn
+#define FRUSTUM_CULLING 1 // Skip meshes, and 256 triangle pieces of them, that are out of view
+#define RASTER_THREADS 0 // Software rasterizer threads | 0 for one per core
+#define RASTER_HIZ 1 // Skip geometry hidden behind what's already drawn (software rasterizer)
+#define RAYCASTER_THREADS 0 // Threads for the cube raycaster (--bench) | 0 for one per core
+#define FB_DOUBLE_BUFFER 1 // Draw offscreen and flip with FBIOPAN_DISPLAY when the driver has room for two pages
+#define FB_WAIT_VSYNC 1 // Wait for vblank before flipping (needs FB_DOUBLE_BUFFER)
+#define PRESENT_QUEUE_DEPTH 1 // Frames that can wait to be shown while the next one renders | 0 to present on the render thread
+#define DAMAGE_TRACKING 1 // Only write the parts of the framebuffer that changed since the last frame
+#define TRACING 1 // Compile in trace zones, recorded with --trace file and written out on exit or SIGUSR1 | 0 leaves them out entirely
+#define STATS_INTERVAL_MS 1000 // How often --stats updates the overlay or writes a line to the log
 
 // Supported shaders:
 // solid_white
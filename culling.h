@@ -0,0 +1,194 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "vectors.h"
+
+// View frustum culling
+// The six planes are pulled straight out of a combined matrix (Gribb,
+// Hartmann 2001). Given the whole model-view-projection they come out in
+// the mesh's own space, so bounds stored at load time are tested as they
+// are, without transforming them every frame
+//
+// A mesh is tested as a whole first. Only a mesh that straddles the edge
+// of the screen gets its clusters tested: runs of CULL_CLUSTER_TRIANGLES
+// consecutive triangles of the index buffer, each with a box and a
+// sphere around it. The triangles are already in vertex cache order
+// (see mesh_optimize.h), so these runs are small patches of surface.
+// Visible clusters that follow each other are merged into one range, and
+// the ranges are the draw list both backends take
+
+#define CULL_CLUSTER_TRIANGLES 256
+
+enum {
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_INTERSECTS,
+    FRUSTUM_INSIDE
+};
+
+// Planes as (normal, distance), inside where dot(normal, p) + distance >= 0
+typedef struct Frustum {
+    vec4 planes[6];
+} Frustum;
+
+// Box and sphere around a run of triangles
+typedef struct CullCluster {
+    float bounds_min[3];
+    float bounds_max[3];
+    float center[3];
+    float radius;
+    uint32_t first_index;
+    uint32_t num_indices;
+} CullCluster;
+
+// A range of an index buffer to draw
+typedef struct DrawRange {
+    uint32_t first_index;
+    uint32_t num_indices;
+} DrawRange;
+
+typedef struct CullStats {
+    unsigned long long meshes_tested;
+    unsigned long long meshes_drawn;
+    unsigned long long clusters_tested;
+    unsigned long long clusters_drawn;
+} CullStats;
+
+// Planes of everything m maps into the clip volume
+Frustum frustum_from_matrix(mat4 m) {
+    Frustum f;
+    // Rows of the (column major) matrix
+    vec4 row[4];
+    for (int i = 0; i < 4; i++) {
+        row[i] = (vec4){m.m[i], m.m[4 + i], m.m[8 + i], m.m[12 + i]};
+    }
+    for (int i = 0; i < 3; i++) {
+        f.planes[i * 2] = add_vec4(row[3], row[i]);          // Left, bottom, near
+        f.planes[i * 2 + 1] = subtract_vec4(row[3], row[i]); // Right, top, far
+    }
+    for (int i = 0; i < 6; i++) {
+        vec4 p = f.planes[i];
+        float length = sqrtf(p.x * p.x + p.y * p.y + p.z * p.z);
+        if (length > 0.0f) f.planes[i] = scale_vec4(p, 1.0f / length);
+    }
+    return f;
+}
+
+int frustum_test_sphere(const Frustum *f, const float center[3], float radius) {
+    int result = FRUSTUM_INSIDE;
+    for (int i = 0; i < 6; i++) {
+        const vec4 *p = &f->planes[i];
+        float distance = p->x * center[0] + p->y * center[1] + p->z * center[2] + p->w;
+        if (distance < -radius) return FRUSTUM_OUTSIDE;
+        if (distance < radius) result = FRUSTUM_INTERSECTS;
+    }
+    return result;
+}
+
+// Checks the corner furthest along each plane's normal, and the one
+// furthest against it
+int frustum_test_box(const Frustum *f, const float bounds_min[3], const float bounds_max[3]) {
+    int result = FRUSTUM_INSIDE;
+    for (int i = 0; i < 6; i++) {
+        const vec4 *p = &f->planes[i];
+        float normal[3] = {p->x, p->y, p->z};
+        float far_distance = p->w, near_distance = p->w;
+        for (int c = 0; c < 3; c++) {
+            far_distance += normal[c] * (normal[c] > 0 ? bounds_max[c] : bounds_min[c]);
+            near_distance += normal[c] * (normal[c] > 0 ? bounds_min[c] : bounds_max[c]);
+        }
+        if (far_distance < 0) return FRUSTUM_OUTSIDE;
+        if (near_distance < 0) result = FRUSTUM_INTERSECTS;
+    }
+    return result;
+}
+
+// The sphere is cheaper and settles most clusters, the box is tighter
+// for the ones it can't
+static inline int frustum_test_cluster(const Frustum *f, const CullCluster *cluster) {
+    int result = frustum_test_sphere(f, cluster->center, cluster->radius);
+    if (result != FRUSTUM_INTERSECTS) return result;
+    return frustum_test_box(f, cluster->bounds_min, cluster->bounds_max);
+}
+
+// Cuts num_indices indices starting at first_index into clusters and
+// writes them to clusters, which needs room for one per
+// CULL_CLUSTER_TRIANGLES triangles (rounded up). Returns how many
+unsigned int cull_build_clusters(const float *vertices, unsigned int stride,
+                                 const void *indices, unsigned int index_size,
+                                 uint32_t first_index, uint32_t num_indices,
+                                 CullCluster *clusters) {
+    unsigned int num_clusters = 0;
+    for (uint32_t start = 0; start < num_indices; start += CULL_CLUSTER_TRIANGLES * 3) {
+        CullCluster *cluster = &clusters[num_clusters++];
+        cluster->first_index = first_index + start;
+        cluster->num_indices = num_indices - start < CULL_CLUSTER_TRIANGLES * 3 ?
+                               num_indices - start : CULL_CLUSTER_TRIANGLES * 3;
+
+        for (int c = 0; c < 3; c++) {
+            cluster->bounds_min[c] = INFINITY;
+            cluster->bounds_max[c] = -INFINITY;
+        }
+        for (uint32_t i = 0; i < cluster->num_indices; i++) {
+            size_t index = (size_t)cluster->first_index + i;
+            unsigned int v = index_size == 2 ? ((const uint16_t*)indices)[index] : ((const uint32_t*)indices)[index];
+            const float *p = &vertices[(size_t)v * stride];
+            for (int c = 0; c < 3; c++) {
+                if (p[c] < cluster->bounds_min[c]) cluster->bounds_min[c] = p[c];
+                if (p[c] > cluster->bounds_max[c]) cluster->bounds_max[c] = p[c];
+            }
+        }
+
+        // Centered on the box, and just big enough for the vertices,
+        // which is usually well inside the box's corners
+        float radius_squared = 0;
+        for (int c = 0; c < 3; c++) {
+            cluster->center[c] = (cluster->bounds_min[c] + cluster->bounds_max[c]) * 0.5f;
+        }
+        for (uint32_t i = 0; i < cluster->num_indices; i++) {
+            size_t index = (size_t)cluster->first_index + i;
+            unsigned int v = index_size == 2 ? ((const uint16_t*)indices)[index] : ((const uint32_t*)indices)[index];
+            const float *p = &vertices[(size_t)v * stride];
+            float dx = p[0] - cluster->center[0], dy = p[1] - cluster->center[1], dz = p[2] - cluster->center[2];
+            float d = dx * dx + dy * dy + dz * dz;
+            if (d > radius_squared) radius_squared = d;
+        }
+        // A little extra so rounding can't put a vertex outside
+        cluster->radius = sqrtf(radius_squared) * 1.0001f;
+    }
+    return num_clusters;
+}
+
+// Appends a range to the draw list, merged into the last one when it
+// carries straight on from it
+static inline void draw_list_push(DrawRange *ranges, unsigned int *num_ranges,
+                                  uint32_t first_index, uint32_t num_indices) {
+    if (*num_ranges > 0) {
+        DrawRange *last = &ranges[*num_ranges - 1];
+        if (last->first_index + last->num_indices == first_index) {
+            last->num_indices += num_indices;
+            return;
+        }
+    }
+    ranges[(*num_ranges)++] = (DrawRange){first_index, num_indices};
+}
+
+// Culls the clusters of a mesh that is partly in view (the mesh's own
+// test said FRUSTUM_INTERSECTS), writing what's left into ranges, which
+// needs room for one per cluster. Returns the number of ranges
+unsigned int frustum_cull_clusters(const Frustum *f, const CullCluster *clusters, unsigned int num_clusters,
+                                   DrawRange *ranges, CullStats *stats) {
+    unsigned int num_ranges = 0;
+    for (unsigned int i = 0; i < num_clusters; i++) {
+        const CullCluster *cluster = &clusters[i];
+        stats->clusters_tested++;
+        if (frustum_test_cluster(f, cluster) == FRUSTUM_OUTSIDE) continue;
+        stats->clusters_drawn++;
+        draw_list_push(ranges, &num_ranges, cluster->first_index, cluster->num_indices);
+    }
+    return num_ranges;
+}
+
+#endif // CULLING_H
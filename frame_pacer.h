@@ -0,0 +1,76 @@
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <errno.h>
+#include <time.h>
+#include "trace.h"
+
+// Frame rate limiting
+// Deadlines are absolute and advance by exactly one period per frame, so
+// error doesn't pile up the way it does with relative sleeps. The thread
+// sleeps with clock_nanosleep() until shortly before the deadline and
+// spins the rest of the way, since waking up from a sleep can easily be
+// a few hundred microseconds late.
+// A frame that finishes after its deadline is counted as late and starts
+// right away. If it's more than a whole period behind, the schedule
+// restarts from now instead of trying to catch up
+
+typedef struct FramePacer {
+    long long period_ns; // 0 means no limit
+    long long spin_ns;
+    long long deadline_ns;
+
+    // Stats
+    unsigned long frames;
+    unsigned long late_frames;
+    double jitter_total_us; // How far past the deadline we woke up, on time frames only
+    double jitter_max_us;
+} FramePacer;
+
+static long long frame_pacer_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// fps <= 0 turns the limit off
+void frame_pacer_init(FramePacer *pacer, int fps, int spin_us) {
+    pacer->period_ns = fps > 0 ? 1000000000LL / fps : 0;
+    pacer->spin_ns = spin_us * 1000LL;
+    pacer->deadline_ns = frame_pacer_now() + pacer->period_ns;
+    pacer->frames = 0;
+    pacer->late_frames = 0;
+    pacer->jitter_total_us = 0;
+    pacer->jitter_max_us = 0;
+}
+
+// Call once per frame, returns when the next one should start
+void frame_pacer_wait(FramePacer *pacer) {
+    if (pacer->period_ns == 0) return;
+    TRACE_ZONE("frame_pacer_wait");
+
+    long long now = frame_pacer_now();
+    if (now > pacer->deadline_ns) {
+        pacer->late_frames++;
+        pacer->deadline_ns += pacer->period_ns;
+        if (now > pacer->deadline_ns) {
+            pacer->deadline_ns = now + pacer->period_ns;
+        }
+        return;
+    }
+
+    long long wake = pacer->deadline_ns - pacer->spin_ns;
+    if (now < wake) {
+        struct timespec until = { wake / 1000000000LL, wake % 1000000000LL };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {}
+    }
+    while ((now = frame_pacer_now()) < pacer->deadline_ns) {}
+
+    double jitter_us = (now - pacer->deadline_ns) / 1000.0;
+    pacer->jitter_total_us += jitter_us;
+    if (jitter_us > pacer->jitter_max_us) pacer->jitter_max_us = jitter_us;
+    pacer->frames++;
+    pacer->deadline_ns += pacer->period_ns;
+}
+
+#endif // FRAME_PACER_H
@@ -0,0 +1,334 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/fb.h>
+#include "blit.h"
+#include "trace.h"
+
+// fbdev output
+// If the virtual screen is at least twice as tall as the visible one,
+// frames are drawn into the hidden half and shown with FBIOPAN_DISPLAY,
+// so we never write to the buffer being scanned out. Otherwise we draw
+// straight into the visible buffer like before.
+// Each page gets its own blitter, since damage tracking has to compare
+// against whatever was last written to that page, not the last frame
+//
+// Frames can also go somewhere that isn't a screen, for benchmarks and
+// regression tests on machines without one: plain memory, a memfd, or a
+// regular file. These get a made up fb_var_screeninfo with whatever
+// resolution and pixel format is asked for (see framebuffer_parse_mode()),
+// so the blitters run exactly the same code as they would on a device.
+// A file ends up holding the last frame, raw, top row first
+
+enum {
+    FB_TARGET_DEVICE, // fbdev
+    FB_TARGET_MEMORY, // Anonymous memory, the frames go nowhere
+    FB_TARGET_MEMFD,  // Anonymous file, another process can map it
+    FB_TARGET_FILE    // Regular file, left with the last frame in it
+};
+
+typedef struct Framebuffer {
+    int target;
+    int fd; // -1 for FB_TARGET_MEMORY
+    struct fb_var_screeninfo vinfo; // yoffset follows the page on screen
+    struct fb_fix_screeninfo finfo;
+    unsigned int original_yoffset;
+
+    char *map;
+    size_t map_size;
+
+    int num_pages; // 2 when page flipping
+    size_t page_offset[2];
+    int back; // Page the next frame goes to
+    int wait_vsync;
+
+    Blitter blitters[2];
+    size_t bytes_written; // By the last present
+} Framebuffer;
+
+static int framebuffer_pan(Framebuffer *fb, unsigned int yoffset) {
+    struct fb_var_screeninfo vinfo = fb->vinfo;
+    vinfo.xoffset = 0;
+    vinfo.yoffset = yoffset;
+    if (ioctl(fb->fd, FBIOPAN_DISPLAY, &vinfo)) return -1;
+    fb->vinfo.yoffset = yoffset;
+    return 0;
+}
+
+// Pick the pixel conversion for this framebuffer once
+static int framebuffer_init_blitters(Framebuffer *fb, int track_damage) {
+    if (blitter_init(&fb->blitters[0], &fb->vinfo, &fb->finfo) < 0) {
+        return -1;
+    }
+    if (blitter_init(&fb->blitters[1], &fb->vinfo, &fb->finfo) < 0) {
+        blitter_destroy(&fb->blitters[0]);
+        return -1;
+    }
+    fb->blitters[0].track_damage = track_damage;
+    fb->blitters[1].track_damage = track_damage;
+    return 0;
+}
+
+// Returns -1 (after printing why) if the device can't be used
+int framebuffer_open(Framebuffer *fb, const char *path, int double_buffer, int wait_vsync, int track_damage) {
+    memset(fb, 0, sizeof(Framebuffer));
+    fb->target = FB_TARGET_DEVICE;
+
+    // Open the framebuffer device
+    fb->fd = open(path, O_RDWR);
+    if (fb->fd == -1) {
+        perror("Error opening framebuffer device");
+        return -1;
+    }
+
+    if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &fb->vinfo)) {
+        perror("Error reading variable information");
+        close(fb->fd);
+        return -1;
+    }
+
+    if (ioctl(fb->fd, FBIOGET_FSCREENINFO, &fb->finfo)) {
+        perror("Error reading fixed information");
+        close(fb->fd);
+        return -1;
+    }
+
+    fb->map_size = (size_t)fb->vinfo.yres_virtual * fb->finfo.line_length;
+    fb->map = (char*)mmap(0, fb->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
+    if (fb->map == MAP_FAILED) {
+        perror("Error mapping framebuffer to memory");
+        close(fb->fd);
+        return -1;
+    }
+
+    if (framebuffer_init_blitters(fb, track_damage) < 0) {
+        munmap(fb->map, fb->map_size);
+        close(fb->fd);
+        return -1;
+    }
+
+    size_t page_size = (size_t)fb->vinfo.yres * fb->finfo.line_length;
+    fb->original_yoffset = fb->vinfo.yoffset;
+    fb->num_pages = 1;
+    fb->page_offset[0] = (size_t)fb->vinfo.yoffset * fb->finfo.line_length;
+    if (fb->page_offset[0] + page_size > fb->map_size) {
+        fb->page_offset[0] = 0;
+    }
+
+    // Panning has to work in steps that land on a page boundary
+    int can_pan = fb->finfo.ypanstep > 0 && fb->vinfo.yres % fb->finfo.ypanstep == 0;
+    if (double_buffer && can_pan && fb->vinfo.yres_virtual >= 2 * fb->vinfo.yres) {
+        // Keep showing whichever page is up and start drawing on the other
+        int front = fb->vinfo.yoffset >= fb->vinfo.yres ? 1 : 0;
+        if (framebuffer_pan(fb, front * fb->vinfo.yres) == 0) {
+            fb->num_pages = 2;
+            fb->page_offset[0] = 0;
+            fb->page_offset[1] = page_size;
+            fb->back = !front;
+        }
+    }
+
+    if (fb->num_pages == 2 && wait_vsync) {
+        int screen = 0;
+        fb->wait_vsync = ioctl(fb->fd, FBIO_WAITFORVSYNC, &screen) == 0;
+    }
+
+    return 0;
+}
+
+// Reads a mode for framebuffer_open_virtual(): WIDTHxHEIGHT, optionally
+// followed by xBPP (16, 24 or 32, 32 if left out) and :R,G,B or :R,G,B,A
+// with the bit offset of each channel. Channels are 8 bits wide, except
+// 5, 6 and 5 at 16 bpp. Without offsets it's XRGB8888, RGB888 or RGB565.
+// Returns -1 if the mode doesn't make sense
+int framebuffer_parse_mode(const char *mode, struct fb_var_screeninfo *vinfo) {
+    unsigned int width = 0, height = 0, bpp = 32;
+    int offsets[4] = {-1, -1, -1, -1};
+    int length = 0;
+    if (sscanf(mode, "%ux%u%n", &width, &height, &length) != 2) return -1;
+    mode += length;
+    if (*mode == 'x') {
+        if (sscanf(mode, "x%u%n", &bpp, &length) != 1) return -1;
+        mode += length;
+    }
+    if (*mode == ':') {
+        int count = sscanf(mode, ":%d,%d,%d,%d", &offsets[0], &offsets[1], &offsets[2], &offsets[3]);
+        if (count < 3) return -1;
+    } else if (*mode != '\0') {
+        return -1;
+    }
+    if (width == 0 || height == 0 || width > 16384 || height > 16384) return -1;
+    if (bpp != 16 && bpp != 24 && bpp != 32) return -1;
+
+    unsigned int lengths[4] = {8, 8, 8, 8};
+    if (bpp == 16) {
+        lengths[0] = 5;
+        lengths[1] = 6;
+        lengths[2] = 5;
+    }
+    if (offsets[0] < 0) {
+        offsets[0] = bpp == 16 ? 11 : 16;
+        offsets[1] = bpp == 16 ? 5 : 8;
+        offsets[2] = 0;
+    }
+
+    memset(vinfo, 0, sizeof(*vinfo));
+    vinfo->xres = vinfo->xres_virtual = width;
+    vinfo->yres = vinfo->yres_virtual = height;
+    vinfo->bits_per_pixel = bpp;
+    struct fb_bitfield *fields[4] = {&vinfo->red, &vinfo->green, &vinfo->blue, &vinfo->transp};
+    for (int c = 0; c < 4; c++) {
+        if (offsets[c] < 0) continue;
+        if (offsets[c] + lengths[c] > bpp) return -1;
+        fields[c]->offset = offsets[c];
+        fields[c]->length = lengths[c];
+    }
+    return 0;
+}
+
+// Opens a framebuffer that isn't a screen (one of FB_TARGET_MEMORY,
+// FB_TARGET_MEMFD or FB_TARGET_FILE, which writes to path) in the mode
+// from framebuffer_parse_mode(). Always a single page.
+// Returns -1 (after printing why) if it can't be set up
+int framebuffer_open_virtual(Framebuffer *fb, int target, const char *path,
+                             const struct fb_var_screeninfo *mode, int track_damage) {
+    memset(fb, 0, sizeof(Framebuffer));
+    fb->target = target;
+    fb->fd = -1;
+    fb->vinfo = *mode;
+    fb->finfo.line_length = mode->xres * (mode->bits_per_pixel / 8);
+    fb->finfo.smem_len = fb->finfo.line_length * mode->yres;
+    fb->finfo.type = FB_TYPE_PACKED_PIXELS;
+    fb->finfo.visual = FB_VISUAL_TRUECOLOR;
+    strncpy(fb->finfo.id, "virtual", sizeof(fb->finfo.id) - 1);
+    fb->map_size = fb->finfo.smem_len;
+
+    if (target == FB_TARGET_MEMFD) {
+#ifdef SYS_memfd_create
+        fb->fd = syscall(SYS_memfd_create, "framebuffer", 0);
+#else
+        errno = ENOSYS;
+#endif
+        if (fb->fd == -1) {
+            perror("Error creating memfd framebuffer");
+            return -1;
+        }
+    } else if (target == FB_TARGET_FILE) {
+        fb->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fb->fd == -1) {
+            perror("Error opening framebuffer file");
+            return -1;
+        }
+    }
+
+    if (fb->fd >= 0 && ftruncate(fb->fd, fb->map_size)) {
+        perror("Error sizing framebuffer file");
+        close(fb->fd);
+        return -1;
+    }
+    fb->map = (char*)mmap(0, fb->map_size, PROT_READ | PROT_WRITE,
+                          fb->fd >= 0 ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS, fb->fd, 0);
+    if (fb->map == MAP_FAILED) {
+        perror("Error mapping framebuffer to memory");
+        if (fb->fd >= 0) close(fb->fd);
+        return -1;
+    }
+
+    if (framebuffer_init_blitters(fb, track_damage) < 0) {
+        munmap(fb->map, fb->map_size);
+        if (fb->fd >= 0) close(fb->fd);
+        return -1;
+    }
+    fb->num_pages = 1;
+    return 0;
+}
+
+// Frames will be scale times smaller than the screen
+void framebuffer_set_scale(Framebuffer *fb, int scale, int filter) {
+    blitter_set_scale(&fb->blitters[0], scale, filter);
+    blitter_set_scale(&fb->blitters[1], scale, filter);
+}
+
+// Frames will come in the framebuffer's own format, top row first
+void framebuffer_set_native(Framebuffer *fb, int native) {
+    blitter_set_native(&fb->blitters[0], native);
+    blitter_set_native(&fb->blitters[1], native);
+}
+
+// Page the next frame goes to, which framebuffer_flip() will show
+char *framebuffer_back_page(Framebuffer *fb) {
+    return fb->map + fb->page_offset[fb->back];
+}
+
+// Writes a frame (RGBA, bottom row first, or native) to the back page
+void framebuffer_write(Framebuffer *fb, const unsigned char *pixels, int width, int height) {
+    TRACE_ZONE("copy_to_framebuffer");
+    Blitter *blitter = &fb->blitters[fb->back];
+    copy_to_framebuffer(blitter, pixels, width, height, framebuffer_back_page(fb));
+    fb->bytes_written = blitter->bytes_written;
+}
+
+// Puts the back page on screen, a no-op without page flipping
+void framebuffer_flip(Framebuffer *fb) {
+    if (fb->num_pages == 1) return;
+    TRACE_ZONE("flip");
+
+    if (fb->wait_vsync) {
+        int screen = 0;
+        ioctl(fb->fd, FBIO_WAITFORVSYNC, &screen);
+    }
+    if (framebuffer_pan(fb, fb->back * fb->vinfo.yres) == 0) {
+        fb->back = !fb->back;
+    } else {
+        // The frame is still there, just not visible. Stop flipping and
+        // keep drawing to whatever page is on screen
+        fprintf(stderr, "FBIOPAN_DISPLAY failed, falling back to a single buffer\n");
+        fb->num_pages = 1;
+        fb->back = fb->vinfo.yoffset >= fb->vinfo.yres ? 1 : 0;
+        blitter_invalidate(&fb->blitters[fb->back]);
+    }
+}
+
+// Writes a frame and puts it on screen
+void framebuffer_present(Framebuffer *fb, const unsigned char *pixels, int width, int height) {
+    framebuffer_write(fb, pixels, width, height);
+    framebuffer_flip(fb);
+}
+
+void framebuffer_close(Framebuffer *fb) {
+    // Leave the console where we found it
+    if (fb->vinfo.yoffset != fb->original_yoffset) {
+        framebuffer_pan(fb, fb->original_yoffset);
+    }
+    blitter_destroy(&fb->blitters[0]);
+    blitter_destroy(&fb->blitters[1]);
+    munmap(fb->map, fb->map_size);
+    if (fb->fd >= 0) close(fb->fd);
+}
+
+// FNV-1a over the visible pixels of the page last presented, to tell
+// frames apart without storing them
+uint64_t framebuffer_checksum(const Framebuffer *fb) {
+    int page = fb->num_pages == 2 ? !fb->back : 0;
+    size_t row_bytes = (size_t)fb->vinfo.xres * (fb->vinfo.bits_per_pixel / 8);
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned int y = 0; y < fb->vinfo.yres; y++) {
+        const unsigned char *row = (const unsigned char*)fb->map + fb->page_offset[page] + (size_t)y * fb->finfo.line_length;
+        for (size_t i = 0; i < row_bytes; i++) {
+            hash = (hash ^ row[i]) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+#endif // FRAMEBUFFER_H
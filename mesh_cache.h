@@ -0,0 +1,348 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mesh_simplify.h"
+#include "culling.h"
+
+// Binary mesh cache
+// Parsing a big OBJ takes seconds, so the parsed mesh is written next to
+// it (model.obj -> model.obj.cache) and mapped straight back in on the
+// next start. The file is a header followed by the interleaved vertex
+// stream, the index buffer and the culling clusters, each 64 byte
+// aligned, in the exact layout the mesh uses, so the renderer points at
+// the mapped pages instead of copying. Levels of detail are ranges of the
+// one index buffer.
+// A cache only counts if it was made from the same source file: same
+// size, same mtime and the same hash over a sample of the file (hashing
+// the whole thing would cost as much as we're trying to save), and made
+// with the same settings, since those change what goes into it. Bump
+// MESH_CACHE_VERSION whenever the layout or how it's built changes
+
+#define MESH_CACHE_MAGIC "TTYMESH"
+#define MESH_CACHE_VERSION 6
+#define MESH_CACHE_ALIGN 64
+#define MESH_CACHE_SAMPLES 64 // Blocks of the source that get hashed
+#define MESH_CACHE_SAMPLE_SIZE 4096
+
+// Identifies the source file a cache was made from
+typedef struct MeshCacheSource {
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t hash;
+} MeshCacheSource;
+
+// Build settings a cache was made with, a different one means rebuilding
+typedef struct MeshCacheSettings {
+    uint32_t max_lods; // Levels of detail asked for
+    uint32_t optimized; // Reordered for the vertex cache
+    uint32_t cluster_triangles; // Culling cluster size
+    uint32_t reserved;
+} MeshCacheSettings;
+
+typedef struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size; // Also catches a different struct layout
+    MeshCacheSource source;
+    MeshCacheSettings settings;
+
+    uint32_t num_vertices;
+    uint32_t vertex_stride; // Floats per vertex, position first
+    uint32_t num_indices;
+    uint32_t index_size; // 2 or 4 bytes
+    float bounds_min[3];
+    float bounds_max[3];
+    float acmr_before; // Vertex cache misses per triangle as loaded, and as stored
+    float acmr_after;
+    uint32_t num_lods;
+    uint32_t reserved;
+    MeshLod lods[MESH_MAX_LODS];
+    uint32_t num_clusters;
+    uint32_t lod_clusters[MESH_MAX_LODS + 1];
+
+    // Byte offsets from the start of the file
+    uint64_t vertices_offset;
+    uint64_t indices_offset;
+    uint64_t clusters_offset;
+    uint64_t file_size;
+} MeshCacheHeader;
+
+// A mesh as it is in the cache. When mapped, the pointers are into the
+// mapping and stay valid until mesh_cache_unmap()
+typedef struct MeshCacheData {
+    const float *vertices;
+    unsigned int vertex_stride;
+    unsigned int num_vertices;
+    const void *indices;
+    unsigned int index_size;
+    unsigned int num_indices;
+    float bounds_min[3];
+    float bounds_max[3];
+    float acmr_before;
+    float acmr_after;
+    unsigned int num_lods; // 0 if the whole index buffer is the only level
+    MeshLod lods[MESH_MAX_LODS];
+    const CullCluster *clusters; // Of level i are lod_clusters[i] up to lod_clusters[i + 1]
+    unsigned int num_clusters;
+    unsigned int lod_clusters[MESH_MAX_LODS + 1];
+
+    void *map;
+    size_t map_size;
+} MeshCacheData;
+
+// Where the cache for an OBJ goes, returns -1 if the path is too long
+int mesh_cache_path(char *out, size_t out_size, const char *source_path) {
+    int n = snprintf(out, out_size, "%s.cache", source_path);
+    return n < 0 || (size_t)n >= out_size ? -1 : 0;
+}
+
+// Size, mtime and a hash over MESH_CACHE_SAMPLES evenly spaced blocks
+// (including the first and last one) of the source file
+int mesh_cache_source_info(const char *source_path, MeshCacheSource *source) {
+    int fd = open(source_path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    source->size = st.st_size;
+    source->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+    uint64_t hash = 1469598103934665603ULL; // FNV-1a
+    unsigned char block[MESH_CACHE_SAMPLE_SIZE];
+    uint64_t last_block = source->size > MESH_CACHE_SAMPLE_SIZE ? source->size - MESH_CACHE_SAMPLE_SIZE : 0;
+    for (int i = 0; i < MESH_CACHE_SAMPLES; i++) {
+        uint64_t offset = last_block * i / (MESH_CACHE_SAMPLES - 1);
+        ssize_t n = pread(fd, block, sizeof(block), offset);
+        if (n < 0) {
+            close(fd);
+            return -1;
+        }
+        for (ssize_t j = 0; j < n; j++) {
+            hash = (hash ^ block[j]) * 1099511628211ULL;
+        }
+        if (last_block == 0) break;
+    }
+    source->hash = hash;
+
+    close(fd);
+    return 0;
+}
+
+static uint64_t mesh_cache_align(uint64_t offset) {
+    return (offset + MESH_CACHE_ALIGN - 1) & ~(uint64_t)(MESH_CACHE_ALIGN - 1);
+}
+
+static int mesh_cache_write_at(int fd, const void *data, size_t size, uint64_t offset) {
+    const char *p = (const char*)data;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Writes the mesh out, through a temporary file so a reader never sees
+// half a cache. Bounds are computed here. Returns -1 if it couldn't
+// (say the directory is read only), which just means no cache next time
+int mesh_cache_write(const char *path, const MeshCacheSource *source, const MeshCacheSettings *settings,
+                     MeshCacheData *mesh) {
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.header_size = sizeof(MeshCacheHeader);
+    header.source = *source;
+    header.settings = *settings;
+    header.num_vertices = mesh->num_vertices;
+    header.vertex_stride = mesh->vertex_stride;
+    header.num_indices = mesh->num_indices;
+    header.index_size = mesh->index_size;
+    header.acmr_before = mesh->acmr_before;
+    header.acmr_after = mesh->acmr_after;
+    header.num_lods = mesh->num_lods;
+    memcpy(header.lods, mesh->lods, sizeof(header.lods));
+    header.num_clusters = mesh->num_clusters;
+    memcpy(header.lod_clusters, mesh->lod_clusters, sizeof(header.lod_clusters));
+
+    for (int c = 0; c < 3; c++) {
+        mesh->bounds_min[c] = mesh->num_vertices ? mesh->vertices[c] : 0;
+        mesh->bounds_max[c] = mesh->bounds_min[c];
+    }
+    for (unsigned int i = 1; i < mesh->num_vertices; i++) {
+        for (int c = 0; c < 3; c++) {
+            float v = mesh->vertices[(size_t)i * mesh->vertex_stride + c];
+            if (v < mesh->bounds_min[c]) mesh->bounds_min[c] = v;
+            if (v > mesh->bounds_max[c]) mesh->bounds_max[c] = v;
+        }
+    }
+    memcpy(header.bounds_min, mesh->bounds_min, sizeof(header.bounds_min));
+    memcpy(header.bounds_max, mesh->bounds_max, sizeof(header.bounds_max));
+
+    size_t vertices_size = (size_t)mesh->num_vertices * mesh->vertex_stride * sizeof(float);
+    size_t indices_size = (size_t)mesh->num_indices * mesh->index_size;
+    size_t clusters_size = (size_t)mesh->num_clusters * sizeof(CullCluster);
+
+    header.vertices_offset = mesh_cache_align(sizeof(MeshCacheHeader));
+    header.indices_offset = mesh_cache_align(header.vertices_offset + vertices_size);
+    header.clusters_offset = mesh_cache_align(header.indices_offset + indices_size);
+    header.file_size = header.clusters_offset + clusters_size;
+
+    char temp_path[4096];
+    int n = snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+    if (n < 0 || (size_t)n >= sizeof(temp_path)) return -1;
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    int failed = mesh_cache_write_at(fd, &header, sizeof(header), 0) < 0 ||
+                 mesh_cache_write_at(fd, mesh->vertices, vertices_size, header.vertices_offset) < 0 ||
+                 mesh_cache_write_at(fd, mesh->indices, indices_size, header.indices_offset) < 0 ||
+                 mesh_cache_write_at(fd, mesh->clusters, clusters_size, header.clusters_offset) < 0 ||
+                 ftruncate(fd, header.file_size) < 0;
+    if (close(fd) < 0) failed = 1;
+    if (failed || rename(temp_path, path) < 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Maps a cache if it exists, was made from this source with these
+// settings and is the current version. Returns -1 otherwise, without
+// printing anything for a cache that simply isn't there
+int mesh_cache_map(const char *path, const MeshCacheSource *source, const MeshCacheSettings *settings,
+                   MeshCacheData *mesh) {
+    memset(mesh, 0, sizeof(MeshCacheData));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(MeshCacheHeader)) {
+        close(fd);
+        return -1;
+    }
+    size_t map_size = st.st_size;
+    void *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const MeshCacheHeader *header = (const MeshCacheHeader*)map;
+    const char *why = NULL;
+    if (memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->header_size != sizeof(MeshCacheHeader)) {
+        why = "not a mesh cache";
+    } else if (header->version != MESH_CACHE_VERSION) {
+        why = "old version";
+    } else if (header->source.size != source->size || header->source.mtime_ns != source->mtime_ns ||
+               header->source.hash != source->hash) {
+        why = "the model changed";
+    } else if (memcmp(&header->settings, settings, sizeof(MeshCacheSettings)) != 0) {
+        why = "made with different settings";
+    } else if (header->vertex_stride < 3 || (header->index_size != 2 && header->index_size != 4) ||
+               header->num_indices % 3 != 0 ||
+               header->num_lods > MESH_MAX_LODS || header->lod_clusters[0] != 0) {
+        why = "bad layout";
+    } else if (header->file_size != map_size ||
+               header->vertices_offset + (uint64_t)header->num_vertices * header->vertex_stride * sizeof(float) > map_size ||
+               header->indices_offset + (uint64_t)header->num_indices * header->index_size > map_size ||
+               header->clusters_offset + (uint64_t)header->num_clusters * sizeof(CullCluster) > map_size) {
+        why = "truncated";
+    }
+    if (why) {
+        fprintf(stderr, "Ignoring mesh cache %s: %s\n", path, why);
+        munmap(map, map_size);
+        return -1;
+    }
+
+    const char *base = (const char*)map;
+    mesh->vertices = (const float*)(base + header->vertices_offset);
+    mesh->vertex_stride = header->vertex_stride;
+    mesh->num_vertices = header->num_vertices;
+    mesh->indices = base + header->indices_offset;
+    mesh->index_size = header->index_size;
+    mesh->num_indices = header->num_indices;
+    memcpy(mesh->bounds_min, header->bounds_min, sizeof(mesh->bounds_min));
+    memcpy(mesh->bounds_max, header->bounds_max, sizeof(mesh->bounds_max));
+    mesh->acmr_before = header->acmr_before;
+    mesh->acmr_after = header->acmr_after;
+    mesh->num_lods = header->num_lods;
+    memcpy(mesh->lods, header->lods, sizeof(mesh->lods));
+    mesh->clusters = (const CullCluster*)(base + header->clusters_offset);
+    mesh->num_clusters = header->num_clusters;
+    memcpy(mesh->lod_clusters, header->lod_clusters, sizeof(mesh->lod_clusters));
+
+    // Every range has to be whole triangles inside the index buffer,
+    // since the renderer draws them without looking
+    const char *bad = NULL;
+    for (unsigned int i = 0; i < mesh->num_lods; i++) {
+        if ((uint64_t)mesh->lods[i].first_index + mesh->lods[i].num_indices > mesh->num_indices ||
+            mesh->lods[i].num_indices % 3 != 0) {
+            bad = "bad level of detail";
+        }
+    }
+    unsigned int num_levels = mesh->num_lods ? mesh->num_lods : 1;
+    for (unsigned int i = 0; i < num_levels; i++) {
+        if (mesh->lod_clusters[i] > mesh->lod_clusters[i + 1] || mesh->lod_clusters[i + 1] > mesh->num_clusters) {
+            bad = "bad clusters";
+        }
+    }
+    for (unsigned int i = 0; i < mesh->num_clusters; i++) {
+        if ((uint64_t)mesh->clusters[i].first_index + mesh->clusters[i].num_indices > mesh->num_indices ||
+            mesh->clusters[i].num_indices % 3 != 0) {
+            bad = "bad clusters";
+        }
+    }
+
+    // Same goes for every vertex an index points at. The upload or the
+    // first frame reads all of them anyway, so one pass over them up
+    // front costs little beyond what the mapping was going to fault in
+    madvise(map, map_size, MADV_WILLNEED);
+    uint32_t max_index = 0;
+    if (mesh->index_size == 2) {
+        const uint16_t *indices = (const uint16_t*)mesh->indices;
+        for (unsigned int i = 0; i < mesh->num_indices; i++) {
+            if (indices[i] > max_index) max_index = indices[i];
+        }
+    } else {
+        const uint32_t *indices = (const uint32_t*)mesh->indices;
+        for (unsigned int i = 0; i < mesh->num_indices; i++) {
+            if (indices[i] > max_index) max_index = indices[i];
+        }
+    }
+    if (mesh->num_indices > 0 && max_index >= mesh->num_vertices) {
+        bad = "bad indices";
+    }
+    if (bad) {
+        fprintf(stderr, "Ignoring mesh cache %s: %s\n", path, bad);
+        munmap(map, map_size);
+        memset(mesh, 0, sizeof(MeshCacheData));
+        return -1;
+    }
+    mesh->map = map;
+    mesh->map_size = map_size;
+    return 0;
+}
+
+void mesh_cache_unmap(MeshCacheData *mesh) {
+    if (mesh->map) munmap(mesh->map, mesh->map_size);
+    mesh->map = NULL;
+    mesh->map_size = 0;
+}
+
+#endif // MESH_CACHE_H
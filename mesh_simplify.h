@@ -0,0 +1,385 @@
+#ifndef MESH_SIMPLIFY_H
+#define MESH_SIMPLIFY_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mesh_optimize.h"
+
+// Mesh simplification for levels of detail
+// Quadric error edge collapse (Garland, Heckbert 1997), collapsing one end
+// of an edge onto the other so no new vertices are made and every level
+// indexes the same vertex buffer. Instead of a priority queue that has
+// to be updated after every collapse, it works in passes: all edges are
+// sorted by cost, and the cheapest ones are collapsed as long as they
+// don't touch a vertex whose neighbourhood already changed in this pass.
+// A few passes halve the triangle count
+//
+// Vertices on an open border, and vertices sharing a position with
+// another one (seams where normals or texcoords change), never move, so
+// the simplified mesh doesn't open holes. Collapses that would flip a
+// triangle over are skipped
+//
+// The error of a level is the largest error of any collapse so far, as a
+// distance in model units (square root of the area weighted mean squared
+// distance to the original planes). Projected to the screen, it says how
+// far off the level can look
+
+#define MESH_MAX_LODS 8
+#define MESH_LOD_REDUCTION 4 // Each level has about 1/4 of the triangles of the last
+#define MESH_LOD_MIN_TRIANGLES 256 // No point going coarser
+
+// One level of detail, a range of a shared index buffer
+typedef struct MeshLod {
+    uint32_t first_index;
+    uint32_t num_indices;
+    float error; // Model units
+    uint32_t reserved;
+} MeshLod;
+
+typedef struct MeshSimplifier {
+    const float *vertices; // Position first, stride floats apart
+    unsigned int stride;
+    unsigned int num_vertices;
+
+    double *quadrics; // 10 per vertex, the upper half of a symmetric 4x4
+    double *weights; // Area summed into each quadric
+    unsigned char *locked;
+
+    unsigned int *indices; // The current level
+    size_t num_indices;
+    float error;
+} MeshSimplifier;
+
+typedef struct {
+    float cost;
+    unsigned int from;
+    unsigned int to;
+} MeshCollapse;
+
+static inline void mesh_quadric_add_plane(double *q, double a, double b, double c, double d, double w) {
+    q[0] += w * a * a; q[1] += w * a * b; q[2] += w * a * c; q[3] += w * a * d;
+    q[4] += w * b * b; q[5] += w * b * c; q[6] += w * b * d;
+    q[7] += w * c * c; q[8] += w * c * d;
+    q[9] += w * d * d;
+}
+
+// v^T Q v for v = (x, y, z, 1) with Q = a + b
+static inline double mesh_quadric_error(const double *a, const double *b, const float *p) {
+    double q[10];
+    for (int i = 0; i < 10; i++) q[i] = a[i] + b[i];
+    double x = p[0], y = p[1], z = p[2];
+    return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x +
+           q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y +
+           q[7] * z * z + 2 * q[8] * z +
+           q[9];
+}
+
+static inline void mesh_triangle_normal(const float *a, const float *b, const float *c, float *n) {
+    float e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    float e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+// Locks border vertices (on an edge only one triangle uses) and vertices
+// that share their position with another vertex
+static int mesh_simplifier_lock(MeshSimplifier *s) {
+    MeshAdjacency adjacency;
+    if (mesh_build_adjacency(s->indices, s->num_indices, s->num_vertices, &adjacency) < 0) return -1;
+    for (unsigned int a = 0; a < s->num_vertices; a++) {
+        for (unsigned int i = adjacency.offsets[a]; i < adjacency.offsets[a + 1] && !s->locked[a]; i++) {
+            const unsigned int *t = &s->indices[(size_t)adjacency.triangles[i] * 3];
+            for (int k = 0; k < 3; k++) {
+                unsigned int b = t[k];
+                if (b == a) continue;
+                // Count the triangles around a that also use b
+                int shared = 0;
+                for (unsigned int j = adjacency.offsets[a]; j < adjacency.offsets[a + 1]; j++) {
+                    const unsigned int *u = &s->indices[(size_t)adjacency.triangles[j] * 3];
+                    shared += u[0] == b || u[1] == b || u[2] == b;
+                }
+                if (shared == 1) {
+                    s->locked[a] = 1;
+                    s->locked[b] = 1;
+                }
+            }
+        }
+    }
+    free(adjacency.offsets);
+    free(adjacency.triangles);
+
+    // Same positions through a hash table of the position bits
+    const unsigned int none = 0xffffffffu;
+    size_t table_size = 1;
+    while (table_size < (size_t)s->num_vertices * 2) table_size *= 2;
+    unsigned int *table = (unsigned int*)malloc(table_size * sizeof(unsigned int));
+    if (!table) return -1;
+    memset(table, 0xff, table_size * sizeof(unsigned int));
+    for (unsigned int v = 0; v < s->num_vertices; v++) {
+        const float *p = &s->vertices[(size_t)v * s->stride];
+        uint32_t bits[3];
+        memcpy(bits, p, sizeof(bits));
+        size_t slot = (bits[0] * 73856093u ^ bits[1] * 19349663u ^ bits[2] * 83492791u) & (table_size - 1);
+        while (table[slot] != none) {
+            const float *q = &s->vertices[(size_t)table[slot] * s->stride];
+            if (p[0] == q[0] && p[1] == q[1] && p[2] == q[2]) {
+                s->locked[v] = 1;
+                s->locked[table[slot]] = 1;
+                break;
+            }
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if (table[slot] == none) table[slot] = v;
+    }
+    free(table);
+    return 0;
+}
+
+void mesh_simplifier_destroy(MeshSimplifier *s) {
+    free(s->quadrics);
+    free(s->weights);
+    free(s->locked);
+    free(s->indices);
+    memset(s, 0, sizeof(MeshSimplifier));
+}
+
+// Starts from a copy of the given indices, which stay untouched
+int mesh_simplifier_init(MeshSimplifier *s, const float *vertices, unsigned int stride, unsigned int num_vertices,
+                         const unsigned int *indices, size_t num_indices) {
+    memset(s, 0, sizeof(MeshSimplifier));
+    s->vertices = vertices;
+    s->stride = stride;
+    s->num_vertices = num_vertices;
+    s->num_indices = num_indices;
+    s->quadrics = (double*)calloc((size_t)num_vertices * 10 + 1, sizeof(double));
+    s->weights = (double*)calloc((size_t)num_vertices + 1, sizeof(double));
+    s->locked = (unsigned char*)calloc((size_t)num_vertices + 1, 1);
+    s->indices = (unsigned int*)malloc(num_indices * sizeof(unsigned int) + 1);
+    if (!s->quadrics || !s->weights || !s->locked || !s->indices) {
+        mesh_simplifier_destroy(s);
+        return -1;
+    }
+    memcpy(s->indices, indices, num_indices * sizeof(unsigned int));
+
+    // Every vertex starts with the planes of the triangles around it
+    for (size_t t = 0; t < num_indices / 3; t++) {
+        const unsigned int *v = &indices[t * 3];
+        const float *p0 = &vertices[(size_t)v[0] * stride];
+        float n[3];
+        mesh_triangle_normal(p0, &vertices[(size_t)v[1] * stride], &vertices[(size_t)v[2] * stride], n);
+        double length = sqrt((double)n[0] * n[0] + (double)n[1] * n[1] + (double)n[2] * n[2]);
+        if (length <= 0) continue;
+        double a = n[0] / length, b = n[1] / length, c = n[2] / length;
+        double d = -(a * p0[0] + b * p0[1] + c * p0[2]);
+        double area = length * 0.5;
+        for (int k = 0; k < 3; k++) {
+            mesh_quadric_add_plane(&s->quadrics[(size_t)v[k] * 10], a, b, c, d, area);
+            s->weights[v[k]] += area;
+        }
+    }
+
+    if (mesh_simplifier_lock(s) < 0) {
+        mesh_simplifier_destroy(s);
+        return -1;
+    }
+    return 0;
+}
+
+// By cost, with an LSD radix sort on the bits of the (never negative)
+// float costs, which order the same way as the floats do. Stable, so
+// equal costs stay in edge order. Ends up back in collapses
+static void mesh_sort_collapses(MeshCollapse *collapses, MeshCollapse *temp, size_t count) {
+    MeshCollapse *from = collapses, *to = temp;
+    for (int shift = 0; shift < 32; shift += 8) {
+        size_t histogram[256] = {0};
+        for (size_t i = 0; i < count; i++) {
+            uint32_t key;
+            memcpy(&key, &from[i].cost, sizeof(key));
+            histogram[(key >> shift) & 0xff]++;
+        }
+        size_t sum = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t n = histogram[b];
+            histogram[b] = sum;
+            sum += n;
+        }
+        for (size_t i = 0; i < count; i++) {
+            uint32_t key;
+            memcpy(&key, &from[i].cost, sizeof(key));
+            to[histogram[(key >> shift) & 0xff]++] = from[i];
+        }
+        MeshCollapse *swap = from;
+        from = to;
+        to = swap;
+    }
+}
+
+// Moving from onto to mustn't turn any of from's other triangles over
+static int mesh_collapse_flips(const MeshSimplifier *s, const MeshAdjacency *adjacency,
+                               unsigned int from, unsigned int to) {
+    const float *target = &s->vertices[(size_t)to * s->stride];
+    for (unsigned int i = adjacency->offsets[from]; i < adjacency->offsets[from + 1]; i++) {
+        const unsigned int *t = &s->indices[(size_t)adjacency->triangles[i] * 3];
+        if (t[0] == to || t[1] == to || t[2] == to) continue; // Goes away
+        const float *p[3];
+        const float *moved[3];
+        for (int k = 0; k < 3; k++) {
+            p[k] = &s->vertices[(size_t)t[k] * s->stride];
+            moved[k] = t[k] == from ? target : p[k];
+        }
+        float before[3], after[3];
+        mesh_triangle_normal(p[0], p[1], p[2], before);
+        mesh_triangle_normal(moved[0], moved[1], moved[2], after);
+        float dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+        if (dot <= 0.0f) return 1;
+    }
+    return 0;
+}
+
+// One pass of collapses, stopping once about target_triangles are left.
+// Returns how many collapses it did, -1 if out of memory
+static long mesh_simplify_pass(MeshSimplifier *s, size_t target_triangles) {
+    size_t num_triangles = s->num_indices / 3;
+    MeshAdjacency adjacency;
+    if (mesh_build_adjacency(s->indices, s->num_indices, s->num_vertices, &adjacency) < 0) return -1;
+    MeshCollapse *collapses = (MeshCollapse*)malloc(s->num_indices * sizeof(MeshCollapse) + 1);
+    MeshCollapse *sort_temp = (MeshCollapse*)malloc(s->num_indices * sizeof(MeshCollapse) + 1);
+    unsigned int *remap = (unsigned int*)malloc((size_t)s->num_vertices * sizeof(unsigned int) + 1);
+    unsigned char *touched = (unsigned char*)calloc((size_t)s->num_vertices + 1, 1);
+    if (!collapses || !sort_temp || !remap || !touched) {
+        free(collapses);
+        free(sort_temp);
+        free(remap);
+        free(touched);
+        free(adjacency.offsets);
+        free(adjacency.triangles);
+        return -1;
+    }
+
+    // Every edge once (the triangle where it runs from the lower index to
+    // the higher one), in whichever direction costs less
+    size_t num_collapses = 0;
+    for (size_t t = 0; t < num_triangles; t++) {
+        const unsigned int *v = &s->indices[t * 3];
+        for (int k = 0; k < 3; k++) {
+            unsigned int a = v[k], b = v[(k + 1) % 3];
+            if (a >= b) continue;
+            const double *qa = &s->quadrics[(size_t)a * 10];
+            const double *qb = &s->quadrics[(size_t)b * 10];
+            double cost_ab = s->locked[a] ? INFINITY : mesh_quadric_error(qa, qb, &s->vertices[(size_t)b * s->stride]);
+            double cost_ba = s->locked[b] ? INFINITY : mesh_quadric_error(qa, qb, &s->vertices[(size_t)a * s->stride]);
+            if (isinf(cost_ab) && isinf(cost_ba)) continue;
+            MeshCollapse *c = &collapses[num_collapses++];
+            // Rounding can take an error slightly below 0
+            if (cost_ab <= cost_ba) {
+                *c = (MeshCollapse){(float)fmax(cost_ab, 0.0), a, b};
+            } else {
+                *c = (MeshCollapse){(float)fmax(cost_ba, 0.0), b, a};
+            }
+        }
+    }
+    mesh_sort_collapses(collapses, sort_temp, num_collapses);
+    free(sort_temp);
+
+    for (unsigned int v = 0; v < s->num_vertices; v++) remap[v] = v;
+    long done = 0;
+    size_t remaining = num_triangles;
+    for (size_t i = 0; i < num_collapses && remaining > target_triangles; i++) {
+        unsigned int from = collapses[i].from, to = collapses[i].to;
+        if (touched[from] || touched[to]) continue;
+        if (mesh_collapse_flips(s, &adjacency, from, to)) continue;
+
+        remap[from] = to;
+        double *qf = &s->quadrics[(size_t)from * 10];
+        double *qt = &s->quadrics[(size_t)to * 10];
+        double weight = s->weights[from] + s->weights[to];
+        float error = weight > 0 ? (float)sqrt(collapses[i].cost / weight) : 0.0f;
+        if (error > s->error) s->error = error;
+        for (int k = 0; k < 10; k++) qt[k] += qf[k];
+        s->weights[to] = weight;
+
+        // Nothing else around from can change in this pass, so the
+        // flip checks above stay valid
+        for (unsigned int a = adjacency.offsets[from]; a < adjacency.offsets[from + 1]; a++) {
+            const unsigned int *t = &s->indices[(size_t)adjacency.triangles[a] * 3];
+            touched[t[0]] = touched[t[1]] = touched[t[2]] = 1;
+            remaining -= t[0] == to || t[1] == to || t[2] == to;
+        }
+        done++;
+    }
+
+    // Drop the triangles that collapsed to nothing
+    size_t out = 0;
+    for (size_t t = 0; t < num_triangles; t++) {
+        unsigned int a = remap[s->indices[t * 3]];
+        unsigned int b = remap[s->indices[t * 3 + 1]];
+        unsigned int c = remap[s->indices[t * 3 + 2]];
+        if (a == b || b == c || a == c) continue;
+        s->indices[out++] = a;
+        s->indices[out++] = b;
+        s->indices[out++] = c;
+    }
+    s->num_indices = out;
+
+    free(collapses);
+    free(remap);
+    free(touched);
+    free(adjacency.offsets);
+    free(adjacency.triangles);
+    return done;
+}
+
+// Simplifies the current level down to target_triangles, or as close as
+// it gets before it runs out of edges it's allowed to collapse
+int mesh_simplify(MeshSimplifier *s, size_t target_triangles) {
+    while (s->num_indices / 3 > target_triangles) {
+        size_t before = s->num_indices;
+        long done = mesh_simplify_pass(s, target_triangles);
+        if (done < 0) return -1;
+        // Passes that barely get anywhere mean only locked or flipping
+        // edges are left
+        if (done == 0 || s->num_indices > before - before / 100) break;
+    }
+    return 0;
+}
+
+// Appends coarser levels to an index buffer holding the full detail mesh,
+// each with about 1/reduction of the triangles of the one before, until
+// max_lods levels, fewer than min_triangles, or simplification stalls.
+// Every level is ordered for the vertex cache. lods[0] has to describe
+// the full mesh already. Returns the number of levels, at least 1
+unsigned int mesh_build_lods(const float *vertices, unsigned int stride, unsigned int num_vertices,
+                             unsigned int **indices, MeshLod *lods, unsigned int max_lods,
+                             unsigned int reduction, size_t min_triangles) {
+    unsigned int num_lods = 1;
+    MeshSimplifier s;
+    if (max_lods < 2 || lods[0].num_indices / 3 <= min_triangles * reduction ||
+        mesh_simplifier_init(&s, vertices, stride, num_vertices, *indices, lods[0].num_indices) < 0) {
+        return num_lods;
+    }
+
+    while (num_lods < max_lods) {
+        size_t previous = lods[num_lods - 1].num_indices / 3;
+        size_t target = previous / reduction;
+        if (target < min_triangles || mesh_simplify(&s, target) < 0) break;
+        // Not worth a level if it didn't get a good part of the way there
+        if (s.num_indices / 3 > previous - (previous - target) / 2) break;
+
+        MeshOptimizeStats stats;
+        mesh_optimize_indices(vertices, stride, num_vertices, s.indices, s.num_indices, &stats);
+        size_t first = (size_t)lods[num_lods - 1].first_index + lods[num_lods - 1].num_indices;
+        unsigned int *grown = (unsigned int*)realloc(*indices, (first + s.num_indices) * sizeof(unsigned int));
+        if (!grown) break;
+        *indices = grown;
+        memcpy(&grown[first], s.indices, s.num_indices * sizeof(unsigned int));
+        lods[num_lods] = (MeshLod){(uint32_t)first, (uint32_t)s.num_indices, s.error, 0};
+        num_lods++;
+    }
+    mesh_simplifier_destroy(&s);
+    return num_lods;
+}
+
+#endif // MESH_SIMPLIFY_H
@@ -0,0 +1,505 @@
+#ifndef OBJ_PARSER_H
+#define OBJ_PARSER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "thread_pool.h"
+#include "trace.h"
+
+// Parallel OBJ parser
+// The file is mapped and cut into chunks at line boundaries, and every
+// chunk is parsed on its own by the thread pool into its own arrays.
+// Numbers go through a small hand written parser instead of sscanf.
+// The chunks are then copied into one set of arrays, again in parallel,
+// and face indices are fixed up on the way: absolute ones are already
+// right, but negative (relative) ones could only be resolved against the
+// chunk's own counts, so those get the counts of the chunks before it
+// added. Only geometry is read: v, vt, vn and f, with polygons split into
+// triangle fans. Everything else (groups, materials, lines...) is skipped
+
+#define OBJ_CHUNK_SIZE (4 << 20) // Bytes of text per job, roughly
+
+// Parsed OBJ, before it becomes a mesh
+typedef struct ObjData {
+    float *positions; // xyz
+    float *texcoords; // uv
+    float *normals; // xyz
+    unsigned int num_positions;
+    unsigned int num_texcoords;
+    unsigned int num_normals;
+
+    // Triangle corners as (v, vt, vn) index triples, 0 based, -1 where a
+    // face doesn't have texcoords or normals
+    int *corners;
+    size_t num_triangles;
+} ObjData;
+
+// Growable array, in bytes
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} ObjBuffer;
+
+typedef struct {
+    const char *begin;
+    const char *end;
+
+    ObjBuffer positions;
+    ObjBuffer texcoords;
+    ObjBuffer normals;
+    ObjBuffer corners;
+    ObjBuffer relative; // size_t corner slots holding relative indices
+    int failed; // Out of memory
+    int out_of_range; // Face indices pointing past the data
+    size_t bad_line; // 1 + offset of the first malformed line in the file, 0 if none
+
+    // Where this chunk's data goes in the merged arrays
+    size_t position_base;
+    size_t texcoord_base;
+    size_t normal_base;
+    size_t corner_base;
+} ObjChunk;
+
+typedef struct {
+    const char *file;
+    ObjChunk *chunks;
+    ObjData *data;
+} ObjParseJob;
+
+static void *obj_buffer_grow(ObjBuffer *buffer, size_t bytes) {
+    if (buffer->size + bytes > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (capacity < buffer->size + bytes) capacity *= 2;
+        char *data = (char*)realloc(buffer->data, capacity);
+        if (!data) return NULL;
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    void *end = buffer->data + buffer->size;
+    buffer->size += bytes;
+    return end;
+}
+
+static inline const char *obj_skip_spaces(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    return p;
+}
+
+// Decimal float with optional sign, fraction and exponent. Up to 19
+// significant digits are kept, which is plenty for a float. Returns NULL
+// if there's no number at p
+static const char *obj_parse_float(const char *p, const char *end, float *out) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0; // Significant ones in mantissa
+    int exponent = 0;
+    int any = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) digits++;
+        } else {
+            exponent++;
+        }
+        any = 1;
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) digits++;
+                exponent--;
+            }
+            any = 1;
+            p++;
+        }
+    }
+    if (!any) return NULL;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        int exponent_negative = 0;
+        if (q < end && (*q == '-' || *q == '+')) {
+            exponent_negative = *q == '-';
+            q++;
+        }
+        if (q < end && *q >= '0' && *q <= '9') {
+            int e = 0;
+            while (q < end && *q >= '0' && *q <= '9') {
+                if (e < 10000) e = e * 10 + (*q - '0');
+                q++;
+            }
+            exponent += exponent_negative ? -e : e;
+            p = q;
+        }
+    }
+
+    double value = (double)mantissa;
+    if (exponent < 0) {
+        value = -exponent <= 22 ? value / powers[-exponent] : value * pow(10.0, exponent);
+    } else if (exponent > 0) {
+        value = exponent <= 22 ? value * powers[exponent] : value * pow(10.0, exponent);
+    }
+    *out = (float)(negative ? -value : value);
+    return p;
+}
+
+// Anything that doesn't fit an int is an error rather than wrapping
+// around to some index that happens to exist
+static const char *obj_parse_int(const char *p, const char *end, long *out) {
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if (p >= end || *p < '0' || *p > '9') return NULL;
+    long value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p - '0');
+        if (value > INT_MAX) return NULL;
+        p++;
+    }
+    *out = negative ? -value : value;
+    return p;
+}
+
+// Reads count floats into a new element of buffer
+static const char *obj_parse_floats(const char *p, const char *end, ObjBuffer *buffer, int count, int required, ObjChunk *chunk) {
+    float *out = (float*)obj_buffer_grow(buffer, count * sizeof(float));
+    if (!out) {
+        chunk->failed = 1;
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        p = obj_skip_spaces(p, end);
+        const char *next = obj_parse_float(p, end, &out[i]);
+        if (!next) {
+            if (i < required) {
+                buffer->size -= count * sizeof(float);
+                return NULL;
+            }
+            out[i] = 0;
+            continue;
+        }
+        p = next;
+    }
+    return p;
+}
+
+#define OBJ_MAX_POLYGON 256 // Corners, anything bigger is cut off
+
+// One index of a face vertex. 1 based or negative (counting back from
+// the last element so far, which is count). Relative ones are stored
+// relative to the chunk and remembered for the merge, which is also
+// where both kinds get checked against the whole file's counts.
+// Returns -1 if it can't even be stored as an int
+static inline int obj_resolve_index(long index, size_t count, int *relative, int bit, int *out) {
+    long resolved = index > 0 ? index - 1 : (long)count + index;
+    if (resolved < INT_MIN || resolved > INT_MAX) return -1;
+    if (index < 0) *relative |= bit;
+    *out = (int)resolved;
+    return 0;
+}
+
+static const char *obj_parse_face(const char *p, const char *end, ObjChunk *chunk) {
+    size_t counts[3] = {
+        chunk->positions.size / (3 * sizeof(float)),
+        chunk->texcoords.size / (2 * sizeof(float)),
+        chunk->normals.size / (3 * sizeof(float)),
+    };
+
+    // Read the whole polygon first
+    int polygon[OBJ_MAX_POLYGON][3];
+    unsigned char polygon_relative[OBJ_MAX_POLYGON]; // Bit per relative index
+    int num_corners = 0;
+    int relative = 0;
+    for (;;) {
+        p = obj_skip_spaces(p, end);
+        if (p >= end || *p == '\n' || *p == '\r' || *p == '#') break;
+
+        long index;
+        p = obj_parse_int(p, end, &index);
+        if (!p || index == 0) return NULL;
+        int slot = num_corners < OBJ_MAX_POLYGON ? num_corners : OBJ_MAX_POLYGON - 1;
+        int *corner = polygon[slot];
+        int corner_relative = 0;
+        if (obj_resolve_index(index, counts[0], &corner_relative, 1, &corner[0]) < 0) return NULL;
+        corner[1] = corner[2] = -1;
+        for (int a = 1; a < 3 && p < end && *p == '/'; a++) {
+            p++;
+            if (p < end && *p == '/') continue; // v//vn
+            if (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) break;
+            p = obj_parse_int(p, end, &index);
+            if (!p || index == 0) return NULL;
+            if (obj_resolve_index(index, counts[a], &corner_relative, 1 << a, &corner[a]) < 0) return NULL;
+        }
+        polygon_relative[slot] = corner_relative;
+        relative |= corner_relative;
+        if (num_corners < OBJ_MAX_POLYGON) num_corners++;
+    }
+    if (num_corners < 3) return NULL;
+
+    // Then fan it out into triangles
+    int num_triangles = num_corners - 2;
+    int *out = (int*)obj_buffer_grow(&chunk->corners, (size_t)num_triangles * 9 * sizeof(int));
+    if (!out) {
+        chunk->failed = 1;
+        return NULL;
+    }
+    for (int t = 0; t < num_triangles; t++) {
+        memcpy(out + t * 9, polygon[0], 3 * sizeof(int));
+        memcpy(out + t * 9 + 3, polygon[t + 1], 3 * sizeof(int));
+        memcpy(out + t * 9 + 6, polygon[t + 2], 3 * sizeof(int));
+    }
+
+    // Remember which slots need the earlier chunks' counts added
+    if (relative) {
+        size_t first_slot = out - (int*)chunk->corners.data;
+        for (int t = 0; t < num_triangles; t++) {
+            int corners[3] = {0, t + 1, t + 2};
+            for (int v = 0; v < 3; v++) {
+                for (int a = 0; a < 3; a++) {
+                    if (!(polygon_relative[corners[v]] & (1 << a))) continue;
+                    size_t *mark = (size_t*)obj_buffer_grow(&chunk->relative, sizeof(size_t));
+                    if (!mark) {
+                        chunk->failed = 1;
+                        return NULL;
+                    }
+                    *mark = first_slot + t * 9 + v * 3 + a;
+                }
+            }
+        }
+    }
+    return p;
+}
+
+static void obj_parse_chunk_job(void *ctx, int job, int worker) {
+    TRACE_ZONE("obj_parse_chunk");
+    ObjParseJob *parse = (ObjParseJob*)ctx;
+    ObjChunk *chunk = &parse->chunks[job];
+    const char *p = chunk->begin;
+    const char *end = chunk->end;
+    (void)worker;
+
+    while (p < end && !chunk->failed) {
+        const char *line = p;
+        p = obj_skip_spaces(p, end);
+        const char *next = NULL;
+        int known = 1;
+        if (end - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            next = obj_parse_floats(p + 2, end, &chunk->positions, 3, 3, chunk);
+        } else if (end - p >= 3 && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+            next = obj_parse_floats(p + 3, end, &chunk->texcoords, 2, 1, chunk);
+        } else if (end - p >= 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+            next = obj_parse_floats(p + 3, end, &chunk->normals, 3, 3, chunk);
+        } else if (end - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            next = obj_parse_face(p + 2, end, chunk);
+        } else {
+            known = 0;
+        }
+        if (known && !next && !chunk->failed && !chunk->bad_line) {
+            chunk->bad_line = line - parse->file + 1;
+        }
+
+        // Whatever is left of the line (comments, a 4th vt component...)
+        const char *newline = (const char*)memchr(known && next ? next : p, '\n', end - (known && next ? next : p));
+        p = newline ? newline + 1 : end;
+    }
+}
+
+static void obj_merge_chunk_job(void *ctx, int job, int worker) {
+    TRACE_ZONE("obj_merge_chunk");
+    ObjParseJob *parse = (ObjParseJob*)ctx;
+    ObjChunk *chunk = &parse->chunks[job];
+    ObjData *data = parse->data;
+    (void)worker;
+
+    memcpy(data->positions + chunk->position_base * 3, chunk->positions.data, chunk->positions.size);
+    memcpy(data->texcoords + chunk->texcoord_base * 2, chunk->texcoords.data, chunk->texcoords.size);
+    memcpy(data->normals + chunk->normal_base * 3, chunk->normals.data, chunk->normals.size);
+
+    int *corners = data->corners + chunk->corner_base;
+    size_t num_corners = chunk->corners.size / sizeof(int);
+    memcpy(corners, chunk->corners.data, chunk->corners.size);
+
+    const size_t *relative = (const size_t*)chunk->relative.data;
+    size_t bases[3] = {chunk->position_base, chunk->texcoord_base, chunk->normal_base};
+    // Anything pointing outside the file's data would crash whoever
+    // draws it, so check now. A relative index counting back past the
+    // start of the file is checked before it could pass for -1, "none"
+    for (size_t i = 0; i < chunk->relative.size / sizeof(size_t); i++) {
+        long index = (long)corners[relative[i]] + (long)bases[relative[i] % 3];
+        if (index < 0 || index > INT_MAX) {
+            chunk->out_of_range = 1;
+            return;
+        }
+        corners[relative[i]] = (int)index;
+    }
+    unsigned int counts[3] = {data->num_positions, data->num_texcoords, data->num_normals};
+    for (size_t i = 0; i < num_corners; i++) {
+        int index = corners[i];
+        int attribute = i % 3;
+        if (index < -1 || index >= (int)counts[attribute] || (attribute == 0 && index < 0)) {
+            chunk->out_of_range = 1;
+            break;
+        }
+    }
+}
+
+void obj_data_free(ObjData *data) {
+    free(data->positions);
+    free(data->texcoords);
+    free(data->normals);
+    free(data->corners);
+    memset(data, 0, sizeof(ObjData));
+}
+
+// Parses an OBJ file with num_threads threads (0 for one per core).
+// Returns -1 after printing why if it can't
+int obj_parse_file(const char *path, int num_threads, ObjData *data) {
+    memset(data, 0, sizeof(ObjData));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open file '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Error: '%s' is empty\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    const char *file = (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    madvise((void*)file, size, MADV_SEQUENTIAL);
+
+    // Cut at the first newline after every OBJ_CHUNK_SIZE bytes
+    int num_chunks = (int)((size + OBJ_CHUNK_SIZE - 1) / OBJ_CHUNK_SIZE);
+    ObjChunk *chunks = (ObjChunk*)calloc(num_chunks, sizeof(ObjChunk));
+    if (!chunks) {
+        munmap((void*)file, size);
+        return -1;
+    }
+    const char *p = file;
+    const char *end = file + size;
+    int used = 0;
+    while (p < end) {
+        const char *cut = end - p > OBJ_CHUNK_SIZE ? p + OBJ_CHUNK_SIZE : end;
+        const char *newline = cut < end ? (const char*)memchr(cut, '\n', end - cut) : NULL;
+        cut = newline ? newline + 1 : end;
+        chunks[used].begin = p;
+        chunks[used].end = cut;
+        used++;
+        p = cut;
+    }
+    num_chunks = used;
+
+    ThreadPool *pool = thread_pool_create(num_threads);
+    if (!pool) {
+        free(chunks);
+        munmap((void*)file, size);
+        return -1;
+    }
+
+    ObjParseJob parse = {file, chunks, data};
+    thread_pool_run(pool, obj_parse_chunk_job, &parse, num_chunks);
+
+    // Where every chunk's data starts in the merged arrays
+    int failed = 0;
+    size_t bad_line = 0;
+    size_t positions = 0, texcoords = 0, normals = 0, corners = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        failed |= chunks[i].failed;
+        if (!bad_line) bad_line = chunks[i].bad_line;
+        chunks[i].position_base = positions;
+        chunks[i].texcoord_base = texcoords;
+        chunks[i].normal_base = normals;
+        chunks[i].corner_base = corners;
+        positions += chunks[i].positions.size / (3 * sizeof(float));
+        texcoords += chunks[i].texcoords.size / (2 * sizeof(float));
+        normals += chunks[i].normals.size / (3 * sizeof(float));
+        corners += chunks[i].corners.size / sizeof(int);
+    }
+    if (bad_line) {
+        size_t line = 1;
+        for (const char *c = file; c < file + bad_line - 1; c++) line += *c == '\n';
+        fprintf(stderr, "Warning: skipped malformed data in '%s', first at line %zu\n", path, line);
+    }
+
+    if (!failed && positions < 0x7fffffff && texcoords < 0x7fffffff && normals < 0x7fffffff) {
+        data->num_positions = positions;
+        data->num_texcoords = texcoords;
+        data->num_normals = normals;
+        data->num_triangles = corners / 9;
+        data->positions = (float*)malloc(positions * 3 * sizeof(float) + 1);
+        data->texcoords = (float*)malloc(texcoords * 2 * sizeof(float) + 1);
+        data->normals = (float*)malloc(normals * 3 * sizeof(float) + 1);
+        data->corners = (int*)malloc(corners * sizeof(int) + 1);
+        failed = !data->positions || !data->texcoords || !data->normals || !data->corners;
+        if (!failed) {
+            thread_pool_run(pool, obj_merge_chunk_job, &parse, num_chunks);
+        }
+    } else {
+        failed = 1;
+    }
+    int out_of_range = 0;
+    for (int i = 0; !failed && i < num_chunks; i++) {
+        out_of_range |= chunks[i].out_of_range;
+    }
+    if (failed) {
+        fprintf(stderr, "Error: Out of memory parsing '%s'\n", path);
+    } else if (out_of_range) {
+        fprintf(stderr, "Error: '%s' has face indices out of range\n", path);
+        failed = 1;
+    } else if (data->num_positions == 0 || data->num_triangles == 0) {
+        fprintf(stderr, "Invalid OBJ file: No vertices or faces found\n");
+        failed = 1;
+    }
+
+    for (int i = 0; i < num_chunks; i++) {
+        free(chunks[i].positions.data);
+        free(chunks[i].texcoords.data);
+        free(chunks[i].normals.data);
+        free(chunks[i].corners.data);
+        free(chunks[i].relative.data);
+    }
+    free(chunks);
+    thread_pool_destroy(pool);
+    munmap((void*)file, size);
+
+    if (failed) {
+        obj_data_free(data);
+        return -1;
+    }
+    return 0;
+}
+
+#endif // OBJ_PARSER_H
@@ -0,0 +1,213 @@
+#ifndef PRESENT_QUEUE_H
+#define PRESENT_QUEUE_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "framebuffer.h"
+#include "stats.h"
+#include "trace.h"
+
+// Render/present pipeline
+// Frames go through a ring of pixel buffers. The render thread fills
+// one, submits it and moves on to the next, while a present thread blits
+// submitted frames to the framebuffer in order. depth is how many frames
+// can be submitted but not yet presented: 1 overlaps rendering frame N+1
+// with presenting frame N, more smooths out uneven frames at the cost of
+// latency. With depth 0 there is no thread and submit presents right away
+
+typedef struct PresentQueue {
+    Framebuffer *fb;
+    int width; // Largest frame
+    int height;
+    int depth;
+    int num_buffers; // depth + the one being rendered
+    unsigned char **buffers; // Each big enough for width x height
+    int *frame_width; // Size and scale of the frame in each buffer
+    int *frame_height;
+    int *frame_scale;
+    StatsFrame *frame_stats;
+
+    // Frames head - tail are in flight, slot is index % num_buffers
+    unsigned long head; // Next to render
+    unsigned long tail; // Next to present
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+    pthread_cond_t presented;
+    pthread_t thread;
+    int quit;
+
+    // Stats, written by whoever presents
+    unsigned long frames_presented;
+    unsigned long long bytes_written;
+    double present_ms; // Blit + flip
+    double wait_ms; // Render thread blocked on a free buffer
+    Stats *stats; // NULL for none, otherwise fed every frame presented
+} PresentQueue;
+
+static double present_queue_ms(struct timespec a, struct timespec b) {
+    return (b.tv_sec - a.tv_sec) * 1e3 + (b.tv_nsec - a.tv_nsec) / 1e6;
+}
+
+static void present_queue_present(PresentQueue *queue, int slot) {
+    TRACE_ZONE("present");
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Only this thread touches the blitters, so the scale can change here
+    Framebuffer *fb = queue->fb;
+    framebuffer_set_scale(fb, queue->frame_scale[slot], fb->blitters[0].filter);
+    framebuffer_write(fb, queue->buffers[slot], queue->frame_width[slot], queue->frame_height[slot]);
+    size_t bytes_written = fb->bytes_written;
+    if (queue->stats) {
+        stats_frame(queue->stats, &queue->frame_stats[slot], bytes_written);
+        if (queue->stats->mode == STATS_OVERLAY) {
+            // Over the page after the frame, so damage tracking never
+            // leaves it half covered
+            const Blitter *blitter = &fb->blitters[fb->back];
+            const uint8_t white[4] = {255, 255, 255, 255}, black[4] = {0, 0, 0, 255};
+            bytes_written += stats_draw_overlay(queue->stats, framebuffer_back_page(fb), fb->finfo.line_length,
+                                                fb->vinfo.xres, fb->vinfo.yres, blitter->bytes_per_pixel,
+                                                blit_pack_pixel(blitter, white), blit_pack_pixel(blitter, black));
+        }
+    }
+    framebuffer_flip(fb);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    queue->present_ms += present_queue_ms(start, end);
+    queue->bytes_written += bytes_written;
+    queue->frames_presented++;
+}
+
+static void *present_queue_thread(void *arg) {
+    PresentQueue *queue = (PresentQueue*)arg;
+    trace_thread_name("present");
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (queue->tail == queue->head && !queue->quit) {
+            pthread_cond_wait(&queue->submitted, &queue->lock);
+        }
+        // Whatever was submitted still gets shown before quitting
+        if (queue->tail == queue->head) break;
+
+        int slot = queue->tail % queue->num_buffers;
+        pthread_mutex_unlock(&queue->lock);
+
+        present_queue_present(queue, slot);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->tail++;
+        pthread_cond_signal(&queue->presented);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+int present_queue_init(PresentQueue *queue, Framebuffer *fb, int width, int height, int depth) {
+    memset(queue, 0, sizeof(PresentQueue));
+    queue->fb = fb;
+    queue->width = width;
+    queue->height = height;
+    queue->depth = depth > 0 ? depth : 0;
+    queue->num_buffers = queue->depth + 1;
+
+    queue->buffers = (unsigned char**)calloc(queue->num_buffers, sizeof(unsigned char*));
+    queue->frame_width = (int*)calloc(queue->num_buffers, sizeof(int));
+    queue->frame_height = (int*)calloc(queue->num_buffers, sizeof(int));
+    queue->frame_scale = (int*)calloc(queue->num_buffers, sizeof(int));
+    queue->frame_stats = (StatsFrame*)calloc(queue->num_buffers, sizeof(StatsFrame));
+    int ok = queue->buffers && queue->frame_width && queue->frame_height && queue->frame_scale && queue->frame_stats;
+    for (int i = 0; ok && i < queue->num_buffers; i++) {
+        queue->buffers[i] = (unsigned char*)malloc((size_t)width * height * 4);
+        ok = queue->buffers[i] != NULL;
+    }
+    if (!ok) {
+        for (int i = 0; queue->buffers && i < queue->num_buffers; i++) free(queue->buffers[i]);
+        free(queue->buffers);
+        free(queue->frame_width);
+        free(queue->frame_height);
+        free(queue->frame_scale);
+        free(queue->frame_stats);
+        return -1;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->submitted, NULL);
+    pthread_cond_init(&queue->presented, NULL);
+
+    if (queue->depth > 0 && pthread_create(&queue->thread, NULL, present_queue_thread, queue) != 0) {
+        fprintf(stderr, "Failed to start the present thread, presenting synchronously\n");
+        queue->depth = 0;
+    }
+
+    return 0;
+}
+
+// Buffer to render the next frame into, waits if they're all in flight
+unsigned char *present_queue_acquire(PresentQueue *queue) {
+    if (queue->depth == 0) return queue->buffers[0];
+    TRACE_ZONE("present_queue_acquire");
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->head - queue->tail > (unsigned long)queue->depth) {
+        pthread_cond_wait(&queue->presented, &queue->lock);
+    }
+    unsigned char *pixels = queue->buffers[queue->head % queue->num_buffers];
+    pthread_mutex_unlock(&queue->lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    queue->wait_ms += present_queue_ms(start, end);
+    return pixels;
+}
+
+// Queue the buffer from the last acquire for presenting
+// The frame in it is width x height, scale times smaller than the screen.
+// stats is what --stats gets to know about it, NULL when that's off
+void present_queue_submit(PresentQueue *queue, int width, int height, int scale, const StatsFrame *stats) {
+    int slot = queue->head % queue->num_buffers;
+    queue->frame_width[slot] = width;
+    queue->frame_height[slot] = height;
+    queue->frame_scale[slot] = scale;
+    if (stats) {
+        queue->frame_stats[slot] = *stats;
+        queue->frame_stats[slot].scale = scale;
+    }
+
+    if (queue->depth == 0) {
+        present_queue_present(queue, slot);
+        return;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->head++;
+    pthread_cond_signal(&queue->submitted);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Presents anything still queued, then stops the thread
+void present_queue_destroy(PresentQueue *queue) {
+    if (queue->depth > 0) {
+        pthread_mutex_lock(&queue->lock);
+        queue->quit = 1;
+        pthread_cond_signal(&queue->submitted);
+        pthread_mutex_unlock(&queue->lock);
+        pthread_join(queue->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->submitted);
+    pthread_cond_destroy(&queue->presented);
+    for (int i = 0; i < queue->num_buffers; i++) {
+        free(queue->buffers[i]);
+    }
+    free(queue->buffers);
+    free(queue->frame_width);
+    free(queue->frame_height);
+    free(queue->frame_scale);
+    free(queue->frame_stats);
+}
+
+#endif // PRESENT_QUEUE_H
@@ -0,0 +1,1153 @@
+#ifndef RASTERIZER_H
+#define RASTERIZER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "vectors.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "culling.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RASTER_X86 1
+#endif
+
+// CPU rasterizer used when there's no GPU (or when asked to with --cpu)
+//
+// A frame goes like this:
+// 1. raster_begin_frame() resets the bins
+// 2. raster_draw() queues a draw. Nothing happens yet, so a scene with
+//    thousands of small instances doesn't pay for waking the workers
+//    once per instance
+// 3. raster_end_frame() transforms, clips and sets up the triangles of
+//    every queued draw, then drops each into the bin of every screen
+//    tile its bounding box touches. The triangles of all the draws are
+//    split into one contiguous range per worker so this part runs in
+//    parallel too. Then it rasterizes all the tiles in parallel, each
+//    tile only looking at its own bin, straight into the RGBA pixel buffer
+//
+// The output matches what glReadPixels gives us (RGBA, bottom row first)
+// so copy_to_framebuffer() doesn't care which backend drew the frame
+//
+// Inside a tile, triangles are walked in 8x2 pixel blocks. The edge
+// functions are computed at the start of each block row and stepped
+// one block at a time, and every pixel in a block is block value +
+// a*i + b*j. The scalar, SSE2 and AVX2 kernels all do exactly these
+// float operations in this order, so they give bit-identical output
+// (as long as the compiler doesn't fuse them, see -ffp-contract=off)
+//
+// Next to the depth buffer there's a coarse max depth per 8x8 cell and
+// per tile. A triangle whose nearest point is behind the farthest depth
+// of a tile is skipped for that tile, and the same goes for every cell
+// it touches, before any of their pixels get looked at
+
+#define RASTER_TILE_SIZE 64
+#define RASTER_SUBPIXEL 16.0f // Vertices get snapped to 1/16th of a pixel
+#define RASTER_NEAR_W 1e-5f
+#define RASTER_BLOCK_W 8
+#define RASTER_BLOCK_H 2
+#define RASTER_HIZ_SIZE 8 // Has to match RASTER_BLOCK_W
+#define RASTER_HIZ_EPSILON 1e-6f // Keeps rounding from rejecting pixels that would pass
+#define RASTER_HIZ_TILE_REFRESH 16 // Triangles drawn before a tile's max depth gets refreshed
+
+enum {
+    RASTER_KERNEL_AUTO,
+    RASTER_KERNEL_SCALAR,
+    RASTER_KERNEL_SSE2,
+    RASTER_KERNEL_AVX2
+};
+
+// Everything a tile needs to rasterize a triangle
+typedef struct RasterTriangle {
+    float x0, y0;        // First vertex, edge functions are relative to it
+    float a[3], b[3];    // Edge function E(x, y) = a*(x - xi) + b*(y - yi)
+    float ex[3], ey[3];  // Starting vertex of each edge
+    float z0, dzdx, dzdy;
+    int top_left[3];     // Top-left fill rule, include pixels with E == 0
+    float zmin;          // Nearest vertex
+    int min_x, min_y, max_x, max_y;
+    uint32_t color;
+    unsigned int seq;    // Submission order, bins are merged by it
+} RasterTriangle;
+
+typedef struct {
+    unsigned int *tris;
+    int count;
+    int capacity;
+} RasterBin;
+
+// Every setup job owns its triangles and a full set of bins, so no
+// locking is needed while binning
+typedef struct {
+    RasterTriangle *tris;
+    int count;
+    int capacity;
+    RasterBin *bins;
+    unsigned long long dropped; // Triangles it had no memory to bin this frame
+} RasterPartition;
+
+// Per frame counters
+typedef struct {
+    unsigned long long triangles_rejected; // Whole triangle behind a tile, counted per tile
+    unsigned long long blocks_tested;      // 8x8 cells checked against the depth hierarchy
+    unsigned long long blocks_rejected;    // ...and skipped because they were behind
+    unsigned long long fragments_shaded;   // Pixels that passed the depth test and got written
+    unsigned long long triangles_dropped;  // Left out of some or all tiles, out of memory
+} RasterStats;
+
+// Each worker counts on its own cache line
+typedef struct {
+    RasterStats stats;
+    char padding[64 - sizeof(RasterStats) % 64];
+} RasterWorkerStats;
+
+// A queued draw, with the state it was queued with
+typedef struct RasterDraw {
+    const float *positions;
+    const float *normals;
+    unsigned int stride; // Floats from one vertex to the next
+    const void *indices;
+    unsigned int index_size; // 2 or 4 bytes
+    unsigned int first_range; // Into the rasterizer's ranges
+    unsigned int num_ranges;
+    unsigned int first_triangle; // Numbered across every draw of the frame
+    unsigned int num_triangles;
+    mat4 mvp;
+    mat4 model;
+    vec3 base_color;
+} RasterDraw;
+
+struct Rasterizer;
+
+// Rasterizes a triangle inside the given (inclusive) pixel rectangle
+typedef void (*raster_kernel_fn)(struct Rasterizer *r, const struct RasterTriangle *tri,
+                                 int min_x, int min_y, int max_x, int max_y,
+                                 RasterStats *stats);
+
+typedef struct Rasterizer {
+    int width;
+    int height;
+    int tiles_x;
+    int tiles_y;
+    int max_width; // What the buffers were allocated for
+    int max_height;
+    int max_tiles;
+
+    float *depth;
+    uint32_t clear_color;
+    unsigned char *pixels;
+
+    // Depth hierarchy, farthest depth per 8x8 cell and per tile
+    int hiz_enabled;
+    int hiz_width;
+    int hiz_height;
+    float *hiz;
+    float *tile_max_depth;
+
+    RasterWorkerStats *worker_stats;
+    RasterStats stats; // Totals of the last finished frame
+
+    raster_kernel_fn kernel;
+    const char *kernel_name;
+
+    ThreadPool *pool;
+    int num_partitions;
+    RasterPartition *partitions;
+    unsigned int next_seq;
+
+    // Draws queued since raster_begin_frame(), read by the setup jobs
+    RasterDraw *draws;
+    unsigned int num_draws;
+    unsigned int draw_capacity;
+    DrawRange *ranges; // Copies of every draw's ranges
+    unsigned int num_ranges;
+    unsigned int range_capacity;
+    unsigned int num_triangles; // In all the draws
+
+    // Picked up by every draw queued after they're set
+    vec3 light_dir;
+    vec3 base_color;
+} Rasterizer;
+
+int raster_set_kernel(Rasterizer *r, int kernel);
+void raster_destroy(Rasterizer *r);
+
+static uint32_t raster_pack_color(vec4 color) {
+    uint32_t r = (uint32_t)(fminf(fmaxf(color.x, 0.0f), 1.0f) * 255.0f + 0.5f);
+    uint32_t g = (uint32_t)(fminf(fmaxf(color.y, 0.0f), 1.0f) * 255.0f + 0.5f);
+    uint32_t b = (uint32_t)(fminf(fmaxf(color.z, 0.0f), 1.0f) * 255.0f + 0.5f);
+    uint32_t a = (uint32_t)(fminf(fmaxf(color.w, 0.0f), 1.0f) * 255.0f + 0.5f);
+    // Byte order in memory is R, G, B, A like GL_RGBA/GL_UNSIGNED_BYTE
+    return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+// num_threads <= 0 means one per core
+Rasterizer* raster_create(int width, int height, int num_threads) {
+    Rasterizer *r = (Rasterizer*)calloc(1, sizeof(Rasterizer));
+    if (!r) return NULL;
+
+    r->width = width;
+    r->height = height;
+    r->max_width = width;
+    r->max_height = height;
+    r->tiles_x = (width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    r->tiles_y = (height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    r->max_tiles = r->tiles_x * r->tiles_y;
+    r->depth = (float*)malloc((size_t)width * height * sizeof(float));
+    r->hiz_enabled = 1;
+    r->hiz_width = (width + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE;
+    r->hiz_height = (height + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE;
+    r->hiz = (float*)malloc((size_t)r->hiz_width * r->hiz_height * sizeof(float));
+    r->tile_max_depth = (float*)malloc((size_t)r->tiles_x * r->tiles_y * sizeof(float));
+    r->pool = thread_pool_create(num_threads);
+    if (!r->depth || !r->hiz || !r->tile_max_depth || !r->pool) {
+        free(r->depth);
+        free(r->hiz);
+        free(r->tile_max_depth);
+        thread_pool_destroy(r->pool);
+        free(r);
+        return NULL;
+    }
+    r->worker_stats = (RasterWorkerStats*)calloc(r->pool->num_workers, sizeof(RasterWorkerStats));
+    r->partitions = (RasterPartition*)calloc(r->pool->num_workers, sizeof(RasterPartition));
+    if (!r->worker_stats || !r->partitions) {
+        raster_destroy(r);
+        return NULL;
+    }
+    r->num_partitions = r->pool->num_workers;
+    for (int p = 0; p < r->num_partitions; p++) {
+        r->partitions[p].bins = (RasterBin*)calloc(r->max_tiles, sizeof(RasterBin));
+        if (!r->partitions[p].bins) {
+            raster_destroy(r);
+            return NULL;
+        }
+    }
+
+    raster_set_kernel(r, RASTER_KERNEL_AUTO);
+    r->light_dir = normalize_vec3((vec3){1.0f, 1.0f, 1.0f});
+    r->base_color = (vec3){0.8f, 0.8f, 0.8f};
+    return r;
+}
+
+void raster_destroy(Rasterizer *r) {
+    if (!r) return;
+
+    for (int p = 0; p < r->num_partitions; p++) {
+        for (int t = 0; r->partitions[p].bins && t < r->max_tiles; t++) {
+            free(r->partitions[p].bins[t].tris);
+        }
+        free(r->partitions[p].bins);
+        free(r->partitions[p].tris);
+    }
+    free(r->partitions);
+    free(r->draws);
+    free(r->ranges);
+    thread_pool_destroy(r->pool);
+    free(r->worker_stats);
+    free(r->tile_max_depth);
+    free(r->hiz);
+    free(r->depth);
+    free(r);
+}
+
+// Renders at a different size from the next frame on, reusing all the
+// buffers. Can't go past the size the rasterizer was created with
+int raster_resize(Rasterizer *r, int width, int height) {
+    if (width <= 0 || height <= 0 || width > r->max_width || height > r->max_height) {
+        return -1;
+    }
+
+    r->width = width;
+    r->height = height;
+    r->tiles_x = (width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    r->tiles_y = (height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    r->hiz_width = (width + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE;
+    r->hiz_height = (height + RASTER_HIZ_SIZE - 1) / RASTER_HIZ_SIZE;
+    return 0;
+}
+
+void raster_begin_frame(Rasterizer *r, vec4 clear_color) {
+    r->clear_color = raster_pack_color(clear_color);
+    r->next_seq = 0;
+    r->num_draws = 0;
+    r->num_ranges = 0;
+    r->num_triangles = 0;
+    memset(r->worker_stats, 0, r->pool->num_workers * sizeof(RasterWorkerStats));
+    for (int p = 0; p < r->num_partitions; p++) {
+        r->partitions[p].count = 0;
+        r->partitions[p].dropped = 0;
+        for (int t = 0; t < r->tiles_x * r->tiles_y; t++) {
+            r->partitions[p].bins[t].count = 0;
+        }
+    }
+}
+
+// Returns -1, leaving the bin as it was, if it can't grow
+static int raster_bin_push(RasterBin *bin, unsigned int tri) {
+    if (bin->count == bin->capacity) {
+        int capacity = bin->capacity ? bin->capacity * 2 : 64;
+        unsigned int *tris = (unsigned int*)realloc(bin->tris, capacity * sizeof(unsigned int));
+        if (!tris) return -1;
+        bin->tris = tris;
+        bin->capacity = capacity;
+    }
+    bin->tris[bin->count++] = tri;
+    return 0;
+}
+
+// Projects a clip space triangle, sets up its edge functions and bins it
+static void raster_setup_triangle(Rasterizer *r, RasterPartition *part, vec4 clip[3],
+                                  uint32_t color, unsigned int seq) {
+    float x[3], y[3], z[3];
+    for (int i = 0; i < 3; i++) {
+        float inv_w = 1.0f / clip[i].w;
+        // Viewport transform, snapped to the subpixel grid
+        x[i] = roundf((clip[i].x * inv_w * 0.5f + 0.5f) * r->width * RASTER_SUBPIXEL) / RASTER_SUBPIXEL;
+        y[i] = roundf((clip[i].y * inv_w * 0.5f + 0.5f) * r->height * RASTER_SUBPIXEL) / RASTER_SUBPIXEL;
+        z[i] = clip[i].z * inv_w * 0.5f + 0.5f;
+    }
+
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+    if (area == 0.0f) return;
+
+    // Culling is off in the GL path too, so just flip clockwise triangles
+    if (area < 0.0f) {
+        float tmp;
+        tmp = x[1]; x[1] = x[2]; x[2] = tmp;
+        tmp = y[1]; y[1] = y[2]; y[2] = tmp;
+        tmp = z[1]; z[1] = z[2]; z[2] = tmp;
+        area = -area;
+    }
+
+    // Pixel centers are at +0.5
+    float fmin_x = fminf(x[0], fminf(x[1], x[2]));
+    float fmax_x = fmaxf(x[0], fmaxf(x[1], x[2]));
+    float fmin_y = fminf(y[0], fminf(y[1], y[2]));
+    float fmax_y = fmaxf(y[0], fmaxf(y[1], y[2]));
+    int min_x = (int)fmaxf(ceilf(fmin_x - 0.5f), 0.0f);
+    int min_y = (int)fmaxf(ceilf(fmin_y - 0.5f), 0.0f);
+    int max_x = (int)fminf(floorf(fmax_x - 0.5f), r->width - 1);
+    int max_y = (int)fminf(floorf(fmax_y - 0.5f), r->height - 1);
+    if (min_x > max_x || min_y > max_y) return;
+
+    if (part->count == part->capacity) {
+        int capacity = part->capacity ? part->capacity * 2 : 1024;
+        RasterTriangle *tris = (RasterTriangle*)realloc(part->tris, capacity * sizeof(RasterTriangle));
+        if (!tris) {
+            part->dropped++;
+            return;
+        }
+        part->tris = tris;
+        part->capacity = capacity;
+    }
+    RasterTriangle *tri = &part->tris[part->count];
+
+    tri->x0 = x[0];
+    tri->y0 = y[0];
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        tri->a[i] = y[i] - y[j];
+        tri->b[i] = x[j] - x[i];
+        tri->ex[i] = x[i];
+        tri->ey[i] = y[i];
+        // Left edges go down, top edges go left (counter-clockwise, y up)
+        tri->top_left[i] = tri->a[i] > 0.0f || (tri->a[i] == 0.0f && tri->b[i] < 0.0f);
+    }
+
+    // Depth plane
+    float dx1 = x[1] - x[0], dy1 = y[1] - y[0], dz1 = z[1] - z[0];
+    float dx2 = x[2] - x[0], dy2 = y[2] - y[0], dz2 = z[2] - z[0];
+    tri->z0 = z[0];
+    tri->zmin = fminf(z[0], fminf(z[1], z[2]));
+    tri->dzdx = (dz1 * dy2 - dz2 * dy1) / area;
+    tri->dzdy = (dx1 * dz2 - dx2 * dz1) / area;
+
+    tri->min_x = min_x;
+    tri->min_y = min_y;
+    tri->max_x = max_x;
+    tri->max_y = max_y;
+    tri->color = color;
+    tri->seq = seq;
+
+    unsigned int index = part->count++;
+    int missing = 0;
+    for (int ty = min_y / RASTER_TILE_SIZE; ty <= max_y / RASTER_TILE_SIZE; ty++) {
+        for (int tx = min_x / RASTER_TILE_SIZE; tx <= max_x / RASTER_TILE_SIZE; tx++) {
+            if (raster_bin_push(&part->bins[ty * r->tiles_x + tx], index) < 0) missing = 1;
+        }
+    }
+    part->dropped += missing;
+}
+
+// Clips against the near plane (z >= -w), everything else is
+// handled by the bounding box clamp
+static void raster_clip_triangle(Rasterizer *r, RasterPartition *part, vec4 clip[3],
+                                 uint32_t color, unsigned int seq) {
+    float dist[3];
+    int inside = 0;
+    for (int i = 0; i < 3; i++) {
+        dist[i] = clip[i].z + clip[i].w;
+        if (dist[i] >= 0.0f && clip[i].w > RASTER_NEAR_W) inside++;
+    }
+
+    if (inside == 3) {
+        raster_setup_triangle(r, part, clip, color, seq);
+        return;
+    }
+    if (inside == 0) return;
+
+    // Sutherland-Hodgman against a single plane, gives 3 or 4 vertices
+    vec4 poly[4];
+    int n = 0;
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        int in_i = dist[i] >= 0.0f && clip[i].w > RASTER_NEAR_W;
+        int in_j = dist[j] >= 0.0f && clip[j].w > RASTER_NEAR_W;
+        if (in_i) poly[n++] = clip[i];
+        if (in_i != in_j) {
+            float t = dist[i] / (dist[i] - dist[j]);
+            poly[n++] = add_vec4(clip[i], scale_vec4(subtract_vec4(clip[j], clip[i]), t));
+        }
+    }
+
+    for (int i = 1; i + 1 < n; i++) {
+        vec4 fan[3] = {poly[0], poly[i], poly[i + 1]};
+        if (fan[0].w > RASTER_NEAR_W && fan[1].w > RASTER_NEAR_W && fan[2].w > RASTER_NEAR_W) {
+            raster_setup_triangle(r, part, fan, color, seq);
+        }
+    }
+}
+
+// Flat lambert shading, same light as the GL fragment shader
+static uint32_t raster_shade(Rasterizer *r, const RasterDraw *draw, vec3 world[3],
+                             unsigned int i0, unsigned int i1, unsigned int i2) {
+    vec3 normal;
+    const float *normals = draw->normals;
+    if (normals) {
+        const float *a = &normals[(size_t)i0 * draw->stride];
+        const float *b = &normals[(size_t)i1 * draw->stride];
+        const float *c = &normals[(size_t)i2 * draw->stride];
+        vec3 n0 = {a[0], a[1], a[2]};
+        vec3 n1 = {b[0], b[1], b[2]};
+        vec3 n2 = {c[0], c[1], c[2]};
+        vec3 n = add_vec3(add_vec3(n0, n1), n2);
+        // mat3(u_model) * normal
+        const float *m = draw->model.m;
+        normal.x = m[0] * n.x + m[4] * n.y + m[8] * n.z;
+        normal.y = m[1] * n.x + m[5] * n.y + m[9] * n.z;
+        normal.z = m[2] * n.x + m[6] * n.y + m[10] * n.z;
+    } else {
+        normal = cross_vec3(subtract_vec3(world[1], world[0]), subtract_vec3(world[2], world[0]));
+    }
+    normal = normalize_vec3(normal);
+
+    float diffuse = fmaxf(dot_vec3(normal, r->light_dir), 0.0f);
+    float ambient = 0.1f;
+    vec4 color = {
+        (ambient + diffuse) * draw->base_color.x,
+        (ambient + diffuse) * draw->base_color.y,
+        (ambient + diffuse) * draw->base_color.z,
+        1.0f
+    };
+    return raster_pack_color(color);
+}
+
+static inline unsigned int raster_index(const RasterDraw *draw, size_t i) {
+    return draw->index_size == 2 ? ((const uint16_t*)draw->indices)[i] : ((const uint32_t*)draw->indices)[i];
+}
+
+static void raster_setup_indexed_triangle(Rasterizer *r, RasterPartition *part, const RasterDraw *draw,
+                                          size_t first_index, unsigned int seq) {
+    unsigned int idx[3] = {raster_index(draw, first_index), raster_index(draw, first_index + 1),
+                           raster_index(draw, first_index + 2)};
+    vec4 clip[3];
+    vec3 world[3];
+    int outside_mask = 0x3f;
+    for (int i = 0; i < 3; i++) {
+        const float *p = &draw->positions[(size_t)idx[i] * draw->stride];
+        vec4 v = {p[0], p[1], p[2], 1.0f};
+        clip[i] = mat4_transform_vec4(draw->mvp, v);
+        if (!draw->normals) {
+            world[i] = mat4_transform_vec3(draw->model, (vec3){p[0], p[1], p[2]});
+        }
+
+        // Trivial reject when all vertices are outside the same plane
+        int outside = 0;
+        if (clip[i].x < -clip[i].w) outside |= 1;
+        if (clip[i].x >  clip[i].w) outside |= 2;
+        if (clip[i].y < -clip[i].w) outside |= 4;
+        if (clip[i].y >  clip[i].w) outside |= 8;
+        if (clip[i].z < -clip[i].w) outside |= 16;
+        if (clip[i].z >  clip[i].w) outside |= 32;
+        outside_mask &= outside;
+    }
+    if (outside_mask) return;
+
+    uint32_t color = raster_shade(r, draw, world, idx[0], idx[1], idx[2]);
+    raster_clip_triangle(r, part, clip, color, seq);
+}
+
+static void raster_setup_job(void *ctx, int job, int worker) {
+    TRACE_ZONE("raster_setup");
+    Rasterizer *r = (Rasterizer*)ctx;
+    RasterPartition *part = &r->partitions[job];
+
+    // Triangles are numbered across all the draws and their ranges, and
+    // every job takes an even share of them wherever they are
+    unsigned int first = (unsigned int)((unsigned long long)r->num_triangles * job / r->num_partitions);
+    unsigned int last = (unsigned int)((unsigned long long)r->num_triangles * (job + 1) / r->num_partitions);
+    if (first >= last) return;
+
+    // Last draw starting at or before the first triangle
+    unsigned int lo = 0, hi = r->num_draws - 1;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi + 1) / 2;
+        if (r->draws[mid].first_triangle <= first) lo = mid;
+        else hi = mid - 1;
+    }
+
+    unsigned int t = first;
+    for (unsigned int d = lo; d < r->num_draws && t < last; d++) {
+        const RasterDraw *draw = &r->draws[d];
+        unsigned int range_start = draw->first_triangle;
+        for (unsigned int i = 0; i < draw->num_ranges && t < last; i++) {
+            const DrawRange *range = &r->ranges[draw->first_range + i];
+            unsigned int range_end = range_start + range->num_indices / 3;
+            for (; t < range_end && t < last; t++) {
+                size_t first_index = range->first_index + (size_t)(t - range_start) * 3;
+                raster_setup_indexed_triangle(r, part, draw, first_index, r->next_seq + t);
+            }
+            range_start = range_end;
+        }
+    }
+}
+
+// Queues the given ranges of an indexed triangle list, drawn with the
+// current base_color and light_dir. Positions and normals (which can be
+// NULL) are read stride floats apart, so they can share one interleaved
+// array, and the indices are uint16_t or uint32_t depending on
+// index_size. The ranges are copied, the vertex and index arrays have to
+// stay around until raster_end_frame()
+void raster_draw_ranges(Rasterizer *r, const float *positions, const float *normals, unsigned int stride,
+                        const void *indices, unsigned int index_size,
+                        const DrawRange *ranges, unsigned int num_ranges,
+                        mat4 mvp, mat4 model) {
+    unsigned int num_triangles = 0;
+    for (unsigned int i = 0; i < num_ranges; i++) {
+        num_triangles += ranges[i].num_indices / 3;
+    }
+    if (num_triangles == 0) return;
+
+    if (r->num_draws == r->draw_capacity) {
+        unsigned int capacity = r->draw_capacity ? r->draw_capacity * 2 : 64;
+        RasterDraw *draws = (RasterDraw*)realloc(r->draws, capacity * sizeof(RasterDraw));
+        if (!draws) return;
+        r->draws = draws;
+        r->draw_capacity = capacity;
+    }
+    if (r->num_ranges + num_ranges > r->range_capacity) {
+        unsigned int capacity = r->range_capacity ? r->range_capacity : 256;
+        while (capacity < r->num_ranges + num_ranges) capacity *= 2;
+        DrawRange *copies = (DrawRange*)realloc(r->ranges, capacity * sizeof(DrawRange));
+        if (!copies) return;
+        r->ranges = copies;
+        r->range_capacity = capacity;
+    }
+
+    RasterDraw *draw = &r->draws[r->num_draws++];
+    draw->positions = positions;
+    draw->normals = normals;
+    draw->stride = stride;
+    draw->indices = indices;
+    draw->index_size = index_size;
+    draw->first_range = r->num_ranges;
+    draw->num_ranges = num_ranges;
+    draw->first_triangle = r->num_triangles;
+    draw->num_triangles = num_triangles;
+    draw->mvp = mvp;
+    draw->model = model;
+    draw->base_color = r->base_color;
+    memcpy(&r->ranges[r->num_ranges], ranges, num_ranges * sizeof(DrawRange));
+    r->num_ranges += num_ranges;
+    r->num_triangles += num_triangles;
+}
+
+// Queues a whole indexed triangle list
+void raster_draw(Rasterizer *r, const float *positions, const float *normals, unsigned int stride,
+                 const void *indices, unsigned int index_size, unsigned int num_indices,
+                 mat4 mvp, mat4 model) {
+    DrawRange whole = {0, num_indices};
+    raster_draw_ranges(r, positions, normals, stride, indices, index_size, &whole, 1, mvp, model);
+}
+
+// Walks the 8x8 depth cells covering the rectangle, and the 8x2 blocks
+// inside each of them, handing every block to the block function along
+// with the edge and depth values at its first pixel center.
+// Always inlined so every kernel gets its own copy with the block and
+// cell functions inlined too, but the stepping is shared by all of them
+//
+// Before touching a cell, the nearest depth the triangle can have in it
+// is compared against the farthest depth already in the cell. If the
+// triangle is behind everything there the whole cell is skipped
+typedef int (*raster_block_fn)(Rasterizer *r, const RasterTriangle *tri, int bx, int by,
+                               const float e[3], float z,
+                               int min_x, int min_y, int max_x, int max_y);
+typedef float (*raster_cell_fn)(Rasterizer *r, int cx, int cy);
+
+static inline __attribute__((always_inline))
+void raster_walk_blocks(Rasterizer *r, const RasterTriangle *tri,
+                        int min_x, int min_y, int max_x, int max_y,
+                        raster_block_fn block, raster_cell_fn cell_max_depth,
+                        RasterStats *stats) {
+    int cx0 = min_x & ~(RASTER_HIZ_SIZE - 1);
+    int cy0 = min_y & ~(RASTER_HIZ_SIZE - 1);
+    float step_e[3] = {
+        tri->b[0] * RASTER_BLOCK_H,
+        tri->b[1] * RASTER_BLOCK_H,
+        tri->b[2] * RASTER_BLOCK_H
+    };
+    float step_z = tri->dzdy * RASTER_BLOCK_H;
+
+    // How much the depth plane drops from the first pixel center
+    // of a cell to its nearest corner
+    float corner_dz = fminf(tri->dzdx, 0.0f) * (RASTER_HIZ_SIZE - 1) +
+                      fminf(tri->dzdy, 0.0f) * (RASTER_HIZ_SIZE - 1);
+
+    for (int cy = cy0; cy <= max_y; cy += RASTER_HIZ_SIZE) {
+        float *hiz_row = r->hiz + (cy / RASTER_HIZ_SIZE) * r->hiz_width;
+
+        for (int cx = cx0; cx <= max_x; cx += RASTER_HIZ_SIZE) {
+            float px = cx + 0.5f;
+            float py = cy + 0.5f;
+            float z = tri->z0 + tri->dzdx * (px - tri->x0) + tri->dzdy * (py - tri->y0);
+            float *cell_max = &hiz_row[cx / RASTER_HIZ_SIZE];
+
+            if (r->hiz_enabled) {
+                stats->blocks_tested++;
+                float nearest = fmaxf(z + corner_dz, tri->zmin);
+                if (nearest - RASTER_HIZ_EPSILON > *cell_max) {
+                    stats->blocks_rejected++;
+                    continue;
+                }
+            }
+
+            float e[3];
+            for (int k = 0; k < 3; k++) {
+                e[k] = tri->a[k] * (px - tri->ex[k]) + tri->b[k] * (py - tri->ey[k]);
+            }
+
+            int written = 0;
+            for (int by = cy; by < cy + RASTER_HIZ_SIZE; by += RASTER_BLOCK_H) {
+                if (by + RASTER_BLOCK_H > min_y && by <= max_y) {
+                    written += block(r, tri, cx, by, e, z, min_x, min_y, max_x, max_y);
+                }
+                e[0] += step_e[0];
+                e[1] += step_e[1];
+                e[2] += step_e[2];
+                z += step_z;
+            }
+
+            if (written) {
+                stats->fragments_shaded += written;
+                if (r->hiz_enabled) {
+                    *cell_max = cell_max_depth(r, cx, cy);
+                }
+            }
+        }
+    }
+}
+
+// Reference version, also used by the SIMD kernels for blocks hanging
+// off the right or top edge of the screen. Returns how many pixels got written
+static int raster_block_scalar(Rasterizer *r, const RasterTriangle *tri, int bx, int by,
+                               const float e[3], float z,
+                               int min_x, int min_y, int max_x, int max_y) {
+    int written = 0;
+    for (int j = 0; j < RASTER_BLOCK_H; j++) {
+        int y = by + j;
+        if (y < min_y || y > max_y) continue;
+
+        uint32_t *color_row = (uint32_t*)r->pixels + (size_t)y * r->width;
+        float *depth_row = r->depth + (size_t)y * r->width;
+
+        for (int i = 0; i < RASTER_BLOCK_W; i++) {
+            int x = bx + i;
+            if (x < min_x || x > max_x) continue;
+
+            int covered = 1;
+            for (int k = 0; k < 3; k++) {
+                float ek = e[k] + (tri->a[k] * (float)i + tri->b[k] * (float)j);
+                covered &= tri->top_left[k] ? ek >= 0.0f : ek > 0.0f;
+            }
+            if (!covered) continue;
+
+            float zp = z + (tri->dzdx * (float)i + tri->dzdy * (float)j);
+            if (zp >= 0.0f && zp <= depth_row[x]) {
+                depth_row[x] = zp;
+                color_row[x] = tri->color;
+                written++;
+            }
+        }
+    }
+    return written;
+}
+
+// Farthest depth in a cell, clipped to the screen
+static float raster_cell_max_scalar(Rasterizer *r, int cx, int cy) {
+    int x1 = cx + RASTER_HIZ_SIZE < r->width ? cx + RASTER_HIZ_SIZE : r->width;
+    int y1 = cy + RASTER_HIZ_SIZE < r->height ? cy + RASTER_HIZ_SIZE : r->height;
+    float max_depth = 0.0f;
+    for (int y = cy; y < y1; y++) {
+        const float *depth_row = r->depth + (size_t)y * r->width;
+        for (int x = cx; x < x1; x++) {
+            if (depth_row[x] > max_depth) max_depth = depth_row[x];
+        }
+    }
+    return max_depth;
+}
+
+static void raster_triangle_scalar(Rasterizer *r, const RasterTriangle *tri,
+                                   int min_x, int min_y, int max_x, int max_y,
+                                   RasterStats *stats) {
+    raster_walk_blocks(r, tri, min_x, min_y, max_x, max_y,
+                       raster_block_scalar, raster_cell_max_scalar, stats);
+}
+
+#ifdef RASTER_X86
+// 8x2 block as four 4-wide halves
+__attribute__((target("sse2")))
+static inline int raster_block_sse2(Rasterizer *r, const RasterTriangle *tri, int bx, int by,
+                                    const float e[3], float z,
+                                    int min_x, int min_y, int max_x, int max_y) {
+    if (bx + RASTER_BLOCK_W > r->width || by + RASTER_BLOCK_H > r->height) {
+        return raster_block_scalar(r, tri, bx, by, e, z, min_x, min_y, max_x, max_y);
+    }
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128i all = _mm_set1_epi32(-1);
+    __m128 lx[2] = {_mm_setr_ps(0, 1, 2, 3), _mm_setr_ps(4, 5, 6, 7)};
+    __m128 color = _mm_castsi128_ps(_mm_set1_epi32((int)tri->color));
+    int written = 0;
+
+    // Lanes outside the rectangle are off
+    __m128 x_mask[2];
+    for (int h = 0; h < 2; h++) {
+        __m128i xi = _mm_add_epi32(_mm_set1_epi32(bx + h * 4), _mm_setr_epi32(0, 1, 2, 3));
+        __m128i out = _mm_or_si128(_mm_cmpgt_epi32(_mm_set1_epi32(min_x), xi),
+                                   _mm_cmpgt_epi32(xi, _mm_set1_epi32(max_x)));
+        x_mask[h] = _mm_castsi128_ps(_mm_xor_si128(out, all));
+    }
+
+    for (int j = 0; j < RASTER_BLOCK_H; j++) {
+        int y = by + j;
+        if (y < min_y || y > max_y) continue;
+
+        __m128 ly = _mm_set1_ps((float)j);
+        float *depth = r->depth + (size_t)y * r->width + bx;
+        float *pixel = (float*)((uint32_t*)r->pixels + (size_t)y * r->width + bx);
+
+        for (int h = 0; h < 2; h++) {
+            __m128 mask = x_mask[h];
+            for (int k = 0; k < 3; k++) {
+                __m128 off = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri->a[k]), lx[h]),
+                                        _mm_mul_ps(_mm_set1_ps(tri->b[k]), ly));
+                __m128 ek = _mm_add_ps(_mm_set1_ps(e[k]), off);
+                mask = _mm_and_ps(mask, tri->top_left[k] ? _mm_cmpge_ps(ek, zero)
+                                                         : _mm_cmpgt_ps(ek, zero));
+            }
+            if (!_mm_movemask_ps(mask)) continue;
+
+            __m128 zoff = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri->dzdx), lx[h]),
+                                     _mm_mul_ps(_mm_set1_ps(tri->dzdy), ly));
+            __m128 zv = _mm_add_ps(_mm_set1_ps(z), zoff);
+            __m128 d = _mm_loadu_ps(depth + h * 4);
+            mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(zv, zero), _mm_cmple_ps(zv, d)));
+            int bits = _mm_movemask_ps(mask);
+            if (!bits) continue;
+
+            __m128 c = _mm_loadu_ps(pixel + h * 4);
+            _mm_storeu_ps(depth + h * 4, _mm_or_ps(_mm_and_ps(mask, zv), _mm_andnot_ps(mask, d)));
+            _mm_storeu_ps(pixel + h * 4, _mm_or_ps(_mm_and_ps(mask, color), _mm_andnot_ps(mask, c)));
+            written += __builtin_popcount(bits);
+        }
+    }
+    return written;
+}
+
+__attribute__((target("sse2")))
+static inline float raster_cell_max_sse2(Rasterizer *r, int cx, int cy) {
+    if (cx + RASTER_HIZ_SIZE > r->width || cy + RASTER_HIZ_SIZE > r->height) {
+        return raster_cell_max_scalar(r, cx, cy);
+    }
+
+    __m128 max_depth = _mm_setzero_ps();
+    for (int y = cy; y < cy + RASTER_HIZ_SIZE; y++) {
+        const float *depth = r->depth + (size_t)y * r->width + cx;
+        max_depth = _mm_max_ps(max_depth, _mm_max_ps(_mm_loadu_ps(depth), _mm_loadu_ps(depth + 4)));
+    }
+    max_depth = _mm_max_ps(max_depth, _mm_shuffle_ps(max_depth, max_depth, _MM_SHUFFLE(1, 0, 3, 2)));
+    max_depth = _mm_max_ps(max_depth, _mm_shuffle_ps(max_depth, max_depth, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(max_depth);
+}
+
+__attribute__((target("sse2")))
+static void raster_triangle_sse2(Rasterizer *r, const RasterTriangle *tri,
+                                 int min_x, int min_y, int max_x, int max_y,
+                                 RasterStats *stats) {
+    raster_walk_blocks(r, tri, min_x, min_y, max_x, max_y,
+                       raster_block_sse2, raster_cell_max_sse2, stats);
+}
+
+// 8x2 block as two 8-wide rows
+__attribute__((target("avx2")))
+static inline int raster_block_avx2(Rasterizer *r, const RasterTriangle *tri, int bx, int by,
+                                    const float e[3], float z,
+                                    int min_x, int min_y, int max_x, int max_y) {
+    if (bx + RASTER_BLOCK_W > r->width || by + RASTER_BLOCK_H > r->height) {
+        return raster_block_scalar(r, tri, bx, by, e, z, min_x, min_y, max_x, max_y);
+    }
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 lx = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 color = _mm256_castsi256_ps(_mm256_set1_epi32((int)tri->color));
+    int written = 0;
+
+    // Lanes outside the rectangle are off
+    __m256i xi = _mm256_add_epi32(_mm256_set1_epi32(bx), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(min_x), xi),
+                                  _mm256_cmpgt_epi32(xi, _mm256_set1_epi32(max_x)));
+    __m256 x_mask = _mm256_castsi256_ps(_mm256_xor_si256(out, _mm256_set1_epi32(-1)));
+
+    for (int j = 0; j < RASTER_BLOCK_H; j++) {
+        int y = by + j;
+        if (y < min_y || y > max_y) continue;
+
+        __m256 ly = _mm256_set1_ps((float)j);
+        __m256 mask = x_mask;
+        for (int k = 0; k < 3; k++) {
+            __m256 off = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(tri->a[k]), lx),
+                                       _mm256_mul_ps(_mm256_set1_ps(tri->b[k]), ly));
+            __m256 ek = _mm256_add_ps(_mm256_set1_ps(e[k]), off);
+            mask = _mm256_and_ps(mask, tri->top_left[k] ? _mm256_cmp_ps(ek, zero, _CMP_GE_OQ)
+                                                        : _mm256_cmp_ps(ek, zero, _CMP_GT_OQ));
+        }
+        if (!_mm256_movemask_ps(mask)) continue;
+
+        float *depth = r->depth + (size_t)y * r->width + bx;
+        float *pixel = (float*)((uint32_t*)r->pixels + (size_t)y * r->width + bx);
+
+        __m256 zoff = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(tri->dzdx), lx),
+                                    _mm256_mul_ps(_mm256_set1_ps(tri->dzdy), ly));
+        __m256 zv = _mm256_add_ps(_mm256_set1_ps(z), zoff);
+        __m256 d = _mm256_loadu_ps(depth);
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(zv, zero, _CMP_GE_OQ),
+                                                 _mm256_cmp_ps(zv, d, _CMP_LE_OQ)));
+        int bits = _mm256_movemask_ps(mask);
+        if (!bits) continue;
+
+        _mm256_storeu_ps(depth, _mm256_blendv_ps(d, zv, mask));
+        _mm256_storeu_ps(pixel, _mm256_blendv_ps(_mm256_loadu_ps(pixel), color, mask));
+        written += __builtin_popcount(bits);
+    }
+    return written;
+}
+
+__attribute__((target("avx2")))
+static inline float raster_cell_max_avx2(Rasterizer *r, int cx, int cy) {
+    if (cx + RASTER_HIZ_SIZE > r->width || cy + RASTER_HIZ_SIZE > r->height) {
+        return raster_cell_max_scalar(r, cx, cy);
+    }
+
+    __m256 max_depth = _mm256_setzero_ps();
+    for (int y = cy; y < cy + RASTER_HIZ_SIZE; y++) {
+        max_depth = _mm256_max_ps(max_depth, _mm256_loadu_ps(r->depth + (size_t)y * r->width + cx));
+    }
+    __m128 half = _mm_max_ps(_mm256_castps256_ps128(max_depth), _mm256_extractf128_ps(max_depth, 1));
+    half = _mm_max_ps(half, _mm_shuffle_ps(half, half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_max_ps(half, _mm_shuffle_ps(half, half, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(half);
+}
+
+__attribute__((target("avx2")))
+static void raster_triangle_avx2(Rasterizer *r, const RasterTriangle *tri,
+                                 int min_x, int min_y, int max_x, int max_y,
+                                 RasterStats *stats) {
+    raster_walk_blocks(r, tri, min_x, min_y, max_x, max_y,
+                       raster_block_avx2, raster_cell_max_avx2, stats);
+}
+#endif
+
+// Picks the inner loop, returns -1 if the CPU can't run the requested one
+int raster_set_kernel(Rasterizer *r, int kernel) {
+#ifdef RASTER_X86
+    __builtin_cpu_init();
+    int has_sse2 = __builtin_cpu_supports("sse2");
+    int has_avx2 = __builtin_cpu_supports("avx2");
+#else
+    int has_sse2 = 0;
+    int has_avx2 = 0;
+#endif
+
+    if (kernel == RASTER_KERNEL_AUTO) {
+        kernel = has_avx2 ? RASTER_KERNEL_AVX2 : has_sse2 ? RASTER_KERNEL_SSE2 : RASTER_KERNEL_SCALAR;
+    }
+
+    switch (kernel) {
+        case RASTER_KERNEL_SCALAR:
+            r->kernel = raster_triangle_scalar;
+            r->kernel_name = "scalar";
+            return 0;
+#ifdef RASTER_X86
+        case RASTER_KERNEL_SSE2:
+            if (!has_sse2) return -1;
+            r->kernel = raster_triangle_sse2;
+            r->kernel_name = "sse2";
+            return 0;
+        case RASTER_KERNEL_AVX2:
+            if (!has_avx2) return -1;
+            r->kernel = raster_triangle_avx2;
+            r->kernel_name = "avx2";
+            return 0;
+#endif
+    }
+    return -1;
+}
+
+static void raster_tile_job(void *ctx, int job, int worker) {
+    TRACE_ZONE("raster_tile");
+    Rasterizer *r = (Rasterizer*)ctx;
+    int tx = job % r->tiles_x;
+    int ty = job / r->tiles_x;
+    int x0 = tx * RASTER_TILE_SIZE;
+    int y0 = ty * RASTER_TILE_SIZE;
+    int x1 = x0 + RASTER_TILE_SIZE - 1;
+    int y1 = y0 + RASTER_TILE_SIZE - 1;
+    if (x1 >= r->width) x1 = r->width - 1;
+    if (y1 >= r->height) y1 = r->height - 1;
+
+    RasterStats *stats = &r->worker_stats[worker].stats;
+
+    // Clear
+    for (int y = y0; y <= y1; y++) {
+        uint32_t *color_row = (uint32_t*)r->pixels + (size_t)y * r->width;
+        float *depth_row = r->depth + (size_t)y * r->width;
+        for (int x = x0; x <= x1; x++) {
+            color_row[x] = r->clear_color;
+            depth_row[x] = 1.0f;
+        }
+    }
+    int cx0 = x0 / RASTER_HIZ_SIZE, cx1 = x1 / RASTER_HIZ_SIZE;
+    int cy0 = y0 / RASTER_HIZ_SIZE, cy1 = y1 / RASTER_HIZ_SIZE;
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            r->hiz[cy * r->hiz_width + cx] = 1.0f;
+        }
+    }
+    // A stale tile max is still a valid (just looser) bound, so it only
+    // gets refreshed every few triangles that actually drew something
+    float *tile_max = &r->tile_max_depth[job];
+    *tile_max = 1.0f;
+    int tile_dirty = 0;
+
+    // Every partition's bin is already sorted by submission order,
+    // merge them so overlapping triangles resolve like they would on the GPU
+    int heads[r->num_partitions];
+    memset(heads, 0, sizeof(heads));
+    for (;;) {
+        int best = -1;
+        unsigned int best_seq = 0;
+        for (int p = 0; p < r->num_partitions; p++) {
+            RasterBin *bin = &r->partitions[p].bins[job];
+            if (heads[p] < bin->count) {
+                unsigned int seq = r->partitions[p].tris[bin->tris[heads[p]]].seq;
+                if (best < 0 || seq < best_seq) {
+                    best = p;
+                    best_seq = seq;
+                }
+            }
+        }
+        if (best < 0) break;
+
+        RasterPartition *part = &r->partitions[best];
+        const RasterTriangle *tri = &part->tris[part->bins[job].tris[heads[best]++]];
+        int min_x = tri->min_x > x0 ? tri->min_x : x0;
+        int min_y = tri->min_y > y0 ? tri->min_y : y0;
+        int max_x = tri->max_x < x1 ? tri->max_x : x1;
+        int max_y = tri->max_y < y1 ? tri->max_y : y1;
+        if (min_x > max_x || min_y > max_y) continue;
+
+        if (r->hiz_enabled && tri->zmin - RASTER_HIZ_EPSILON > *tile_max) {
+            stats->triangles_rejected++;
+            continue;
+        }
+
+        unsigned long long shaded = stats->fragments_shaded;
+        r->kernel(r, tri, min_x, min_y, max_x, max_y, stats);
+
+        if (r->hiz_enabled && stats->fragments_shaded != shaded &&
+            ++tile_dirty == RASTER_HIZ_TILE_REFRESH) {
+            tile_dirty = 0;
+            float max_depth = 0.0f;
+            for (int cy = cy0; cy <= cy1; cy++) {
+                for (int cx = cx0; cx <= cx1; cx++) {
+                    max_depth = fmaxf(max_depth, r->hiz[cy * r->hiz_width + cx]);
+                }
+            }
+            *tile_max = max_depth;
+        }
+    }
+}
+
+// Sets up and rasterizes everything queued since raster_begin_frame()
+// into pixels, which must hold width * height RGBA pixels
+void raster_end_frame(Rasterizer *r, unsigned char *pixels) {
+    TRACE_ZONE("raster_end_frame");
+    if (r->num_triangles > 0) {
+        thread_pool_run(r->pool, raster_setup_job, r, r->num_partitions);
+        r->next_seq += r->num_triangles;
+    }
+
+    r->pixels = pixels;
+    thread_pool_run(r->pool, raster_tile_job, r, r->tiles_x * r->tiles_y);
+
+    memset(&r->stats, 0, sizeof(r->stats));
+    for (int w = 0; w < r->pool->num_workers; w++) {
+        RasterStats *stats = &r->worker_stats[w].stats;
+        r->stats.triangles_rejected += stats->triangles_rejected;
+        r->stats.blocks_tested += stats->blocks_tested;
+        r->stats.blocks_rejected += stats->blocks_rejected;
+        r->stats.fragments_shaded += stats->fragments_shaded;
+    }
+    for (int p = 0; p < r->num_partitions; p++) {
+        r->stats.triangles_dropped += r->partitions[p].dropped;
+    }
+}
+
+// Micro-benchmark for the inner loops: random small, medium and large
+// triangles drawn with every kernel this CPU supports, plus the best
+// kernel again with the depth hierarchy off. Every run is checked
+// against the scalar output
+static unsigned long long raster_hash_pixels(const unsigned char *pixels, size_t size) {
+    unsigned long long hash = 1469598103934665603ULL; // FNV-1a
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ pixels[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void raster_benchmark(int width, int height, int num_threads) {
+    static const struct {
+        const char *name;
+        float leg;  // Triangles are right angled with both legs this long
+        int count;
+    } sizes[] = {
+        {"small", 8.0f, 100000},
+        {"medium", 64.0f, 10000},
+        {"large", 512.0f, 200},
+    };
+    static const struct {
+        int kernel;
+        int hiz;
+    } runs[] = {
+        {RASTER_KERNEL_SCALAR, 1},
+        {RASTER_KERNEL_SSE2, 1},
+        {RASTER_KERNEL_AVX2, 1},
+        {RASTER_KERNEL_AUTO, 0},
+    };
+    const double min_seconds = 1.0;
+
+    Rasterizer *r = raster_create(width, height, num_threads);
+    unsigned char *pixels = (unsigned char*)malloc((size_t)width * height * 4);
+    if (!r || !pixels) {
+        fprintf(stderr, "Failed to set up the rasterizer benchmark\n");
+        raster_destroy(r);
+        free(pixels);
+        return;
+    }
+
+    printf("Rasterizer benchmark: %dx%d, %d threads\n", width, height, r->pool->num_workers);
+    printf("%-8s %-4s %-8s %12s %10s %14s %10s %s\n", "kernel", "hiz", "size",
+           "triangles/s", "Mpixels/s", "shaded/frame", "rejected", "output");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int count = sizes[s].count;
+        float *positions = (float*)malloc((size_t)count * 9 * sizeof(float));
+        unsigned int *indices = (unsigned int*)malloc((size_t)count * 3 * sizeof(unsigned int));
+        if (!positions || !indices) {
+            fprintf(stderr, "Failed to set up the rasterizer benchmark\n");
+            free(positions);
+            free(indices);
+            break;
+        }
+
+        // Same triangles for every kernel, positions given straight in NDC
+        unsigned int seed = 12345;
+        float leg_x = sizes[s].leg * 2.0f / width;
+        float leg_y = sizes[s].leg * 2.0f / height;
+        for (int t = 0; t < count; t++) {
+            float v[3];
+            for (int i = 0; i < 3; i++) {
+                seed = seed * 1664525u + 1013904223u;
+                v[i] = (seed >> 8) / 16777216.0f;
+            }
+            float x = v[0] * (2.0f - leg_x) - 1.0f;
+            float y = v[1] * (2.0f - leg_y) - 1.0f;
+            float z = v[2] * 1.8f - 0.9f;
+            float *p = &positions[t * 9];
+            p[0] = x;         p[1] = y;         p[2] = z;
+            p[3] = x + leg_x; p[4] = y;         p[5] = z;
+            p[6] = x;         p[7] = y + leg_y; p[8] = z;
+            indices[t * 3] = t * 3;
+            indices[t * 3 + 1] = t * 3 + 1;
+            indices[t * 3 + 2] = t * 3 + 2;
+        }
+        double pixels_per_frame = (double)count * sizes[s].leg * sizes[s].leg * 0.5;
+
+        unsigned long long reference = 0;
+        for (size_t k = 0; k < sizeof(runs) / sizeof(runs[0]); k++) {
+            if (raster_set_kernel(r, runs[k].kernel) < 0) continue;
+            r->hiz_enabled = runs[k].hiz;
+
+            struct timespec start, end;
+            double seconds = 0;
+            int frames = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            while (seconds < min_seconds) {
+                raster_begin_frame(r, (vec4){0.0f, 0.0f, 0.0f, 1.0f});
+                raster_draw(r, positions, NULL, 3, indices, sizeof(unsigned int), count * 3,
+                            mat4_identity(), mat4_identity());
+                raster_end_frame(r, pixels);
+                frames++;
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            }
+
+            unsigned long long hash = raster_hash_pixels(pixels, (size_t)width * height * 4);
+            if (runs[k].kernel == RASTER_KERNEL_SCALAR) {
+                reference = hash;
+            }
+
+            // Share of 8x8 cells skipped by the depth hierarchy
+            double rejected = r->stats.blocks_tested ?
+                100.0 * r->stats.blocks_rejected / r->stats.blocks_tested : 0.0;
+            printf("%-8s %-4s %-8s %12.0f %10.1f %14llu %9.1f%% %s\n", r->kernel_name,
+                   r->hiz_enabled ? "on" : "off", sizes[s].name,
+                   count * frames / seconds,
+                   pixels_per_frame * frames / seconds / 1e6,
+                   r->stats.fragments_shaded, rejected,
+                   hash == reference ? "matches scalar" : "MISMATCH");
+        }
+
+        free(positions);
+        free(indices);
+    }
+
+    free(pixels);
+    raster_destroy(r);
+}
+
+#endif // RASTERIZER_H
@@ -0,0 +1,465 @@
+#ifndef RAYCASTER_H
+#define RAYCASTER_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vectors.h"
+#include "light.h"
+#include "fragment_shaders.h"
+#include "camera.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RAYCASTER_X86 1
+#endif
+
+// The renderer this project started out as: no meshes, only a cube of
+// side SIDE_LENGTH around the origin, one ray per pixel tested against
+// its six faces, and SHADER (see fragment_shaders.h) painting them.
+// This aims the camera at the cube and writes what it sees the way the
+// blitters take it, RGBA with the bottom row first
+//
+// get_pixel_through_camera() in camera.h does a pixel at a time and
+// shades every face its ray crosses. Here rays go in packets of
+// RAYCASTER_PACKET pixels of a row. A kernel (scalar, SSE2 or AVX2)
+// finds where each ray crosses the planes of the cube's faces, one slab
+// per axis, and which of those crossings land on the face in front of
+// the camera. Only then is a face picked per ray, the same one
+// get_pixel_through_camera() would end up with, and only that one is
+// shaded. All the kernels do the float operations camera.h does in the
+// same order, so the picture is the same bit for bit, which
+// raycaster_benchmark() (--raycaster-bench) checks. Bands of rows are
+// rendered in parallel on a thread pool
+
+#define RAYCASTER_PACKET 8 // Rays traced together, from one row
+#define RAYCASTER_BAND_ROWS 8 // Rows per thread pool job
+
+enum {
+    RAYCASTER_KERNEL_AUTO,
+    RAYCASTER_KERNEL_SCALAR,
+    RAYCASTER_KERNEL_SSE2,
+    RAYCASTER_KERNEL_AVX2
+};
+
+// The face planes of get_pixel_through_camera(), a*x + b*y + c*z = d,
+// and the coordinates that say where on the face a point is
+static const float raycaster_planes[6][4] = {
+    {0, 0, 1, -SIDE_LENGTH/2.0}, {0, 0, 1, SIDE_LENGTH/2.0 - 1},
+    {1, 0, 0, -SIDE_LENGTH/2.0}, {1, 0, 0, SIDE_LENGTH/2.0 - 1},
+    {0, 1, 0, -SIDE_LENGTH/2.0}, {0, 1, 0, SIDE_LENGTH/2.0 - 1},
+};
+static const int raycaster_face_axes[6][2] = {{0, 1}, {0, 1}, {2, 1}, {2, 1}, {2, 0}, {2, 0}};
+
+typedef struct RaycasterPacket {
+    float direction[3][RAYCASTER_PACKET]; // Focal vector of every ray, x y z
+    float t[6][RAYCASTER_PACKET]; // Where it crosses each face's plane
+    unsigned char hits[6]; // A bit per ray, set if the crossing is on the face, in front of the camera
+} RaycasterPacket;
+
+// What every ray of a frame starts from
+typedef struct RaycasterRays {
+    float center[3]; // Of the camera plane
+    float base_x[3];
+    float base_y[3];
+    float focal_point[3];
+    float numerator[6]; // Of t for each face, the same for every ray
+    float offset_x; // Of the center pixel
+    float offset_y;
+} RaycasterRays;
+
+struct Raycaster;
+
+// Traces the packet of rays starting at pixel x, y
+typedef void (*raycaster_kernel_fn)(const RaycasterRays *rays, int x, int y, RaycasterPacket *packet);
+
+typedef struct Raycaster {
+    camera camera;
+    light3 light;
+    int width, height;
+    vec4 background; // Shows through where the rays miss
+
+    raycaster_kernel_fn kernel;
+    const char *kernel_name;
+    ThreadPool *pool; // NULL to render on the calling thread
+} Raycaster;
+
+int raycaster_set_kernel(Raycaster *r, int kernel);
+
+void raycaster_init(Raycaster *r, int width, int height) {
+    memset(r, 0, sizeof(Raycaster));
+    r->width = width;
+    r->height = height;
+    r->background = (vec4){0.2f, 0.2f, 0.4f, 1.0f};
+    r->camera.dimensions = (vec2){width, height};
+    // The view is as wide as it is deep at the camera plane, about 53
+    // degrees, whatever the resolution
+    r->camera.focal_offset = -width;
+    r->camera.deformations = (vec3){1, 1, 1};
+    r->light.color = (vec3){1, 1, 1};
+    raycaster_set_kernel(r, RAYCASTER_KERNEL_AUTO);
+    r->pool = thread_pool_create(RAYCASTER_THREADS);
+}
+
+void raycaster_destroy(Raycaster *r) {
+    if (r->pool) thread_pool_destroy(r->pool);
+    r->pool = NULL;
+}
+
+// Puts the camera distance away from the center of the cube (in the
+// cube's units), turned by yaw and pitch, looking straight at it. The
+// light comes from over the camera's shoulder
+void raycaster_orbit(Raycaster *r, float yaw, float pitch, float distance) {
+    r->camera.rotations = (vec3){pitch, yaw, 0};
+    r->camera.translations = (vec3){0, 0, 0};
+    r->camera = setup_camera(r->camera);
+    // Rays leave the focal point along base_z
+    vec3 forward = normalize_vec3(r->camera.base_z);
+    r->camera.translations = scale_vec3(forward, -distance);
+    r->camera = setup_camera(r->camera);
+    r->light.position = add_vec3(r->camera.translations, scale_vec3(r->camera.base_y, distance * 0.5f));
+}
+
+static void raycaster_setup_rays(const Raycaster *r, RaycasterRays *rays) {
+    const camera *cam = &r->camera;
+    const vec3 *from[4] = {&cam->center_point, &cam->base_x, &cam->base_y, &cam->focal_point};
+    float *to[4] = {rays->center, rays->base_x, rays->base_y, rays->focal_point};
+    for (int i = 0; i < 4; i++) {
+        to[i][0] = from[i]->x;
+        to[i][1] = from[i]->y;
+        to[i][2] = from[i]->z;
+    }
+    const float *p = rays->focal_point;
+    for (int f = 0; f < 6; f++) {
+        const float *plane = raycaster_planes[f];
+        rays->numerator[f] = plane[3] - plane[0] * p[0] - plane[1] * p[1] - plane[2] * p[2];
+    }
+    rays->offset_x = cam->center_offset.x;
+    rays->offset_y = cam->center_offset.y;
+}
+
+static void raycaster_kernel_scalar(const RaycasterRays *rays, int x, int y, RaycasterPacket *packet) {
+    // Pixel coordinates are whole numbers from the center, like camera.h has them
+    float row = (int)(y - rays->offset_y);
+    memset(packet->hits, 0, sizeof(packet->hits));
+    for (int lane = 0; lane < RAYCASTER_PACKET; lane++) {
+        float column = (int)((x + lane) - rays->offset_x);
+        float d[3];
+        for (int c = 0; c < 3; c++) {
+            d[c] = (rays->center[c] + (rays->base_x[c] * column + rays->base_y[c] * row)) - rays->focal_point[c];
+            packet->direction[c][lane] = d[c];
+        }
+        for (int f = 0; f < 6; f++) {
+            const float *plane = raycaster_planes[f];
+            float t = rays->numerator[f] / (plane[0] * d[0] + plane[1] * d[1] + plane[2] * d[2]);
+            packet->t[f][lane] = t;
+            if (t < 1) continue;
+            int u = raycaster_face_axes[f][0], v = raycaster_face_axes[f][1];
+            float face_u = (d[u] * t + rays->focal_point[u]) + SIDE_LENGTH/2;
+            float face_v = (d[v] * t + rays->focal_point[v]) + SIDE_LENGTH/2;
+            if (face_u > SIDE_LENGTH - 1 || face_v > SIDE_LENGTH - 1 || face_u < 0 || face_v < 0) continue;
+            packet->hits[f] |= 1 << lane;
+        }
+    }
+}
+
+#ifdef RAYCASTER_X86
+// The packet as two 4-wide halves
+__attribute__((target("sse2")))
+static void raycaster_kernel_sse2(const RaycasterRays *rays, int x, int y, RaycasterPacket *packet) {
+    float row = (int)(y - rays->offset_y);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 half_side = _mm_set1_ps(SIDE_LENGTH/2);
+    const __m128 last = _mm_set1_ps(SIDE_LENGTH - 1);
+    memset(packet->hits, 0, sizeof(packet->hits));
+
+    for (int h = 0; h < RAYCASTER_PACKET; h += 4) {
+        __m128 xf = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x + h), _mm_setr_epi32(0, 1, 2, 3)));
+        __m128 column = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_sub_ps(xf, _mm_set1_ps(rays->offset_x))));
+        __m128 d[3];
+        for (int c = 0; c < 3; c++) {
+            __m128 plane = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(rays->base_x[c]), column),
+                                      _mm_set1_ps(rays->base_y[c] * row));
+            d[c] = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(rays->center[c]), plane), _mm_set1_ps(rays->focal_point[c]));
+            _mm_storeu_ps(&packet->direction[c][h], d[c]);
+        }
+        for (int f = 0; f < 6; f++) {
+            const float *plane = raycaster_planes[f];
+            __m128 denominator = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane[0]), d[0]),
+                                                       _mm_mul_ps(_mm_set1_ps(plane[1]), d[1])),
+                                            _mm_mul_ps(_mm_set1_ps(plane[2]), d[2]));
+            __m128 t = _mm_div_ps(_mm_set1_ps(rays->numerator[f]), denominator);
+            _mm_storeu_ps(&packet->t[f][h], t);
+            int u = raycaster_face_axes[f][0], v = raycaster_face_axes[f][1];
+            __m128 face_u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[u], t), _mm_set1_ps(rays->focal_point[u])), half_side);
+            __m128 face_v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[v], t), _mm_set1_ps(rays->focal_point[v])), half_side);
+            __m128 miss = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(t, one), _mm_cmpgt_ps(face_u, last)),
+                                    _mm_or_ps(_mm_cmpgt_ps(face_v, last),
+                                              _mm_or_ps(_mm_cmplt_ps(face_u, zero), _mm_cmplt_ps(face_v, zero))));
+            packet->hits[f] |= (~_mm_movemask_ps(miss) & 15) << h;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void raycaster_kernel_avx2(const RaycasterRays *rays, int x, int y, RaycasterPacket *packet) {
+    float row = (int)(y - rays->offset_y);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 half_side = _mm256_set1_ps(SIDE_LENGTH/2);
+    const __m256 last = _mm256_set1_ps(SIDE_LENGTH - 1);
+
+    __m256 xf = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+    __m256 column = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_sub_ps(xf, _mm256_set1_ps(rays->offset_x))));
+    __m256 d[3];
+    for (int c = 0; c < 3; c++) {
+        __m256 plane = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(rays->base_x[c]), column),
+                                     _mm256_set1_ps(rays->base_y[c] * row));
+        d[c] = _mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps(rays->center[c]), plane),
+                             _mm256_set1_ps(rays->focal_point[c]));
+        _mm256_storeu_ps(packet->direction[c], d[c]);
+    }
+    for (int f = 0; f < 6; f++) {
+        const float *plane = raycaster_planes[f];
+        __m256 denominator = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane[0]), d[0]),
+                                                         _mm256_mul_ps(_mm256_set1_ps(plane[1]), d[1])),
+                                           _mm256_mul_ps(_mm256_set1_ps(plane[2]), d[2]));
+        __m256 t = _mm256_div_ps(_mm256_set1_ps(rays->numerator[f]), denominator);
+        _mm256_storeu_ps(packet->t[f], t);
+        int u = raycaster_face_axes[f][0], v = raycaster_face_axes[f][1];
+        __m256 face_u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d[u], t), _mm256_set1_ps(rays->focal_point[u])),
+                                      half_side);
+        __m256 face_v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d[v], t), _mm256_set1_ps(rays->focal_point[v])),
+                                      half_side);
+        // Ordered compares, false for NaN like the scalar ones
+        __m256 miss = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(t, one, _CMP_LT_OQ),
+                                                _mm256_cmp_ps(face_u, last, _CMP_GT_OQ)),
+                                   _mm256_or_ps(_mm256_cmp_ps(face_v, last, _CMP_GT_OQ),
+                                                _mm256_or_ps(_mm256_cmp_ps(face_u, zero, _CMP_LT_OQ),
+                                                             _mm256_cmp_ps(face_v, zero, _CMP_LT_OQ))));
+        packet->hits[f] = ~_mm256_movemask_ps(miss) & 255;
+    }
+}
+#endif
+
+// Picks the inner loop, returns -1 if the CPU can't run the requested one
+int raycaster_set_kernel(Raycaster *r, int kernel) {
+#ifdef RAYCASTER_X86
+    __builtin_cpu_init();
+    int has_sse2 = __builtin_cpu_supports("sse2");
+    int has_avx2 = __builtin_cpu_supports("avx2");
+#else
+    int has_sse2 = 0;
+    int has_avx2 = 0;
+#endif
+
+    if (kernel == RAYCASTER_KERNEL_AUTO) {
+        kernel = has_avx2 ? RAYCASTER_KERNEL_AVX2 : has_sse2 ? RAYCASTER_KERNEL_SSE2 : RAYCASTER_KERNEL_SCALAR;
+    }
+
+    switch (kernel) {
+        case RAYCASTER_KERNEL_SCALAR:
+            r->kernel = raycaster_kernel_scalar;
+            r->kernel_name = "scalar";
+            return 0;
+#ifdef RAYCASTER_X86
+        case RAYCASTER_KERNEL_SSE2:
+            if (!has_sse2) return -1;
+            r->kernel = raycaster_kernel_sse2;
+            r->kernel_name = "sse2";
+            return 0;
+        case RAYCASTER_KERNEL_AVX2:
+            if (!has_avx2) return -1;
+            r->kernel = raycaster_kernel_avx2;
+            r->kernel_name = "avx2";
+            return 0;
+#endif
+    }
+    return -1;
+}
+
+static vec4 raycaster_shade_face(const Raycaster *r, const RaycasterPacket *packet, int lane, int face) {
+    // Anything shade_projection() would turn away anyway
+    if (!(packet->hits[face] >> lane & 1)) return (vec4){0, 0, 0, 0};
+    vec3 direction = {packet->direction[0][lane], packet->direction[1][lane], packet->direction[2][lane]};
+    return shade_projection(packet->t[face][lane], face, &r->camera, direction, &r->light);
+}
+
+// Goes over the faces the way get_pixel_through_camera() blends them,
+// but only looking at t and which faces were hit, then shades what the
+// result is made of: the nearer of the last two faces hit with SHADING,
+// the two blended without it
+static vec4 raycaster_shade(const Raycaster *r, const RaycasterPacket *packet, int lane) {
+    int near = -1, far = -1;
+    int last = 0;
+    for (int f = 0; f < 6; f++) {
+        if (!(packet->hits[f] >> lane & 1)) continue;
+        float t = packet->t[f][lane], last_t = packet->t[last][lane];
+        if (t > last_t) {
+            near = last;
+            far = f;
+        } else if (t < last_t) {
+            near = f;
+            far = last;
+        }
+        last = f;
+    }
+
+    if (near < 0) return (vec4){0, 0, 0, 0};
+    vec4 pixel = raycaster_shade_face(r, packet, lane, near);
+    if (SHADING) return pixel;
+    return alpha_composite(raycaster_shade_face(r, packet, lane, far), pixel);
+}
+
+static inline unsigned char raycaster_channel(float value) {
+    return (unsigned char)(fminf(fmaxf(value, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+// Renders rows first_row to last_row (exclusive) of the frame into pixels
+void raycaster_render_rows(const Raycaster *r, unsigned char *pixels, int first_row, int last_row) {
+    RaycasterRays rays;
+    raycaster_setup_rays(r, &rays);
+    RaycasterPacket packet;
+    for (int y = first_row; y < last_row; y++) {
+        unsigned char *out = pixels + (size_t)y * r->width * 4;
+        for (int x = 0; x < r->width; x += RAYCASTER_PACKET) {
+            r->kernel(&rays, x, y, &packet);
+            int lanes = r->width - x < RAYCASTER_PACKET ? r->width - x : RAYCASTER_PACKET;
+            for (int lane = 0; lane < lanes; lane++) {
+                vec4 pixel = raycaster_shade(r, &packet, lane);
+                float alpha = fminf(fmaxf(pixel.w, 0.0f), 1.0f);
+                unsigned char *p = out + (x + lane) * 4;
+                p[0] = raycaster_channel(pixel.x * alpha + r->background.x * (1 - alpha));
+                p[1] = raycaster_channel(pixel.y * alpha + r->background.y * (1 - alpha));
+                p[2] = raycaster_channel(pixel.z * alpha + r->background.z * (1 - alpha));
+                p[3] = 255;
+            }
+        }
+    }
+}
+
+typedef struct RaycasterFrame {
+    const Raycaster *raycaster;
+    unsigned char *pixels;
+} RaycasterFrame;
+
+static void raycaster_band_job(void *ctx, int job, int worker) {
+    TRACE_ZONE("raycaster_band");
+    RaycasterFrame *frame = (RaycasterFrame*)ctx;
+    int first_row = job * RAYCASTER_BAND_ROWS;
+    int last_row = first_row + RAYCASTER_BAND_ROWS;
+    if (last_row > frame->raycaster->height) last_row = frame->raycaster->height;
+    raycaster_render_rows(frame->raycaster, frame->pixels, first_row, last_row);
+}
+
+void raycaster_render(const Raycaster *r, unsigned char *pixels) {
+    if (!r->pool) {
+        raycaster_render_rows(r, pixels, 0, r->height);
+        return;
+    }
+    // Small bands, so the ones through the middle of the cube, which
+    // shade every pixel, don't all end up on the same thread
+    RaycasterFrame frame = {r, pixels};
+    thread_pool_run(r->pool, raycaster_band_job, &frame, (r->height + RAYCASTER_BAND_ROWS - 1) / RAYCASTER_BAND_ROWS);
+}
+
+// The raycaster as it was, get_pixel_through_camera() for every pixel.
+// What the kernels are checked against
+static void raycaster_render_per_pixel(const Raycaster *r, unsigned char *pixels) {
+    for (int y = 0; y < r->height; y++) {
+        unsigned char *out = pixels + (size_t)y * r->width * 4;
+        for (int x = 0; x < r->width; x++) {
+            vec4 pixel = get_pixel_through_camera(x, y, r->camera, r->light);
+            float alpha = fminf(fmaxf(pixel.w, 0.0f), 1.0f);
+            out[x * 4 + 0] = raycaster_channel(pixel.x * alpha + r->background.x * (1 - alpha));
+            out[x * 4 + 1] = raycaster_channel(pixel.y * alpha + r->background.y * (1 - alpha));
+            out[x * 4 + 2] = raycaster_channel(pixel.z * alpha + r->background.z * (1 - alpha));
+            out[x * 4 + 3] = 255;
+        }
+    }
+}
+
+// Views to check: all the way around, above and below, and from inside
+// the cube as well as outside
+static void raycaster_benchmark_orbit(Raycaster *r, int orbit) {
+    float distance = orbit % 4 == 3 ? SIDE_LENGTH * 0.3f : SIDE_LENGTH * (1.2f + 0.4f * (orbit % 4));
+    raycaster_orbit(r, orbit * 0.61f, sinf(orbit * 0.37f) * 1.2f, distance);
+}
+
+// Renders the same orbits with every kernel this CPU supports and with
+// get_pixel_through_camera(), which every kernel has to match byte for
+// byte. One size has an odd width, so the last packet of a row is partial
+void raycaster_benchmark() {
+    static const struct { int width, height; } sizes[] = {{160, 90}, {317, 179}};
+    static const int kernels[] = {RAYCASTER_KERNEL_SCALAR, RAYCASTER_KERNEL_SSE2, RAYCASTER_KERNEL_AVX2};
+    const int num_orbits = 24;
+
+    printf("Raycaster benchmark: %d orbits per size\n", num_orbits);
+    printf("%-10s %-8s %10s %s\n", "kernel", "size", "frames/s", "output");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int width = sizes[s].width, height = sizes[s].height;
+        size_t frame_size = (size_t)width * height * 4;
+        Raycaster r;
+        raycaster_init(&r, width, height);
+        unsigned char *reference = (unsigned char*)malloc(frame_size * num_orbits);
+        unsigned char *pixels = (unsigned char*)malloc(frame_size);
+        if (!reference || !pixels) {
+            fprintf(stderr, "Failed to set up the raycaster benchmark\n");
+            free(reference);
+            free(pixels);
+            raycaster_destroy(&r);
+            return;
+        }
+        char size_name[32];
+        snprintf(size_name, sizeof(size_name), "%dx%d", width, height);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int o = 0; o < num_orbits; o++) {
+            raycaster_benchmark_orbit(&r, o);
+            raycaster_render_per_pixel(&r, reference + frame_size * o);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%-10s %-8s %10.1f reference\n", "per-pixel", size_name, num_orbits / seconds);
+
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            if (raycaster_set_kernel(&r, kernels[k]) < 0) continue;
+            unsigned long long mismatched = 0;
+            int first_orbit = -1;
+            seconds = 0;
+            for (int o = 0; o < num_orbits; o++) {
+                raycaster_benchmark_orbit(&r, o);
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                raycaster_render(&r, pixels);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+                const unsigned char *expected = reference + frame_size * o;
+                for (size_t i = 0; i < frame_size; i += 4) {
+                    if (memcmp(pixels + i, expected + i, 4) != 0) {
+                        mismatched++;
+                        if (first_orbit < 0) first_orbit = o;
+                    }
+                }
+            }
+            if (mismatched == 0) {
+                printf("%-10s %-8s %10.1f matches per-pixel\n", r.kernel_name, size_name, num_orbits / seconds);
+            } else {
+                printf("%-10s %-8s %10.1f MISMATCH: %llu pixels, first in orbit %d\n", r.kernel_name, size_name,
+                       num_orbits / seconds, mismatched, first_orbit);
+            }
+        }
+
+        free(reference);
+        free(pixels);
+        raycaster_destroy(&r);
+    }
+}
+
+#endif // RAYCASTER_H
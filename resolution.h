@@ -0,0 +1,82 @@
+#ifndef RESOLUTION_H
+#define RESOLUTION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Dynamic resolution
+// Picks the downscaling factor frame by frame to keep frame time under a
+// budget. Frame time is smoothed, and after every change the controller
+// waits a while before looking again so it doesn't bounce between two
+// factors. It only goes back to a finer factor if the estimated cost
+// there (frame time scales with the pixel count) still leaves some
+// headroom under the budget
+
+#define RESOLUTION_SETTLE_FRAMES 20 // Frames to wait after a change
+#define RESOLUTION_SMOOTHING 0.1 // Weight of the newest frame in the average
+#define RESOLUTION_HEADROOM 0.8 // Only go finer if it'd fit in this much of the budget
+
+typedef struct ResolutionController {
+    int enabled;
+    int min_scale; // Finest
+    int max_scale; // Coarsest
+    int scale;
+    double budget_ms;
+
+    double average_ms;
+    int frames_at_scale;
+
+    // Log
+    unsigned long *frames_per_scale; // Indexed by scale
+    unsigned long changes;
+} ResolutionController;
+
+void resolution_init(ResolutionController *rc, int enabled, int scale, int min_scale, int max_scale, double budget_ms) {
+    rc->enabled = enabled;
+    rc->min_scale = min_scale < 1 ? 1 : min_scale;
+    rc->max_scale = max_scale < rc->min_scale ? rc->min_scale : max_scale;
+    if (scale < rc->min_scale) scale = rc->min_scale;
+    if (scale > rc->max_scale) scale = rc->max_scale;
+    rc->scale = scale;
+    rc->budget_ms = budget_ms;
+    rc->average_ms = 0;
+    rc->frames_at_scale = 0;
+    rc->frames_per_scale = (unsigned long*)calloc(rc->max_scale + 1, sizeof(unsigned long));
+    rc->changes = 0;
+}
+
+// Feed it the time the last frame took, returns 1 if the scale changed
+int resolution_update(ResolutionController *rc, double frame_ms) {
+    if (rc->frames_per_scale) rc->frames_per_scale[rc->scale]++;
+    if (!rc->enabled) return 0;
+
+    if (rc->frames_at_scale == 0) {
+        rc->average_ms = frame_ms;
+    } else {
+        rc->average_ms += (frame_ms - rc->average_ms) * RESOLUTION_SMOOTHING;
+    }
+    if (++rc->frames_at_scale < RESOLUTION_SETTLE_FRAMES) return 0;
+
+    int scale = rc->scale;
+    if (rc->average_ms > rc->budget_ms && scale < rc->max_scale) {
+        scale++;
+    } else if (scale > rc->min_scale) {
+        double ratio = (double)scale / (scale - 1);
+        if (rc->average_ms * ratio * ratio < rc->budget_ms * RESOLUTION_HEADROOM) {
+            scale--;
+        }
+    }
+    if (scale == rc->scale) return 0;
+
+    rc->scale = scale;
+    rc->frames_at_scale = 0;
+    rc->changes++;
+    return 1;
+}
+
+void resolution_destroy(ResolutionController *rc) {
+    free(rc->frames_per_scale);
+    rc->frames_per_scale = NULL;
+}
+
+#endif // RESOLUTION_H
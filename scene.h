@@ -0,0 +1,144 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vectors.h"
+
+// Scenes of many instances sharing a few meshes
+// An instance is a placement (model matrix) and a color, pointing at one
+// of the renderer's meshes and one of its programs. Both are just numbers
+// here, the renderer keeps the actual ones
+//
+// Every frame the renderer pushes one draw per instance that survives
+// culling, with the level of detail it picked, and scene_sort_draws()
+// orders them by program, then mesh, then level. All the draws of a
+// batch then follow each other, so state only changes between batches
+// and a batch can go out as one instanced draw call. Inside a batch the
+// draws go front to back, which is what depth testing (and the software
+// rasterizer's depth hierarchy) like best
+
+#define SCENE_MAX_MESHES 65536
+#define SCENE_MAX_PROGRAMS 256
+
+typedef struct SceneInstance {
+    mat4 model;
+    vec4 color; // Multiplied into whatever the shading comes up with
+    uint32_t mesh;
+    uint32_t program;
+} SceneInstance;
+
+typedef struct SceneDraw {
+    // Program, mesh, level and depth from the most significant bits down
+    uint64_t key;
+    uint32_t instance;
+    uint16_t level;
+    uint16_t visibility; // How the instance's bounds tested against the frustum
+} SceneDraw;
+
+typedef struct Scene {
+    SceneInstance *instances;
+    unsigned int num_instances;
+    unsigned int instance_capacity;
+
+    // This frame's draws, room for one per instance
+    SceneDraw *draws;
+    SceneDraw *sort_temp;
+    unsigned int num_draws;
+} Scene;
+
+void scene_init(Scene *scene) {
+    memset(scene, 0, sizeof(Scene));
+}
+
+void scene_destroy(Scene *scene) {
+    free(scene->instances);
+    free(scene->draws);
+    free(scene->sort_temp);
+    memset(scene, 0, sizeof(Scene));
+}
+
+// Returns the new instance's index, -1 if out of memory
+int scene_add_instance(Scene *scene, uint32_t mesh, uint32_t program, mat4 model, vec4 color) {
+    if (mesh >= SCENE_MAX_MESHES || program >= SCENE_MAX_PROGRAMS) return -1;
+    if (scene->num_instances == scene->instance_capacity) {
+        unsigned int capacity = scene->instance_capacity ? scene->instance_capacity * 2 : 16;
+        SceneInstance *instances = (SceneInstance*)realloc(scene->instances, capacity * sizeof(SceneInstance));
+        SceneDraw *draws = (SceneDraw*)malloc(capacity * sizeof(SceneDraw));
+        SceneDraw *sort_temp = (SceneDraw*)malloc(capacity * sizeof(SceneDraw));
+        if (instances) scene->instances = instances;
+        if (!instances || !draws || !sort_temp) {
+            free(draws);
+            free(sort_temp);
+            return -1;
+        }
+        free(scene->draws);
+        free(scene->sort_temp);
+        scene->draws = draws;
+        scene->sort_temp = sort_temp;
+        scene->instance_capacity = capacity;
+    }
+    scene->instances[scene->num_instances] = (SceneInstance){model, color, mesh, program};
+    scene->num_draws = 0;
+    return scene->num_instances++;
+}
+
+void scene_begin_draws(Scene *scene) {
+    scene->num_draws = 0;
+}
+
+// depth is anything that grows away from the camera, as long as it's >= 0
+void scene_push_draw(Scene *scene, uint32_t instance, unsigned int level, int visibility, float depth) {
+    const SceneInstance *inst = &scene->instances[instance];
+    if (!(depth >= 0.0f)) depth = 0.0f;
+    uint32_t depth_bits;
+    memcpy(&depth_bits, &depth, sizeof(depth_bits)); // Positive floats sort like their bits
+    SceneDraw *draw = &scene->draws[scene->num_draws++];
+    // Program 8 bits, mesh 16, level 8, then the depth's 32
+    draw->key = (uint64_t)inst->program << 56 | (uint64_t)inst->mesh << 40 |
+                (uint64_t)(level & 0xff) << 32 | depth_bits;
+    draw->instance = instance;
+    draw->level = (uint16_t)level;
+    draw->visibility = (uint16_t)visibility;
+}
+
+// Whether two draws go in the same batch
+static inline int scene_same_batch(const SceneDraw *a, const SceneDraw *b) {
+    return (a->key >> 32) == (b->key >> 32);
+}
+
+// LSD radix sort on the keys, a byte at a time, skipping the bytes every
+// key has the same (usually most of the program and mesh ones)
+void scene_sort_draws(Scene *scene) {
+    unsigned int n = scene->num_draws;
+    if (n < 2) return;
+
+    SceneDraw *from = scene->draws, *to = scene->sort_temp;
+    for (int shift = 0; shift < 64; shift += 8) {
+        unsigned int counts[256] = {0};
+        for (unsigned int i = 0; i < n; i++) counts[(from[i].key >> shift) & 0xff]++;
+        if (counts[(from[0].key >> shift) & 0xff] == n) continue;
+
+        unsigned int offset = 0;
+        for (int b = 0; b < 256; b++) {
+            unsigned int count = counts[b];
+            counts[b] = offset;
+            offset += count;
+        }
+        for (unsigned int i = 0; i < n; i++) to[counts[(from[i].key >> shift) & 0xff]++] = from[i];
+        SceneDraw *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != scene->draws) memcpy(scene->draws, from, n * sizeof(SceneDraw));
+}
+
+// End of the batch starting at draw first
+unsigned int scene_batch_end(const Scene *scene, unsigned int first) {
+    unsigned int end = first + 1;
+    while (end < scene->num_draws && scene_same_batch(&scene->draws[first], &scene->draws[end])) end++;
+    return end;
+}
+
+#endif // SCENE_H
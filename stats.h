@@ -0,0 +1,231 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Frame statistics for --stats
+// Frames are added up in memory as they're presented, and every interval
+// the totals become a summary: frames per second, frame time (average
+// and worst), render time, triangles and framebuffer bytes per frame.
+// The summary goes either into an overlay drawn over the top left of the
+// screen with the small bitmap font below, or as one line to a log fd.
+// Either way nothing is printed, or written anywhere, more than once an
+// interval, and with stats off nothing here runs at all
+
+enum {
+    STATS_OFF,
+    STATS_OVERLAY,
+    STATS_LOG
+};
+
+#define STATS_OVERLAY_LINES 5
+#define STATS_OVERLAY_COLUMNS 26 // The overlay is always this big, so shorter text covers longer
+#define STATS_FONT_WIDTH 5
+#define STATS_FONT_HEIGHT 7
+
+// What the render thread knows about a frame, handed over with it
+typedef struct StatsFrame {
+    float render_ms; // Drawing it and reading it back
+    unsigned int triangles;
+    int scale; // Resolution it was rendered at, 1/scale
+} StatsFrame;
+
+typedef struct Stats {
+    int mode;
+    int log_fd; // For STATS_LOG
+    long long interval_ns;
+    long long start_ns;
+
+    // Frames since the last summary
+    long long interval_start_ns;
+    long long last_frame_ns;
+    unsigned int frames;
+    double render_ms;
+    double frame_ms_max; // Longest time between two frames
+    unsigned long long triangles;
+    unsigned long long bytes_written;
+    int scale;
+
+    // Last summary, upper case so the font has it
+    char lines[STATS_OVERLAY_LINES][STATS_OVERLAY_COLUMNS + 1];
+} Stats;
+
+// ' ' to 'Z', a row per byte, top first, the low 5 bits left to right
+static const uint8_t stats_font[][STATS_FONT_HEIGHT] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ' '
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '!'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '"'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '#'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '$'
+    {0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03}, // '%'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '&'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // "'"
+    {0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02}, // '('
+    {0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08}, // ')'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '*'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '+'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ','
+    {0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00}, // '-'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c}, // '.'
+    {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00}, // '/'
+    {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e}, // '0'
+    {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e}, // '1'
+    {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f}, // '2'
+    {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e}, // '3'
+    {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02}, // '4'
+    {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e}, // '5'
+    {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e}, // '6'
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08}, // '7'
+    {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e}, // '8'
+    {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c}, // '9'
+    {0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00}, // ':'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ';'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '<'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '='
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '>'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '?'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '@'
+    {0x0e, 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11}, // 'A'
+    {0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e}, // 'B'
+    {0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e}, // 'C'
+    {0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c}, // 'D'
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f}, // 'E'
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10}, // 'F'
+    {0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f}, // 'G'
+    {0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11}, // 'H'
+    {0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e}, // 'I'
+    {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c}, // 'J'
+    {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}, // 'K'
+    {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f}, // 'L'
+    {0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11}, // 'M'
+    {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11}, // 'N'
+    {0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, // 'O'
+    {0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10}, // 'P'
+    {0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d}, // 'Q'
+    {0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11}, // 'R'
+    {0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e}, // 'S'
+    {0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04}, // 'T'
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, // 'U'
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04}, // 'V'
+    {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a}, // 'W'
+    {0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11}, // 'X'
+    {0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04}, // 'Y'
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f}, // 'Z'
+};
+
+static inline long long stats_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void stats_init(Stats *stats, int mode, int log_fd, int interval_ms) {
+    memset(stats, 0, sizeof(Stats));
+    stats->mode = mode;
+    stats->log_fd = log_fd;
+    stats->interval_ns = (long long)interval_ms * 1000000LL;
+    stats->start_ns = stats_now_ns();
+    stats->interval_start_ns = stats->start_ns;
+    snprintf(stats->lines[0], sizeof(stats->lines[0]), "FPS -");
+}
+
+// Turns the frames since the last summary into the next one
+static void stats_summarize(Stats *stats, long long now_ns) {
+    double seconds = (now_ns - stats->interval_start_ns) / 1e9;
+    double fps = stats->frames / seconds;
+    double frame_ms = seconds * 1000.0 / stats->frames;
+    double render_ms = stats->render_ms / stats->frames;
+    unsigned long long triangles = stats->triangles / stats->frames;
+    double kb = stats->bytes_written / 1024.0 / stats->frames;
+
+    if (stats->mode == STATS_OVERLAY) {
+        snprintf(stats->lines[0], sizeof(stats->lines[0]), "FPS %.1f", fps);
+        snprintf(stats->lines[1], sizeof(stats->lines[1]), "FRAME %.1f MAX %.1f MS", frame_ms, stats->frame_ms_max);
+        snprintf(stats->lines[2], sizeof(stats->lines[2]), "RENDER %.2f MS 1/%d", render_ms, stats->scale);
+        snprintf(stats->lines[3], sizeof(stats->lines[3]), "TRIS %llu", triangles);
+        snprintf(stats->lines[4], sizeof(stats->lines[4]), "BLIT %.0f KB", kb);
+    } else if (stats->mode == STATS_LOG && stats->log_fd >= 0) {
+        // One write for the whole line
+        char line[192];
+        int length = snprintf(line, sizeof(line),
+                              "[%8.2fs] %.1f fps, frame %.2f ms (max %.2f), render %.2f ms at 1/%d, "
+                              "%llu triangles, %.0f KB blitted per frame\n",
+                              (now_ns - stats->start_ns) / 1e9, fps, frame_ms, stats->frame_ms_max,
+                              render_ms, stats->scale, triangles, kb);
+        if (length > (int)sizeof(line) - 1) length = sizeof(line) - 1;
+        if (write(stats->log_fd, line, length) < 0) stats->log_fd = -1; // Nobody's reading
+    }
+}
+
+// Adds a frame as it's presented, bytes_written being what it took to
+// put it on screen. Summarizes once an interval has gone by
+void stats_frame(Stats *stats, const StatsFrame *frame, size_t bytes_written) {
+    long long now = stats_now_ns();
+    if (stats->last_frame_ns) {
+        double frame_ms = (now - stats->last_frame_ns) / 1e6;
+        if (frame_ms > stats->frame_ms_max) stats->frame_ms_max = frame_ms;
+    }
+    stats->last_frame_ns = now;
+    stats->frames++;
+    stats->render_ms += frame->render_ms;
+    stats->triangles += frame->triangles;
+    stats->bytes_written += bytes_written;
+    stats->scale = frame->scale;
+
+    if (now - stats->interval_start_ns < stats->interval_ns) return;
+    stats_summarize(stats, now);
+    stats->interval_start_ns = now;
+    stats->frames = 0;
+    stats->render_ms = 0;
+    stats->frame_ms_max = 0;
+    stats->triangles = 0;
+    stats->bytes_written = 0;
+}
+
+// Draws the last summary over the top left of a framebuffer page, on a
+// box that's always the same size. fg and bg are packed in the page's
+// pixel format. Returns the bytes written
+size_t stats_draw_overlay(const Stats *stats, char *page, int line_length, int width, int height,
+                          int bytes_per_pixel, uint32_t fg, uint32_t bg) {
+    // Font pixels are square blocks of this many screen pixels
+    int dot = width >= 1280 ? 2 : 1;
+    int margin = 4 * dot;
+    int cell_width = (STATS_FONT_WIDTH + 1) * dot;
+    int cell_height = (STATS_FONT_HEIGHT + 2) * dot;
+    int box_width = STATS_OVERLAY_COLUMNS * cell_width + 2 * margin;
+    int box_height = STATS_OVERLAY_LINES * cell_height + 2 * margin;
+    if (box_width > width) box_width = width;
+    if (box_height > height) box_height = height;
+
+    for (int y = 0; y < box_height; y++) {
+        char *row = page + (size_t)y * line_length;
+        int line = (y - margin) / cell_height;
+        int glyph_y = ((y - margin) % cell_height) / dot;
+        int in_text = y >= margin && line < STATS_OVERLAY_LINES && glyph_y < STATS_FONT_HEIGHT;
+        const char *text = in_text ? stats->lines[line] : "";
+        size_t length = strlen(text);
+
+        for (int x = 0; x < box_width; x++) {
+            uint32_t color = bg;
+            int column = (x - margin) / cell_width;
+            int glyph_x = ((x - margin) % cell_width) / dot;
+            if (in_text && x >= margin && (size_t)column < length && glyph_x < STATS_FONT_WIDTH) {
+                unsigned char c = (unsigned char)text[column];
+                if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+                if (c >= ' ' && c <= 'Z' &&
+                    (stats_font[c - ' '][glyph_y] >> (STATS_FONT_WIDTH - 1 - glyph_x) & 1)) {
+                    color = fg;
+                }
+            }
+            // Little endian, so the low bytes are the pixel whatever its size
+            memcpy(row + (size_t)x * bytes_per_pixel, &color, bytes_per_pixel);
+        }
+    }
+    return (size_t)box_width * box_height * bytes_per_pixel;
+}
+
+#endif // STATS_H
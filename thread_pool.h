@@ -0,0 +1,176 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "trace.h"
+
+// Simple fork/join worker pool.
+// thread_pool_run() hands out job indices [0, num_jobs) to every worker
+// (the calling thread included) and returns once all of them are done.
+// Jobs are pulled from a shared atomic counter, so uneven jobs balance
+// themselves out.
+
+// worker is in [0, num_workers), handy for per-thread scratch memory
+typedef void (*thread_pool_job)(void *ctx, int job, int worker);
+
+typedef struct ThreadPool {
+    int num_workers; // Includes the thread calling thread_pool_run()
+    pthread_t *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    unsigned long generation;
+    int quit;
+
+    // Current batch
+    thread_pool_job fn;
+    void *ctx;
+    int num_jobs;
+    atomic_int next_job;
+    int active;
+} ThreadPool;
+
+typedef struct {
+    ThreadPool *pool;
+    int worker;
+} ThreadPoolWorkerArg;
+
+int thread_pool_default_threads() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+static void thread_pool_drain(ThreadPool *pool, int worker) {
+    int job;
+    while ((job = atomic_fetch_add(&pool->next_job, 1)) < pool->num_jobs) {
+        pool->fn(pool->ctx, job, worker);
+    }
+}
+
+static void *thread_pool_worker(void *arg) {
+    ThreadPoolWorkerArg *worker_arg = (ThreadPoolWorkerArg*)arg;
+    ThreadPool *pool = worker_arg->pool;
+    int worker = worker_arg->worker;
+    free(worker_arg);
+    trace_thread_name("worker %d", worker);
+
+    unsigned long seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->quit) {
+            pthread_cond_wait(&pool->start_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        thread_pool_drain(pool, worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// num_threads <= 0 means one thread per online core
+ThreadPool* thread_pool_create(int num_threads) {
+    if (num_threads <= 0) {
+        num_threads = thread_pool_default_threads();
+    }
+
+    ThreadPool *pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    if (!pool) return NULL;
+
+    pool->num_workers = num_threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    atomic_init(&pool->next_job, 0);
+
+    // Worker 0 is whoever calls thread_pool_run()
+    pool->threads = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
+    if (!pool->threads) {
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->start_cond);
+        pthread_cond_destroy(&pool->done_cond);
+        free(pool);
+        return NULL;
+    }
+    // A worker that can't be started leaves the pool with the ones that did
+    for (int i = 1; i < num_threads; i++) {
+        ThreadPoolWorkerArg *arg = (ThreadPoolWorkerArg*)malloc(sizeof(ThreadPoolWorkerArg));
+        if (!arg) {
+            pool->num_workers = i;
+            break;
+        }
+        arg->pool = pool;
+        arg->worker = i;
+        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, arg) != 0) {
+            free(arg);
+            pool->num_workers = i;
+            break;
+        }
+    }
+
+    return pool;
+}
+
+void thread_pool_run(ThreadPool *pool, thread_pool_job fn, void *ctx, int num_jobs) {
+    if (num_jobs <= 0) return;
+
+    // Not worth waking anyone up
+    if (pool->num_workers == 1 || num_jobs == 1) {
+        for (int job = 0; job < num_jobs; job++) {
+            fn(ctx, job, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->num_jobs = num_jobs;
+    atomic_store(&pool->next_job, 0);
+    pool->active = pool->num_workers - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    thread_pool_drain(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_destroy(ThreadPool *pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->num_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->threads);
+    free(pool);
+}
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,211 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Trace zones
+// TRACE_ZONE("name") times the rest of the block it's in. Every thread
+// writes its zones into a ring of its own, allocated along with all the
+// others when tracing starts, so a zone costs two clock reads and a few
+// stores, no locks and no allocation. A full ring overwrites its oldest
+// zones, so what's kept is always the last stretch before a dump.
+// trace_write() dumps every ring as Chrome trace JSON, which
+// chrome://tracing and ui.perfetto.dev open.
+// Until trace_start() a zone is a load and a branch at each end, and
+// with TRACING 0 zones aren't compiled in at all
+
+#ifndef TRACING
+#define TRACING 1
+#endif
+
+#define TRACE_MAX_THREADS 64
+#define TRACE_RING_EVENTS 16384 // Per thread, has to be a power of two
+
+typedef struct TraceEvent {
+    const char *name; // Has to outlive the trace, string literals do
+    uint64_t start_ns;
+    uint64_t duration_ns;
+} TraceEvent;
+
+typedef struct TraceRing {
+    TraceEvent *events;
+    atomic_uint_fast64_t head; // Events ever written, only the owning thread moves it
+    atomic_int ready; // Set once the fields below are filled in
+    int tid;
+    char name[32];
+} TraceRing;
+
+typedef struct Tracer {
+    atomic_int enabled;
+    uint64_t start_ns; // Timestamps in the dump count from here
+    TraceEvent *storage; // Every ring's events, in one allocation
+    TraceRing rings[TRACE_MAX_THREADS];
+    atomic_int num_rings;
+} Tracer;
+
+typedef struct TraceZone {
+    const char *name;
+    uint64_t start_ns; // 0 when tracing was off as the zone began
+} TraceZone;
+
+Tracer tracer;
+static __thread TraceRing *trace_thread_ring;
+static __thread int trace_thread_dropped; // No ring left for this thread
+static __thread char trace_thread_label[32];
+
+// Set from a signal handler, see trace_request_dump()
+volatile sig_atomic_t trace_dump_requested = 0;
+
+static inline uint64_t trace_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Names the calling thread in the dump. Works before tracing starts too
+void trace_thread_name(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(trace_thread_label, sizeof(trace_thread_label), format, args);
+    va_end(args);
+}
+
+// Allocates the rings and starts recording. Returns -1 if they don't fit
+int trace_start() {
+    if (atomic_load(&tracer.enabled)) return 0;
+    // Pages only get memory once a thread writes to them
+    tracer.storage = (TraceEvent*)calloc((size_t)TRACE_MAX_THREADS * TRACE_RING_EVENTS, sizeof(TraceEvent));
+    if (!tracer.storage) {
+        fprintf(stderr, "Failed to allocate trace buffers\n");
+        return -1;
+    }
+    tracer.start_ns = trace_now_ns();
+    atomic_store(&tracer.enabled, 1);
+    return 0;
+}
+
+// Claims a ring for the calling thread, the first time it ends a zone
+static TraceRing *trace_register_thread() {
+    if (trace_thread_dropped) return NULL;
+    int index = atomic_fetch_add(&tracer.num_rings, 1);
+    if (index >= TRACE_MAX_THREADS) {
+        trace_thread_dropped = 1;
+        return NULL;
+    }
+    TraceRing *ring = &tracer.rings[index];
+    ring->events = tracer.storage + (size_t)index * TRACE_RING_EVENTS;
+    ring->tid = index + 1;
+    if (trace_thread_label[0]) {
+        memcpy(ring->name, trace_thread_label, sizeof(ring->name));
+    } else {
+        snprintf(ring->name, sizeof(ring->name), "thread %d", ring->tid);
+    }
+    atomic_store_explicit(&ring->ready, 1, memory_order_release);
+    trace_thread_ring = ring;
+    return ring;
+}
+
+void trace_record(const char *name, uint64_t start_ns, uint64_t end_ns) {
+    TraceRing *ring = trace_thread_ring;
+    if (!ring && !(ring = trace_register_thread())) return;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    TraceEvent *event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+    event->name = name;
+    event->start_ns = start_ns;
+    event->duration_ns = end_ns - start_ns;
+    // The event is written before anyone reading the head can see it
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static inline TraceZone trace_zone_begin(const char *name) {
+    TraceZone zone = {name, 0};
+    if (__builtin_expect(atomic_load_explicit(&tracer.enabled, memory_order_relaxed), 0)) {
+        zone.start_ns = trace_now_ns();
+    }
+    return zone;
+}
+
+static inline void trace_zone_end(TraceZone *zone) {
+    if (__builtin_expect(zone->start_ns != 0, 0)) {
+        trace_record(zone->name, zone->start_ns, trace_now_ns());
+    }
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#if TRACING
+#define TRACE_ZONE(name) \
+    TraceZone TRACE_CONCAT(trace_zone_, __LINE__) __attribute__((cleanup(trace_zone_end))) = trace_zone_begin(name)
+#else
+#define TRACE_ZONE(name) ((void)0)
+#endif
+
+// SIGUSR1 handler. Writing a file isn't safe in a handler, so this only
+// asks for it and the render loop calls trace_write() when it sees it
+void trace_request_dump(int signum) {
+    trace_dump_requested = 1;
+}
+
+// Writes whatever the rings hold now as Chrome trace JSON. Threads keep
+// recording meanwhile; zones they overwrite while the copy is being made
+// are left out rather than written half old, half new.
+// Returns -1 (after printing why) if the file can't be written
+int trace_write(const char *path) {
+    if (!atomic_load(&tracer.enabled)) return 0;
+    TraceEvent *copy = (TraceEvent*)malloc(TRACE_RING_EVENTS * sizeof(TraceEvent));
+    FILE *out = copy ? fopen(path, "w") : NULL;
+    if (!out) {
+        perror("Error writing trace");
+        free(copy);
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(out, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"tty_renderer\"}}");
+    unsigned long long written = 0;
+    int num_rings = atomic_load(&tracer.num_rings);
+    if (num_rings > TRACE_MAX_THREADS) num_rings = TRACE_MAX_THREADS;
+    for (int r = 0; r < num_rings; r++) {
+        TraceRing *ring = &tracer.rings[r];
+        if (!atomic_load_explicit(&ring->ready, memory_order_acquire)) continue;
+        fprintf(out, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                ring->tid, ring->name);
+
+        uint64_t end = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t begin = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+        for (uint64_t i = begin; i < end; i++) {
+            copy[i - begin] = ring->events[i & (TRACE_RING_EVENTS - 1)];
+        }
+        // Anything the thread got around to overwriting meanwhile is gone,
+        // plus the slot it may be writing event `now` into at this moment
+        uint64_t now = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t first_intact = now + 1 > TRACE_RING_EVENTS ? now + 1 - TRACE_RING_EVENTS : 0;
+
+        for (uint64_t i = begin > first_intact ? begin : first_intact; i < end; i++) {
+            const TraceEvent *event = &copy[i - begin];
+            fprintf(out, ",\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    event->name, ring->tid, (double)(int64_t)(event->start_ns - tracer.start_ns) / 1000.0,
+                    event->duration_ns / 1000.0);
+            written++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    int failed = ferror(out);
+    if (fclose(out) != 0) failed = 1;
+    free(copy);
+    if (failed) {
+        fprintf(stderr, "Error writing trace to %s\n", path);
+        return -1;
+    }
+    fprintf(stderr, "Trace: %llu zones from %d threads written to %s\n", written, num_rings, path);
+    return 0;
+}
+
+#endif // TRACE_H
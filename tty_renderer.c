@@ -1,4 +1,5 @@
 #include <fcntl.h>      // For open
+#include <sys/stat.h>   // For telling devices from files
 #include <linux/fb.h>   // For FBIOGET_VSCREENINFO
 #include <sys/ioctl.h>  // For ioctl
 #include <sys/mman.h>   // For mmap
@@ -19,6 +20,21 @@
 #include <GLES2/gl2ext.h>
 #include "config.h"
 #include "vectors.h"
+#include "rasterizer.h"
+#include "framebuffer.h"
+#include "frame_pacer.h"
+#include "present_queue.h"
+#include "resolution.h"
+#include "mesh_cache.h"
+#include "obj_parser.h"
+#include "mesh_optimize.h"
+#include "culling.h"
+#include "scene.h"
+#include "camera_path.h"
+#include "raycaster.h"
+#include "bench.h"
+#include "trace.h"
+#include "stats.h"
 #define TINYOBJ_LOADER_C_IMPLEMENTATION
 #include "tinyobj_loader_c.h"
 
@@ -41,6 +57,15 @@ PFNGLGENVERTEXARRAYSOESPROC glGenVertexArraysOES;
 PFNGLBINDVERTEXARRAYOESPROC glBindVertexArrayOES;
 PFNGLDELETEVERTEXARRAYSOESPROC glDeleteVertexArraysOES;
 
+// Function pointers for instanced drawing, NULL without instanced arrays
+PFNGLDRAWELEMENTSINSTANCEDEXTPROC glDrawElementsInstancedEXT;
+PFNGLVERTEXATTRIBDIVISOREXTPROC glVertexAttribDivisorEXT;
+
+// Function pointers for fence syncs, NULL if the display doesn't have them
+PFNEGLCREATESYNCKHRPROC eglCreateSyncKHR;
+PFNEGLCLIENTWAITSYNCKHRPROC eglClientWaitSyncKHR;
+PFNEGLDESTROYSYNCKHRPROC eglDestroySyncKHR;
+
 // Helper function to load extensions
 void load_gl_extensions() {
     glGenVertexArraysOES = (PFNGLGENVERTEXARRAYSOESPROC)
@@ -57,6 +82,64 @@ void load_gl_extensions() {
     }
 }
 
+// Fences need EGL_KHR_fence_sync on the display, and GL_OES_EGL_sync so
+// they can be put into the GLES command stream
+int load_fence_sync(EGLDisplay display) {
+    const char *egl_extensions = eglQueryString(display, EGL_EXTENSIONS);
+    const char *gl_extensions = (const char*)glGetString(GL_EXTENSIONS);
+    if (!egl_extensions || !strstr(egl_extensions, "EGL_KHR_fence_sync") ||
+        !gl_extensions || !strstr(gl_extensions, "GL_OES_EGL_sync")) {
+        return -1;
+    }
+
+    eglCreateSyncKHR = (PFNEGLCREATESYNCKHRPROC)
+        eglGetProcAddress("eglCreateSyncKHR");
+    eglClientWaitSyncKHR = (PFNEGLCLIENTWAITSYNCKHRPROC)
+        eglGetProcAddress("eglClientWaitSyncKHR");
+    eglDestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC)
+        eglGetProcAddress("eglDestroySyncKHR");
+
+    if (!eglCreateSyncKHR || !eglClientWaitSyncKHR || !eglDestroySyncKHR) {
+        eglCreateSyncKHR = NULL;
+        eglClientWaitSyncKHR = NULL;
+        eglDestroySyncKHR = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Instanced arrays are an extension in GLES2, as EXT or ANGLE with the
+// same entry points under different suffixes, and core from GLES 3.0.
+// Returns the name of the one we got, NULL if there's none
+const char *load_instanced_arrays() {
+    static const struct {
+        const char *extension; // NULL for core
+        const char *draw;
+        const char *divisor;
+    } sources[] = {
+        {"GL_EXT_instanced_arrays", "glDrawElementsInstancedEXT", "glVertexAttribDivisorEXT"},
+        {"GL_ANGLE_instanced_arrays", "glDrawElementsInstancedANGLE", "glVertexAttribDivisorANGLE"},
+        {NULL, "glDrawElementsInstanced", "glVertexAttribDivisor"},
+    };
+    const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+    const char *version = (const char*)glGetString(GL_VERSION);
+    int gles3 = version && strncmp(version, "OpenGL ES ", 10) == 0 && version[10] >= '3';
+
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        if (sources[i].extension ? !extensions || !strstr(extensions, sources[i].extension) : !gles3) {
+            continue;
+        }
+        glDrawElementsInstancedEXT = (PFNGLDRAWELEMENTSINSTANCEDEXTPROC)eglGetProcAddress(sources[i].draw);
+        glVertexAttribDivisorEXT = (PFNGLVERTEXATTRIBDIVISOREXTPROC)eglGetProcAddress(sources[i].divisor);
+        if (glDrawElementsInstancedEXT && glVertexAttribDivisorEXT) {
+            return sources[i].extension ? sources[i].extension : "GLES 3";
+        }
+    }
+    glDrawElementsInstancedEXT = NULL;
+    glVertexAttribDivisorEXT = NULL;
+    return NULL;
+}
+
 // Structure to track key states (1 = pressed, 0 = released)
 typedef struct {
     int w, a, s, d;
@@ -67,19 +150,66 @@ typedef struct {
 } KeyState;
 
 
+// Vertex layout: position, normal, then texcoord only if the mesh has them
+#define MESH_NORMAL_OFFSET 3
+#define MESH_TEXCOORD_OFFSET 6
+#define MESH_STRIDE 6 // Floats per vertex without texcoords
+#define MESH_STRIDE_TEXCOORDS 8
+
 // Mesh structure
 typedef struct {
     GLuint vao;
-    GLuint vbo_positions;
-    GLuint vbo_normals;
-    GLuint vbo_texcoords;
+    GLuint vbo;
     GLuint ebo;
     unsigned int num_indices;
     vec3 position;
     vec3 rotation;
     vec3 scale;
+
+    // CPU side copy of the mesh, the software rasterizer draws from these
+    // One interleaved vertex stream, see MESH_STRIDE above
+    float *vertices;
+    unsigned int vertex_stride;
+    unsigned int num_vertices;
+    void *indices; // uint16_t when index_size is 2, otherwise uint32_t
+    unsigned int index_size;
+    vec3 bounds_min; // Model space, see mesh_build_culling()
+    vec3 bounds_max;
+    vec3 bounds_center;
+    float bounds_radius;
+    float acmr_before; // Vertex cache misses per triangle, see mesh_optimize.h
+    float acmr_after; // 0 if never measured
+
+    // Levels of detail, all in the one index buffer (see mesh_simplify.h)
+    // Without any, the whole index buffer is the only level
+    unsigned int num_lods;
+    MeshLod lods[MESH_MAX_LODS];
+
+    // Frustum culling clusters (see culling.h), the ones of level i are
+    // lod_clusters[i] up to lod_clusters[i + 1]
+    CullCluster *clusters;
+    unsigned int num_clusters;
+    unsigned int lod_clusters[MESH_MAX_LODS + 1];
+
+    // Set when the arrays above point into a mapped mesh cache
+    MeshCacheData cache;
 } Mesh;
 
+void free_mesh(Mesh* mesh);
+
+static inline unsigned int mesh_index(const Mesh *mesh, size_t i) {
+    return mesh->index_size == 2 ? ((const uint16_t*)mesh->indices)[i] : ((const uint32_t*)mesh->indices)[i];
+}
+
+static inline MeshLod mesh_lod(const Mesh *mesh, unsigned int level) {
+    if (mesh->num_lods == 0) return (MeshLod){0, mesh->num_indices, 0.0f, 0};
+    return mesh->lods[level < mesh->num_lods ? level : mesh->num_lods - 1];
+}
+
+static inline GLenum mesh_index_type(const Mesh *mesh) {
+    return mesh->index_size == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
 // OpenGL/EGL structures
 struct render_device {
     int fd;
@@ -103,8 +233,47 @@ struct render_device {
     GLint u_light_dir;
     GLint u_light_color;
     GLint u_camera_pos;
+    GLint u_color;
+
+    // Instanced drawing for scenes (see draw_scene_gl()), which needs
+    // instanced arrays. The model matrix and color of every instance come
+    // from instance_vbo as attributes instead of uniforms
+    const char *instancing; // Where the entry points came from, NULL without
+    GLuint instanced_program;
+    GLint u_instanced_view_projection;
+    GLint u_instanced_view;
+    GLint u_instanced_light_dir;
+    GLint u_instanced_light_color;
+    GLint u_instanced_camera_pos;
+    GLuint instance_vbo;
+    float *instance_data; // Staging for instance_vbo
+    unsigned int instance_capacity;
 };
 
+// GL resource bookkeeping
+// Programs are cached by a hash of their sources, and every GL object we
+// create is counted here so leaks show up (see --gl-soak)
+typedef struct {
+    uint64_t key;
+    GLuint program;
+} ProgramCacheEntry;
+
+typedef struct {
+    ProgramCacheEntry *programs;
+    int num_programs;
+    int program_capacity;
+
+    // Live object counts
+    int live_shaders;
+    int live_programs;
+    int live_buffers;
+    int live_vertex_arrays;
+    int live_framebuffers;
+    int live_renderbuffers;
+} GLResources;
+
+GLResources gl_resources = {0};
+
 KeyState key_state = {0}; // Initialize all keys to not pressed
 struct libevdev *input_dev = NULL;
 int input_fd = -1;
@@ -117,14 +286,39 @@ const char *vertex_shader_source =
     "uniform mat4 u_mvp;\n"       // Model-view-projection
     "uniform mat4 u_model;\n"     // Model matrix
     "uniform mat4 u_view;\n"      // View matrix
+    "uniform vec4 u_color;\n"     // Instance color
     "varying vec3 v_normal;\n"
     "varying vec3 v_position;\n"
     "varying vec2 v_texcoord;\n"
+    "varying vec4 v_color;\n"
     "void main() {\n"
     "  gl_Position = u_mvp * vec4(a_position, 1.0);\n"
     "  v_normal = mat3(u_model) * a_normal;\n"  // Transform normal to world space
     "  v_position = (u_model * vec4(a_position, 1.0)).xyz;\n"  // Position in world space
     "  v_texcoord = a_texcoord;\n"
+    "  v_color = u_color;\n"
+    "}\n";
+
+// Same as above with the model matrix and color per instance
+const char *instanced_vertex_shader_source =
+    "attribute vec3 a_position;\n"
+    "attribute vec3 a_normal;\n"
+    "attribute vec2 a_texcoord;\n"
+    "attribute mat4 a_model;\n"   // Per instance
+    "attribute vec4 a_color;\n"   // Per instance
+    "uniform mat4 u_view_projection;\n"
+    "uniform mat4 u_view;\n"
+    "varying vec3 v_normal;\n"
+    "varying vec3 v_position;\n"
+    "varying vec2 v_texcoord;\n"
+    "varying vec4 v_color;\n"
+    "void main() {\n"
+    "  vec4 world = a_model * vec4(a_position, 1.0);\n"
+    "  gl_Position = u_view_projection * world;\n"
+    "  v_normal = mat3(a_model) * a_normal;\n"
+    "  v_position = world.xyz;\n"
+    "  v_texcoord = a_texcoord;\n"
+    "  v_color = a_color;\n"
     "}\n";
 
 // Fragment shader for basic lighting
@@ -150,8 +344,9 @@ const char *fragment_shader_source =
 
 const char *debug_fragment_shader_source =
     "precision mediump float;\n"
+    "varying vec4 v_color;\n"
     "void main() {\n"
-    "  gl_FragColor = vec4(1.0, 1.0, 0.0, 1.0);\n" // Bright yellow
+    "  gl_FragColor = vec4(1.0, 1.0, 0.0, 1.0) * v_color;\n" // Bright yellow, tinted per instance
     "}\n";
 
 void term(int signum) {
@@ -194,6 +389,7 @@ int setup_input(const char *device_path) {
 }
 
 void process_input_events() {
+    TRACE_ZONE("input");
     struct input_event ev;
     int rc;
     
@@ -242,6 +438,7 @@ GLuint compile_shader(GLenum type, const char *source) {
         return 0;
     }
 
+    gl_resources.live_shaders++;
     return shader;
 }
 
@@ -250,6 +447,13 @@ GLuint create_program(GLuint vertex_shader, GLuint fragment_shader) {
     GLuint program = glCreateProgram();
     glAttachShader(program, vertex_shader);
     glAttachShader(program, fragment_shader);
+
+    // Same slots upload_mesh() puts the vertex streams in
+    glBindAttribLocation(program, 0, "a_position");
+    glBindAttribLocation(program, 1, "a_normal");
+    glBindAttribLocation(program, 2, "a_texcoord");
+    glBindAttribLocation(program, 3, "a_model"); // Takes 3 to 6, one per column
+    glBindAttribLocation(program, 7, "a_color");
     glLinkProgram(program);
 
     GLint success;
@@ -262,9 +466,84 @@ GLuint create_program(GLuint vertex_shader, GLuint fragment_shader) {
         return 0;
     }
 
+    gl_resources.live_programs++;
+    return program;
+}
+
+static uint64_t hash_shader_sources(const char *vertex_source, const char *fragment_source) {
+    // FNV-1a over both sources, with the terminator in between
+    uint64_t hash = 1469598103934665603ULL;
+    const char *sources[2] = {vertex_source, fragment_source};
+    for (int i = 0; i < 2; i++) {
+        const unsigned char *c = (const unsigned char*)sources[i];
+        do {
+            hash ^= *c;
+            hash *= 1099511628211ULL;
+        } while (*c++);
+    }
+    return hash;
+}
+
+// Compile and link a program, or hand back the one already built from
+// the same sources. Programs live until release_programs()
+GLuint get_program(const char *vertex_source, const char *fragment_source) {
+    uint64_t key = hash_shader_sources(vertex_source, fragment_source);
+    for (int i = 0; i < gl_resources.num_programs; i++) {
+        if (gl_resources.programs[i].key == key) {
+            return gl_resources.programs[i].program;
+        }
+    }
+
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_source);
+    if (!vertex_shader) {
+        return 0;
+    }
+
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+    if (!fragment_shader) {
+        glDeleteShader(vertex_shader);
+        gl_resources.live_shaders--;
+        return 0;
+    }
+
+    // The program keeps what it needs, the shaders can go
+    GLuint program = create_program(vertex_shader, fragment_shader);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    gl_resources.live_shaders -= 2;
+    if (!program) {
+        return 0;
+    }
+
+    if (gl_resources.num_programs == gl_resources.program_capacity) {
+        int capacity = gl_resources.program_capacity ? gl_resources.program_capacity * 2 : 8;
+        ProgramCacheEntry *programs = (ProgramCacheEntry*)realloc(gl_resources.programs, capacity * sizeof(ProgramCacheEntry));
+        if (!programs) {
+            glDeleteProgram(program);
+            gl_resources.live_programs--;
+            return 0;
+        }
+        gl_resources.programs = programs;
+        gl_resources.program_capacity = capacity;
+    }
+    gl_resources.programs[gl_resources.num_programs].key = key;
+    gl_resources.programs[gl_resources.num_programs].program = program;
+    gl_resources.num_programs++;
+
     return program;
 }
 
+void release_programs() {
+    for (int i = 0; i < gl_resources.num_programs; i++) {
+        glDeleteProgram(gl_resources.programs[i].program);
+    }
+    gl_resources.live_programs -= gl_resources.num_programs;
+    free(gl_resources.programs);
+    gl_resources.programs = NULL;
+    gl_resources.num_programs = 0;
+    gl_resources.program_capacity = 0;
+}
+
 // Find an available DRM render node
 static int find_drm_render_node(struct render_device *dev) {
     DIR *dir;
@@ -302,35 +581,55 @@ static int find_drm_render_node(struct render_device *dev) {
     return 0;
 }
 
+// A render node if there is one. Otherwise, if allowed, carry on without
+// a device and init_egl_surfaceless() asks Mesa for a software (llvmpipe)
+// context, which is slow but lets the GL path run on machines with no GPU
+static int open_render_device(struct render_device *dev, int allow_software) {
+    dev->fd = -1;
+    if (find_drm_render_node(dev) == 0) {
+        return 0;
+    }
+    if (!allow_software) {
+        return -1;
+    }
+    printf("Using a surfaceless context without a render node\n");
+    return 0;
+}
+
 static int init_egl_surfaceless(struct render_device *dev, int width, int height) {
     // Set render size
     dev->width = width;
     dev->height = height;
 
-    // Create GBM device
-    dev->gbm_dev = gbm_create_device(dev->fd);
-    if (!dev->gbm_dev) {
-        fprintf(stderr, "Failed to create GBM device: %s\n", strerror(errno));
-        return -1;
-    }
-
     // Get EGL display
     PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = 
         (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
     if (!get_platform_display) {
         fprintf(stderr, "Failed to get eglGetPlatformDisplayEXT function\n");
-        gbm_device_destroy(dev->gbm_dev);
         return -1;
     }
 
-    dev->egl_display = get_platform_display(EGL_PLATFORM_GBM_KHR, dev->gbm_dev, NULL);
+    dev->gbm_dev = NULL;
+    if (dev->fd >= 0) {
+        // Create GBM device
+        dev->gbm_dev = gbm_create_device(dev->fd);
+        if (!dev->gbm_dev) {
+            fprintf(stderr, "Failed to create GBM device: %s\n", strerror(errno));
+            return -1;
+        }
+        dev->egl_display = get_platform_display(EGL_PLATFORM_GBM_KHR, dev->gbm_dev, NULL);
+    } else {
+        // No render node, Mesa can still render without a device (llvmpipe)
+        dev->egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+
     if (dev->egl_display == EGL_NO_DISPLAY) {
         // Try the old method if the platform method fails
         fprintf(stderr, "Failed to get EGL display via platform extension, trying default method\n");
         dev->egl_display = eglGetDisplay((EGLNativeDisplayType)dev->gbm_dev);
         if (dev->egl_display == EGL_NO_DISPLAY) {
             fprintf(stderr, "Failed to get EGL display: %04x\n", eglGetError());
-            gbm_device_destroy(dev->gbm_dev);
+            if (dev->gbm_dev) gbm_device_destroy(dev->gbm_dev);
             return -1;
         }
     }
@@ -338,7 +637,7 @@ static int init_egl_surfaceless(struct render_device *dev, int width, int height
     // Initialize EGL
     if (!eglInitialize(dev->egl_display, NULL, NULL)) {
         fprintf(stderr, "Failed to initialize EGL: %04x\n", eglGetError());
-        gbm_device_destroy(dev->gbm_dev);
+        if (dev->gbm_dev) gbm_device_destroy(dev->gbm_dev);
         return -1;
     }
 
@@ -351,7 +650,7 @@ static int init_egl_surfaceless(struct render_device *dev, int width, int height
     if (!eglBindAPI(EGL_OPENGL_ES_API)) {
         fprintf(stderr, "Failed to bind OpenGL ES API: %04x\n", eglGetError());
         eglTerminate(dev->egl_display);
-        gbm_device_destroy(dev->gbm_dev);
+        if (dev->gbm_dev) gbm_device_destroy(dev->gbm_dev);
         return -1;
     }
 
@@ -380,10 +679,16 @@ static int init_egl_surfaceless(struct render_device *dev, int width, int height
         };
         
         if (!eglChooseConfig(dev->egl_display, minimal_attribs, &config, 1, &num_configs) || num_configs == 0) {
-            fprintf(stderr, "Still failed to choose EGL config: %04x\n", eglGetError());
-            eglTerminate(dev->egl_display);
-            gbm_device_destroy(dev->gbm_dev);
-            return -1;
+            // We only ever draw into our own FBOs, so if the display has
+            // no configs at all (Mesa's surfaceless platform) we don't need one
+            const char *extensions = eglQueryString(dev->egl_display, EGL_EXTENSIONS);
+            if (!extensions || !strstr(extensions, "EGL_KHR_no_config_context")) {
+                fprintf(stderr, "Still failed to choose EGL config: %04x\n", eglGetError());
+                eglTerminate(dev->egl_display);
+                if (dev->gbm_dev) gbm_device_destroy(dev->gbm_dev);
+                return -1;
+            }
+            config = EGL_NO_CONFIG_KHR;
         }
     }
 
@@ -404,7 +709,7 @@ static int init_egl_surfaceless(struct render_device *dev, int width, int height
     if (dev->egl_context == EGL_NO_CONTEXT) {
         fprintf(stderr, "Failed to create EGL context: %04x\n", eglGetError());
         eglTerminate(dev->egl_display);
-        gbm_device_destroy(dev->gbm_dev);
+        if (dev->gbm_dev) gbm_device_destroy(dev->gbm_dev);
         return -1;
     }
 
@@ -413,7 +718,7 @@ static int init_egl_surfaceless(struct render_device *dev, int width, int height
         fprintf(stderr, "Failed to make EGL context current: %04x\n", eglGetError());
         eglDestroyContext(dev->egl_display, dev->egl_context);
         eglTerminate(dev->egl_display);
-        gbm_device_destroy(dev->gbm_dev);
+        if (dev->gbm_dev) gbm_device_destroy(dev->gbm_dev);
         return -1;
     }
 
@@ -421,16 +726,22 @@ static int init_egl_surfaceless(struct render_device *dev, int width, int height
 }
 
 static void cleanup_egl(struct render_device *dev) {
+    if (dev->instance_vbo) {
+        glDeleteBuffers(1, &dev->instance_vbo);
+        gl_resources.live_buffers--;
+    }
+    free(dev->instance_data);
+
     // Clean up EGL
     eglMakeCurrent(dev->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
     eglDestroyContext(dev->egl_display, dev->egl_context);
     eglTerminate(dev->egl_display);
 
     // Clean up GBM
-    gbm_device_destroy(dev->gbm_dev);
+    if (dev->gbm_dev) gbm_device_destroy(dev->gbm_dev);
 
     // Close DRM FD
-    close(dev->fd);
+    if (dev->fd >= 0) close(dev->fd);
 }
 
 // Set up shader program for 3D rendering
@@ -438,22 +749,8 @@ int setup_3d_rendering(struct render_device *dev) {
     // Load GL extensions
     load_gl_extensions();
     
-    // Compile shaders
-    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_shader_source);
-    if (!vertex_shader) {
-        return -1;
-    }
-
-    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, debug_fragment_shader_source);
-    if (!fragment_shader) {
-        glDeleteShader(vertex_shader);
-        return -1;
-    }
-
     // Create shader program
-    dev->program = create_program(vertex_shader, fragment_shader);
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment_shader);
+    dev->program = get_program(vertex_shader_source, debug_fragment_shader_source);
     if (!dev->program) {
         return -1;
     }
@@ -465,6 +762,25 @@ int setup_3d_rendering(struct render_device *dev) {
     dev->u_light_dir = glGetUniformLocation(dev->program, "u_light_dir");
     dev->u_light_color = glGetUniformLocation(dev->program, "u_light_color");
     dev->u_camera_pos = glGetUniformLocation(dev->program, "u_camera_pos");
+    dev->u_color = glGetUniformLocation(dev->program, "u_color");
+
+    // Scenes draw with instancing when there's a way to
+    dev->instancing = load_instanced_arrays();
+    if (dev->instancing) {
+        dev->instanced_program = get_program(instanced_vertex_shader_source, debug_fragment_shader_source);
+        if (!dev->instanced_program) {
+            dev->instancing = NULL;
+        }
+    }
+    if (dev->instancing) {
+        dev->u_instanced_view_projection = glGetUniformLocation(dev->instanced_program, "u_view_projection");
+        dev->u_instanced_view = glGetUniformLocation(dev->instanced_program, "u_view");
+        dev->u_instanced_light_dir = glGetUniformLocation(dev->instanced_program, "u_light_dir");
+        dev->u_instanced_light_color = glGetUniformLocation(dev->instanced_program, "u_light_color");
+        dev->u_instanced_camera_pos = glGetUniformLocation(dev->instanced_program, "u_camera_pos");
+        glGenBuffers(1, &dev->instance_vbo);
+        gl_resources.live_buffers++;
+    }
     
     // Enable depth testing for 3D rendering
     glEnable(GL_DEPTH_TEST);
@@ -478,211 +794,997 @@ int setup_3d_rendering(struct render_device *dev) {
     return 0;
 }
 
-// Load an .obj model
-Mesh* load_obj_model(const char* filename) {
-    // Check if file exists first
-    FILE* file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Error: Cannot open file '%s': %s\n", 
-                filename, strerror(errno));
-        return NULL;
+// Offscreen color + depth target the GL backend renders into
+int create_render_target(struct render_device *dev, GLenum color_format, GLuint *fbo, GLuint *color_rb, GLuint *depth_rb) {
+    glGenFramebuffers(1, fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+
+    // Create color renderbuffer
+    glGenRenderbuffers(1, color_rb);
+    glBindRenderbuffer(GL_RENDERBUFFER, *color_rb);
+    glRenderbufferStorage(GL_RENDERBUFFER, color_format, dev->width, dev->height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, *color_rb);
+
+    // Create depth renderbuffer
+    glGenRenderbuffers(1, depth_rb);
+    glBindRenderbuffer(GL_RENDERBUFFER, *depth_rb);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, dev->width, dev->height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, *depth_rb);
+
+    gl_resources.live_framebuffers++;
+    gl_resources.live_renderbuffers += 2;
+
+    // Check framebuffer completeness
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Framebuffer not complete: %d\n", status);
+        return -1;
     }
-    fclose(file);
-    
-    printf("Loading OBJ file: %s\n", filename);
-    
-    // Check if OES extension functions are initialized
-    if (!glGenVertexArraysOES || !glBindVertexArrayOES || !glDeleteVertexArraysOES) {
-        fprintf(stderr, "Error: VAO extension functions not initialized!\n");
-        return NULL;
+
+    return 0;
+}
+
+void destroy_render_target(GLuint *fbo, GLuint *color_rb, GLuint *depth_rb) {
+    if (!*fbo) return;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(1, color_rb);
+    glDeleteRenderbuffers(1, depth_rb);
+    glDeleteFramebuffers(1, fbo);
+    gl_resources.live_framebuffers--;
+    gl_resources.live_renderbuffers -= 2;
+    *fbo = *color_rb = *depth_rb = 0;
+}
+
+// GL readback
+// glReadPixels() right after drawing stalls until the GPU is done with
+// the frame. Instead, frames are drawn into a ring of render targets and
+// each gets a fence. A frame is only read back once the ring is full, by
+// which time the frames after it have already been submitted, and the
+// read waits on that frame's fence alone. This costs num_targets - 1
+// frames of latency. With one target (or no fence support) it's the old
+// draw, then read right away.
+// When GL can hand back pixels laid out exactly like the framebuffer
+// (RGBA, BGRA or RGB565), frames are read in that format and drawn
+// upside down, so the rows come out top first and the blitter only has
+// to copy them
+#define READBACK_MAX_TARGETS 3
+
+typedef struct {
+    int num_targets;
+    EGLDisplay display;
+    GLuint fbo[READBACK_MAX_TARGETS];
+    GLuint color_rb[READBACK_MAX_TARGETS];
+    GLuint depth_rb[READBACK_MAX_TARGETS];
+    EGLSyncKHR fence[READBACK_MAX_TARGETS];
+
+    GLenum color_format;
+    GLenum read_format;
+    GLenum read_type;
+    int bytes_per_pixel; // Of what glReadPixels() writes
+    int native; // Framebuffer format, top row first
+
+    // Size and scale of the frame in each target
+    int width[READBACK_MAX_TARGETS];
+    int height[READBACK_MAX_TARGETS];
+    int scale[READBACK_MAX_TARGETS];
+
+    // Frames drawn - read are waiting, target is index % num_targets
+    unsigned long drawn;
+    unsigned long read;
+} ReadbackRing;
+
+void readback_destroy(ReadbackRing *ring) {
+    for (int i = 0; i < READBACK_MAX_TARGETS; i++) {
+        if (ring->fence[i] != EGL_NO_SYNC_KHR) {
+            eglDestroySyncKHR(ring->display, ring->fence[i]);
+            ring->fence[i] = EGL_NO_SYNC_KHR;
+        }
+        destroy_render_target(&ring->fbo[i], &ring->color_rb[i], &ring->depth_rb[i]);
     }
-    
-    // Create empty mesh
-    Mesh* mesh = (Mesh*)malloc(sizeof(Mesh));
-    if (!mesh) {
-        fprintf(stderr, "Failed to allocate mesh memory\n");
-        return NULL;
+}
+
+// The GL format/type a framebuffer layout can be read back as directly,
+// returns 0 if there isn't one
+static int readback_native_format(const struct fb_var_screeninfo *vinfo, GLenum *format, GLenum *type) {
+    int bytes = vinfo->red.length == 8 && vinfo->green.length == 8 && vinfo->blue.length == 8 &&
+                vinfo->green.offset == 8;
+    int no_alpha = vinfo->transp.length == 0;
+    int alpha_on_top = no_alpha || (vinfo->transp.length == 8 && vinfo->transp.offset == 24);
+
+    if (vinfo->bits_per_pixel == 32 && bytes && alpha_on_top &&
+        vinfo->red.offset == 0 && vinfo->blue.offset == 16) {
+        *format = GL_RGBA;
+        *type = GL_UNSIGNED_BYTE;
+        return 1;
     }
-    
-    // Set default position, rotation, scale
-    mesh->position = (vec3){0.0f, 0.0f, 0.0f};
-    mesh->rotation = (vec3){0.0f, 0.0f, 0.0f};
-    mesh->scale = (vec3){3.0f, 3.0f, 3.0f};
+    if (vinfo->bits_per_pixel == 32 && bytes && alpha_on_top &&
+        vinfo->red.offset == 16 && vinfo->blue.offset == 0) {
+        *format = GL_BGRA_EXT;
+        *type = GL_UNSIGNED_BYTE;
+        return 1;
+    }
+    if (vinfo->bits_per_pixel == 24 && bytes && no_alpha &&
+        vinfo->red.offset == 0 && vinfo->blue.offset == 16) {
+        *format = GL_RGB;
+        *type = GL_UNSIGNED_BYTE;
+        return 1;
+    }
+    if (vinfo->bits_per_pixel == 16 && no_alpha &&
+        vinfo->red.offset == 11 && vinfo->red.length == 5 &&
+        vinfo->green.offset == 5 && vinfo->green.length == 6 &&
+        vinfo->blue.offset == 0 && vinfo->blue.length == 5) {
+        *format = GL_RGB;
+        *type = GL_UNSIGNED_SHORT_5_6_5;
+        return 1;
+    }
+    return 0;
+}
 
-    
-    // Initialize tinyobj structures
-    tinyobj_attrib_t attrib;
-    tinyobj_shape_t* shapes = NULL;
-    size_t num_shapes = 0;
-    tinyobj_material_t* materials = NULL;
-    size_t num_materials = 0;
-    
-    memset(&attrib, 0, sizeof(attrib));
-    
-    // Set up file content buffer for safe parsing
-    unsigned int flags = TINYOBJ_FLAG_TRIANGULATE;
-    
-    // Set up error reporting
-    fprintf(stdout, "Starting OBJ parsing...\n");
-    
-    int ret = tinyobj_parse_obj(&attrib, &shapes, &num_shapes, &materials,
-                         &num_materials, filename, NULL, NULL, flags);
-                         
-    fprintf(stdout, "Parsing completed with result: %d\n", ret);
-    
-    if (ret != TINYOBJ_SUCCESS) {
-        fprintf(stderr, "Failed to load OBJ file: %s (error code %d)\n", filename, ret);
-        free(mesh);
-        return NULL;
+// vinfo is the framebuffer to read back for natively, NULL for RGBA
+int readback_init(ReadbackRing *ring, struct render_device *dev, int num_targets, const struct fb_var_screeninfo *vinfo) {
+    memset(ring, 0, sizeof(ReadbackRing));
+    ring->display = dev->egl_display;
+    if (num_targets < 1) num_targets = 1;
+    if (num_targets > READBACK_MAX_TARGETS) num_targets = READBACK_MAX_TARGETS;
+    if (num_targets > 1 && load_fence_sync(dev->egl_display) < 0) {
+        fprintf(stderr, "No fence sync support, reading back synchronously\n");
+        num_targets = 1;
     }
-    
-    // Verify that we have some data
-    if (attrib.num_vertices == 0 || attrib.num_faces == 0) {
-        fprintf(stderr, "Invalid OBJ file: No vertices or faces found\n");
-        tinyobj_attrib_free(&attrib);
-        tinyobj_shapes_free(shapes, num_shapes);
-        tinyobj_materials_free(materials, num_materials);
-        free(mesh);
-        return NULL;
+    ring->num_targets = num_targets;
+
+    // RGBA is the one format GLES2 can always read
+    const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+    int has_rgba8 = extensions && strstr(extensions, "GL_OES_rgb8_rgba8");
+    ring->color_format = has_rgba8 ? GL_RGBA8_OES : GL_RGBA4;
+    ring->read_format = GL_RGBA;
+    ring->read_type = GL_UNSIGNED_BYTE;
+    ring->bytes_per_pixel = 4;
+
+    GLenum native_format = GL_RGBA, native_type = GL_UNSIGNED_BYTE;
+    int want_native = vinfo && readback_native_format(vinfo, &native_format, &native_type);
+    if (want_native && native_type == GL_UNSIGNED_SHORT_5_6_5) {
+        ring->color_format = GL_RGB565;
     }
-    
-    printf("  Vertices: %d\n", (int)attrib.num_vertices);
-    printf("  Normals: %d\n", (int)attrib.num_normals);
-    printf("  Texcoords: %d\n", (int)attrib.num_texcoords);
-    printf("  Faces: %d\n", (int)attrib.num_faces);
-    printf("  Shapes: %d\n", (int)num_shapes);
-    
-    // Create VAO
-    glGenVertexArraysOES(1, &mesh->vao);
-    glBindVertexArrayOES(mesh->vao);
-    
-    // Create position VBO
-    glGenBuffers(1, &mesh->vbo_positions);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo_positions);
-    glBufferData(GL_ARRAY_BUFFER, attrib.num_vertices * 3 * sizeof(float),
-                attrib.vertices, GL_STATIC_DRAW);
-    
-    // Set up position attribute
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-    
-    // Create normal VBO if available
-    if (attrib.num_normals > 0) {
-        glGenBuffers(1, &mesh->vbo_normals);
-        glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo_normals);
-        glBufferData(GL_ARRAY_BUFFER, attrib.num_normals * 3 * sizeof(float),
-                    attrib.normals, GL_STATIC_DRAW);
-        
-        // Set up normal attribute
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-        glEnableVertexAttribArray(1);
-    } else {
-        // If no normals, generate simple normals (all pointing out)
-        float* normals = (float*)malloc(attrib.num_vertices * 3 * sizeof(float));
-        for (size_t i = 0; i < attrib.num_vertices * 3; i += 3) {
-            normals[i] = 0.0f;
-            normals[i+1] = 1.0f;  // All pointing up as a fallback
-            normals[i+2] = 0.0f;
+
+    for (int i = 0; i < ring->num_targets; i++) {
+        ring->fence[i] = EGL_NO_SYNC_KHR;
+        if (create_render_target(dev, ring->color_format, &ring->fbo[i], &ring->color_rb[i], &ring->depth_rb[i]) < 0) {
+            readback_destroy(ring);
+            return -1;
         }
-        
-        glGenBuffers(1, &mesh->vbo_normals);
-        glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo_normals);
-        glBufferData(GL_ARRAY_BUFFER, attrib.num_vertices * 3 * sizeof(float),
-                   normals, GL_STATIC_DRAW);
-        
-        // Set up normal attribute
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-        glEnableVertexAttribArray(1);
-        
-        free(normals);
     }
-    
-    // Create texcoord VBO if available
-    if (attrib.num_texcoords > 0) {
-        glGenBuffers(1, &mesh->vbo_texcoords);
-        glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo_texcoords);
-        glBufferData(GL_ARRAY_BUFFER, attrib.num_texcoords * 2 * sizeof(float),
-                    attrib.texcoords, GL_STATIC_DRAW);
-        
-        // Set up texcoord attribute
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, 0);
-        glEnableVertexAttribArray(2);
-    } else {
-        mesh->vbo_texcoords = 0;
+
+    // Anything but RGBA has to be the implementation's read format for
+    // this target, which can only be asked with it bound (BGRA is also
+    // fine with GL_EXT_read_format_bgra)
+    if (want_native && native_format != GL_RGBA) {
+        GLint format = 0, type = 0;
+        glBindFramebuffer(GL_FRAMEBUFFER, ring->fbo[0]);
+        glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_FORMAT, &format);
+        glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_TYPE, &type);
+        int readable = ((GLenum)format == native_format && (GLenum)type == native_type) ||
+                       (native_format == GL_BGRA_EXT && native_type == GL_UNSIGNED_BYTE &&
+                        extensions && strstr(extensions, "GL_EXT_read_format_bgra"));
+        if (!readable) {
+            fprintf(stderr, "GL can't read back in the framebuffer's format (it prefers 0x%04x/0x%04x), "
+                    "converting from RGBA\n", format, type);
+            want_native = 0;
+        }
     }
-    
-    // Create element buffer for indices
-    glGenBuffers(1, &mesh->ebo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ebo);
-    
-    // Use face indices - construct an index buffer from the face data
-    unsigned int* indices = (unsigned int*)malloc(attrib.num_faces * sizeof(unsigned int));
-    if (!indices) {
-        fprintf(stderr, "Failed to allocate index buffer\n");
-        glDeleteVertexArraysOES(1, &mesh->vao);
-        glDeleteBuffers(1, &mesh->vbo_positions);
-        if (mesh->vbo_normals) glDeleteBuffers(1, &mesh->vbo_normals);
-        if (mesh->vbo_texcoords) glDeleteBuffers(1, &mesh->vbo_texcoords);
-        free(mesh);
-        tinyobj_attrib_free(&attrib);
-        tinyobj_shapes_free(shapes, num_shapes);
-        tinyobj_materials_free(materials, num_materials);
-        return NULL;
+
+    if (want_native) {
+        ring->read_format = native_format;
+        ring->read_type = native_type;
+        ring->bytes_per_pixel = vinfo->bits_per_pixel / 8;
+        ring->native = 1;
+        // Rows are only as wide as the frame, and flipping the image
+        // flips the winding too
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glFrontFace(GL_CW);
+    } else {
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glFrontFace(GL_CCW);
     }
-    
-    // Use vertex indices directly
-    for (size_t i = 0; i < attrib.num_faces; i++) {
-        indices[i] = attrib.faces[i].v_idx;
+    return 0;
+}
+
+// Binds the target for the next frame, which will be width x height
+void readback_begin_frame(ReadbackRing *ring, int width, int height, int scale) {
+    int slot = ring->drawn % ring->num_targets;
+    glBindFramebuffer(GL_FRAMEBUFFER, ring->fbo[slot]);
+    ring->width[slot] = width;
+    ring->height[slot] = height;
+    ring->scale[slot] = scale;
+}
+
+// Fences the frame and sends it off without waiting for it
+void readback_end_frame(ReadbackRing *ring) {
+    int slot = ring->drawn % ring->num_targets;
+    if (ring->num_targets > 1) {
+        ring->fence[slot] = eglCreateSyncKHR(ring->display, EGL_SYNC_FENCE_KHR, NULL);
+        glFlush();
     }
-    
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, attrib.num_faces * sizeof(unsigned int),
-                indices, GL_STATIC_DRAW);
-    
-    mesh->num_indices = attrib.num_faces;
-    
-    free(indices);
-    
-    // Clean up tinyobj data
-    tinyobj_attrib_free(&attrib);
-    tinyobj_shapes_free(shapes, num_shapes);
-    tinyobj_materials_free(materials, num_materials);
-    
-    // Unbind VAO
-    glBindVertexArrayOES(0);
-    
-    return mesh;
+    ring->drawn++;
 }
 
-// testing
-// Add this function to create a simple cube
+// Is every target holding a frame, so the oldest has to be read before
+// the next one can be drawn
+int readback_full(ReadbackRing *ring) {
+    return ring->drawn - ring->read >= (unsigned long)ring->num_targets;
+}
+
+// Reads the oldest frame into pixels (RGBA bottom row first, or native)
+// and says how big it is
+void readback_read(ReadbackRing *ring, unsigned char *pixels, int *width, int *height, int *scale) {
+    TRACE_ZONE("readback_read");
+    int slot = ring->read % ring->num_targets;
+    if (ring->fence[slot] != EGL_NO_SYNC_KHR) {
+        eglClientWaitSyncKHR(ring->display, ring->fence[slot], EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+        eglDestroySyncKHR(ring->display, ring->fence[slot]);
+        ring->fence[slot] = EGL_NO_SYNC_KHR;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, ring->fbo[slot]);
+    glReadPixels(0, 0, ring->width[slot], ring->height[slot], ring->read_format, ring->read_type, pixels);
+    *width = ring->width[slot];
+    *height = ring->height[slot];
+    *scale = ring->scale[slot];
+    ring->read++;
+}
+
+// Box and sphere around the whole mesh, from its full detail clusters
+// (which cover everything the mesh draws)
+void mesh_bounds_from_clusters(Mesh *mesh) {
+    unsigned int first = mesh->lod_clusters[0], last = mesh->lod_clusters[1];
+    float bounds_min[3] = {0, 0, 0}, bounds_max[3] = {0, 0, 0};
+    for (unsigned int i = first; i < last; i++) {
+        for (int c = 0; c < 3; c++) {
+            float lo = mesh->clusters[i].bounds_min[c], hi = mesh->clusters[i].bounds_max[c];
+            if (i == first || lo < bounds_min[c]) bounds_min[c] = lo;
+            if (i == first || hi > bounds_max[c]) bounds_max[c] = hi;
+        }
+    }
+    mesh->bounds_min = (vec3){bounds_min[0], bounds_min[1], bounds_min[2]};
+    mesh->bounds_max = (vec3){bounds_max[0], bounds_max[1], bounds_max[2]};
+    mesh->bounds_center = scale_vec3(add_vec3(mesh->bounds_min, mesh->bounds_max), 0.5f);
+    mesh->bounds_radius = 0;
+    for (unsigned int i = first; i < last; i++) {
+        const CullCluster *cluster = &mesh->clusters[i];
+        vec3 center = {cluster->center[0], cluster->center[1], cluster->center[2]};
+        float radius = length_vec3(subtract_vec3(center, mesh->bounds_center)) + cluster->radius;
+        if (radius > mesh->bounds_radius) mesh->bounds_radius = radius;
+    }
+}
+
+// Cuts every level of detail into culling clusters, then bounds the
+// whole mesh. Meshes from a cache already have their clusters
+int mesh_build_culling(Mesh *mesh) {
+    unsigned int num_levels = mesh->num_lods ? mesh->num_lods : 1;
+    unsigned int max_clusters = 0;
+    for (unsigned int i = 0; i < num_levels; i++) {
+        unsigned int triangles = mesh_lod(mesh, i).num_indices / 3;
+        max_clusters += (triangles + CULL_CLUSTER_TRIANGLES - 1) / CULL_CLUSTER_TRIANGLES;
+    }
+    mesh->clusters = (CullCluster*)malloc((max_clusters ? max_clusters : 1) * sizeof(CullCluster));
+    if (!mesh->clusters) {
+        fprintf(stderr, "Failed to allocate culling clusters\n");
+        mesh->num_clusters = 0;
+        return -1;
+    }
+
+    mesh->num_clusters = 0;
+    for (unsigned int i = 0; i < num_levels; i++) {
+        MeshLod lod = mesh_lod(mesh, i);
+        mesh->lod_clusters[i] = mesh->num_clusters;
+        mesh->num_clusters += cull_build_clusters(mesh->vertices, mesh->vertex_stride, mesh->indices,
+                                                  mesh->index_size, lod.first_index, lod.num_indices,
+                                                  mesh->clusters + mesh->num_clusters);
+    }
+    mesh->lod_clusters[num_levels] = mesh->num_clusters;
+    mesh_bounds_from_clusters(mesh);
+    return 0;
+}
+
+// Tests a mesh's bounds against a frustum in its own space (from its
+// model-view-projection matrix). Without FRUSTUM_CULLING everything is
+// inside
+int mesh_test_frustum(const Mesh *mesh, const Frustum *frustum, CullStats *stats) {
+    if (!FRUSTUM_CULLING || !mesh->clusters) return FRUSTUM_INSIDE;
+    float bounds_min[3] = {mesh->bounds_min.x, mesh->bounds_min.y, mesh->bounds_min.z};
+    float bounds_max[3] = {mesh->bounds_max.x, mesh->bounds_max.y, mesh->bounds_max.z};
+    stats->meshes_tested++;
+    int result = frustum_test_box(frustum, bounds_min, bounds_max);
+    if (result != FRUSTUM_OUTSIDE) stats->meshes_drawn++;
+    return result;
+}
+
+// What to draw of one level of detail of a mesh, given how the whole mesh
+// tested (mesh_test_frustum()). Only a mesh partly in view gets its
+// clusters culled. Writes the ranges left into ranges (room for one more
+// than the mesh has clusters) and returns how many
+unsigned int mesh_cull_clusters(const Mesh *mesh, unsigned int level, const Frustum *frustum, int visibility,
+                                DrawRange *ranges, CullStats *stats) {
+    if (visibility == FRUSTUM_OUTSIDE) return 0;
+    MeshLod lod = mesh_lod(mesh, level);
+    if (visibility == FRUSTUM_INSIDE || !mesh->clusters) {
+        ranges[0] = (DrawRange){lod.first_index, lod.num_indices};
+        return 1;
+    }
+
+    unsigned int num_levels = mesh->num_lods ? mesh->num_lods : 1;
+    if (level >= num_levels) level = num_levels - 1;
+    unsigned int first = mesh->lod_clusters[level];
+    unsigned int count = mesh->lod_clusters[level + 1] - first;
+    return frustum_cull_clusters(frustum, mesh->clusters + first, count, ranges, stats);
+}
+
+// Coarsest level of detail whose error, projected onto the screen at the
+// point of the mesh's bounding sphere nearest to the camera, stays within
+// MESH_LOD_ERROR_PIXELS. pixels_per_unit is the projection's scale one
+// unit in front of the camera (render height / (2 tan(fov / 2)))
+unsigned int mesh_select_lod(const Mesh *mesh, mat4 model, vec3 camera_position, float pixels_per_unit) {
+    if (mesh->num_lods < 2) return 0;
+
+    vec3 center = mesh->bounds_center;
+    float radius = mesh->bounds_radius;
+    // Largest scale along any axis of the model matrix
+    float scale = 0;
+    for (int c = 0; c < 3; c++) {
+        float axis = length_vec3((vec3){model.m[c * 4], model.m[c * 4 + 1], model.m[c * 4 + 2]});
+        if (axis > scale) scale = axis;
+    }
+
+    vec3 world_center = mat4_transform_vec3(model, center);
+    float distance = length_vec3(subtract_vec3(world_center, camera_position)) - radius * scale;
+    if (distance <= 0) return 0;
+
+    unsigned int level = 0;
+    for (unsigned int i = 1; i < mesh->num_lods; i++) {
+        float error_pixels = mesh->lods[i].error * scale * pixels_per_unit / distance;
+        if (error_pixels > MESH_LOD_ERROR_PIXELS) break;
+        level = i;
+    }
+    return level;
+}
+
+// Uniforms that stay the same for everything drawn in a frame
+static void set_frame_uniforms_gl(GLint u_view, GLint u_light_dir, GLint u_light_color, GLint u_camera_pos,
+                                  mat4 view, vec3 camera_pos) {
+    if (u_view != -1) {
+        glUniformMatrix4fv(u_view, 1, GL_FALSE, view.m);
+    }
+
+    if (u_light_dir != -1) {
+        // Light direction (normalized)
+        vec3 light_dir = {1.0f, 1.0f, 1.0f};
+        light_dir = normalize_vec3(light_dir);
+        glUniform3f(u_light_dir, light_dir.x, light_dir.y, light_dir.z);
+    }
+
+    if (u_light_color != -1) {
+        // Light color
+        glUniform3f(u_light_color, 1.0f, 1.0f, 1.0f);
+    }
+
+    if (u_camera_pos != -1) {
+        // Camera position for specular calculations
+        glUniform3f(u_camera_pos, camera_pos.x, camera_pos.y, camera_pos.z);
+    }
+}
+
+static void draw_ranges_gl(Mesh *mesh, const DrawRange *ranges, unsigned int num_ranges) {
+    for (unsigned int i = 0; i < num_ranges; i++) {
+        glDrawElements(GL_TRIANGLES, ranges[i].num_indices, mesh_index_type(mesh),
+                       (void*)((size_t)ranges[i].first_index * mesh->index_size));
+    }
+}
+
+// Draw ranges of an uploaded mesh's index buffer (from mesh_cull_clusters(),
+// or one level of detail as a whole) with the program from setup_3d_rendering()
+void draw_mesh_gl(struct render_device *dev, Mesh *mesh, const DrawRange *ranges, unsigned int num_ranges,
+                  mat4 mvp, mat4 model, mat4 view, vec3 camera_pos) {
+    glUseProgram(dev->program);
+
+    // Set uniforms
+    if (dev->u_mvp != -1) {
+        glUniformMatrix4fv(dev->u_mvp, 1, GL_FALSE, mvp.m);
+    }
+
+    if (dev->u_model != -1) {
+        glUniformMatrix4fv(dev->u_model, 1, GL_FALSE, model.m);
+    }
+
+    if (dev->u_color != -1) {
+        glUniform4f(dev->u_color, 1.0f, 1.0f, 1.0f, 1.0f);
+    }
+
+    set_frame_uniforms_gl(dev->u_view, dev->u_light_dir, dev->u_light_color, dev->u_camera_pos, view, camera_pos);
+
+    glBindVertexArrayOES(mesh->vao);
+    draw_ranges_gl(mesh, ranges, num_ranges);
+    glBindVertexArrayOES(0);
+}
+
+#define SCENE_MAX_MODELS 8 // Meshes main() loads, the OBJ file and every --model
+
+// One frame of a scene (see scene.h): the meshes its instances point at,
+// the camera, and what drawing it came to
+typedef struct SceneFrame {
+    Mesh **meshes;
+    const mat4 *mesh_motion; // Per mesh, applied before the instance's own model matrix
+    mat4 view;
+    mat4 view_projection;
+    vec3 camera_position;
+    float pixels_per_unit; // For mesh_select_lod()
+    int instancing; // Draw batches as instances when the GL has a way to
+    DrawRange *ranges; // Room for one more range than any mesh has clusters
+
+    // Counters, never reset here
+    CullStats cull;
+    unsigned long long triangles_submitted;
+    unsigned long long triangles_full_detail;
+    unsigned long long draw_calls;
+    unsigned long long batches;
+    unsigned long draws_per_lod[MESH_MAX_LODS];
+} SceneFrame;
+
+static inline mat4 scene_instance_model(const SceneFrame *frame, const SceneInstance *instance) {
+    return mat4_multiply(instance->model, frame->mesh_motion[instance->mesh]);
+}
+
+// Pushes a draw for every instance whose mesh is at least partly in view,
+// at the level of detail its size on screen calls for, and sorts them
+// into batches
+void scene_cull(Scene *scene, SceneFrame *frame) {
+    TRACE_ZONE("scene_cull");
+    scene_begin_draws(scene);
+    for (unsigned int i = 0; i < scene->num_instances; i++) {
+        const SceneInstance *instance = &scene->instances[i];
+        const Mesh *mesh = frame->meshes[instance->mesh];
+        mat4 model = scene_instance_model(frame, instance);
+        frame->triangles_full_detail += mesh_lod(mesh, 0).num_indices / 3;
+
+        Frustum frustum = frustum_from_matrix(mat4_multiply(frame->view_projection, model));
+        int visibility = mesh_test_frustum(mesh, &frustum, &frame->cull);
+        if (visibility == FRUSTUM_OUTSIDE) continue;
+
+        unsigned int level = mesh_select_lod(mesh, model, frame->camera_position, frame->pixels_per_unit);
+        frame->draws_per_lod[level]++;
+        vec3 center = mat4_transform_vec3(model, mesh->bounds_center);
+        scene_push_draw(scene, i, level, visibility, length_vec3(subtract_vec3(center, frame->camera_position)));
+    }
+    scene_sort_draws(scene);
+}
+
+// Draws the sorted draws of scene_cull(). A batch of more than one
+// instance goes out as a single instanced draw call, its model matrices
+// and colors read from instance_vbo, which gets all of them in one upload
+// per frame. Instances drawn that way are only culled as a whole. The
+// rest are drawn one by one, cluster culled, with only the per instance
+// uniforms set between them
+void draw_scene_gl(struct render_device *dev, Scene *scene, SceneFrame *frame) {
+    TRACE_ZONE("draw_scene_gl");
+    int instancing = frame->instancing && dev->instancing;
+    if (instancing && scene->num_draws > dev->instance_capacity) {
+        float *data = (float*)realloc(dev->instance_data, (size_t)scene->num_draws * 20 * sizeof(float));
+        if (data) {
+            dev->instance_data = data;
+            dev->instance_capacity = scene->num_draws;
+        } else {
+            instancing = 0;
+        }
+    }
+    if (instancing && scene->num_draws > 0) {
+        for (unsigned int i = 0; i < scene->num_draws; i++) {
+            const SceneInstance *instance = &scene->instances[scene->draws[i].instance];
+            mat4 model = scene_instance_model(frame, instance);
+            float *out = &dev->instance_data[(size_t)i * 20];
+            memcpy(out, model.m, 16 * sizeof(float));
+            memcpy(out + 16, &instance->color, 4 * sizeof(float));
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, dev->instance_vbo);
+        glBufferData(GL_ARRAY_BUFFER, (size_t)scene->num_draws * 20 * sizeof(float), dev->instance_data, GL_STREAM_DRAW);
+    }
+
+    GLuint current_program = 0;
+    for (unsigned int first = 0, end; first < scene->num_draws; first = end) {
+        end = scene_batch_end(scene, first);
+        const SceneDraw *draw = &scene->draws[first];
+        Mesh *mesh = frame->meshes[scene->instances[draw->instance].mesh];
+        frame->batches++;
+        glBindVertexArrayOES(mesh->vao);
+
+        if (instancing && end - first > 1) {
+            if (current_program != dev->instanced_program) {
+                glUseProgram(dev->instanced_program);
+                current_program = dev->instanced_program;
+                if (dev->u_instanced_view_projection != -1) {
+                    glUniformMatrix4fv(dev->u_instanced_view_projection, 1, GL_FALSE, frame->view_projection.m);
+                }
+                set_frame_uniforms_gl(dev->u_instanced_view, dev->u_instanced_light_dir, dev->u_instanced_light_color,
+                                      dev->u_instanced_camera_pos, frame->view, frame->camera_position);
+            }
+            // The batch's slice of instance_vbo, a vec4 per matrix column
+            // and one for the color
+            glBindBuffer(GL_ARRAY_BUFFER, dev->instance_vbo);
+            for (int c = 0; c < 5; c++) {
+                glVertexAttribPointer(3 + c, 4, GL_FLOAT, GL_FALSE, 20 * sizeof(float),
+                                      (void*)(((size_t)first * 20 + c * 4) * sizeof(float)));
+                glEnableVertexAttribArray(3 + c);
+                glVertexAttribDivisorEXT(3 + c, 1);
+            }
+            MeshLod lod = mesh_lod(mesh, draw->level);
+            glDrawElementsInstancedEXT(GL_TRIANGLES, lod.num_indices, mesh_index_type(mesh),
+                                       (void*)((size_t)lod.first_index * mesh->index_size), end - first);
+            // These live in the mesh's VAO, which the per-draw path below
+            // uses too, and it doesn't feed them
+            for (int c = 0; c < 5; c++) {
+                glVertexAttribDivisorEXT(3 + c, 0);
+                glDisableVertexAttribArray(3 + c);
+            }
+            frame->draw_calls++;
+            frame->triangles_submitted += (unsigned long long)(lod.num_indices / 3) * (end - first);
+            continue;
+        }
+
+        if (current_program != dev->program) {
+            glUseProgram(dev->program);
+            current_program = dev->program;
+            set_frame_uniforms_gl(dev->u_view, dev->u_light_dir, dev->u_light_color, dev->u_camera_pos,
+                                  frame->view, frame->camera_position);
+        }
+        for (unsigned int i = first; i < end; i++) {
+            draw = &scene->draws[i];
+            const SceneInstance *instance = &scene->instances[draw->instance];
+            mat4 model = scene_instance_model(frame, instance);
+            mat4 mvp = mat4_multiply(frame->view_projection, model);
+            Frustum frustum;
+            if (draw->visibility == FRUSTUM_INTERSECTS) frustum = frustum_from_matrix(mvp);
+            unsigned int num_ranges = mesh_cull_clusters(mesh, draw->level, &frustum, draw->visibility,
+                                                         frame->ranges, &frame->cull);
+            if (num_ranges == 0) continue;
+
+            if (dev->u_mvp != -1) glUniformMatrix4fv(dev->u_mvp, 1, GL_FALSE, mvp.m);
+            if (dev->u_model != -1) glUniformMatrix4fv(dev->u_model, 1, GL_FALSE, model.m);
+            if (dev->u_color != -1) {
+                glUniform4f(dev->u_color, instance->color.x, instance->color.y, instance->color.z, instance->color.w);
+            }
+            draw_ranges_gl(mesh, frame->ranges, num_ranges);
+            frame->draw_calls += num_ranges;
+            for (unsigned int r = 0; r < num_ranges; r++) {
+                frame->triangles_submitted += frame->ranges[r].num_indices / 3;
+            }
+        }
+    }
+    glBindVertexArrayOES(0);
+}
+
+// Queues the sorted draws of scene_cull() on the software rasterizer,
+// each cluster culled and tinted by its instance's color
+void draw_scene_cpu(Rasterizer *rasterizer, Scene *scene, SceneFrame *frame) {
+    TRACE_ZONE("draw_scene_cpu");
+    vec3 base_color = rasterizer->base_color;
+    for (unsigned int first = 0, end; first < scene->num_draws; first = end) {
+        end = scene_batch_end(scene, first);
+        frame->batches++;
+        for (unsigned int i = first; i < end; i++) {
+            const SceneDraw *draw = &scene->draws[i];
+            const SceneInstance *instance = &scene->instances[draw->instance];
+            Mesh *mesh = frame->meshes[instance->mesh];
+            mat4 model = scene_instance_model(frame, instance);
+            mat4 mvp = mat4_multiply(frame->view_projection, model);
+            Frustum frustum;
+            if (draw->visibility == FRUSTUM_INTERSECTS) frustum = frustum_from_matrix(mvp);
+            unsigned int num_ranges = mesh_cull_clusters(mesh, draw->level, &frustum, draw->visibility,
+                                                         frame->ranges, &frame->cull);
+            if (num_ranges == 0) continue;
+
+            rasterizer->base_color = (vec3){base_color.x * instance->color.x, base_color.y * instance->color.y,
+                                            base_color.z * instance->color.z};
+            raster_draw_ranges(rasterizer, mesh->vertices, mesh->vertices + MESH_NORMAL_OFFSET, mesh->vertex_stride,
+                               mesh->indices, mesh->index_size, frame->ranges, num_ranges, mvp, model);
+            frame->draw_calls++;
+            for (unsigned int r = 0; r < num_ranges; r++) {
+                frame->triangles_submitted += frame->ranges[r].num_indices / 3;
+            }
+        }
+    }
+    rasterizer->base_color = base_color;
+}
+
+// Instances for main(): one of the first mesh where it wants to be, or,
+// with more of them or more meshes, a grid of all the meshes in turn
+// across the XY plane, each shrunk to fit its cell
+int scene_layout_grid(Scene *scene, Mesh **meshes, int num_meshes, int count) {
+    static const vec4 palette[] = {
+        {1.0f, 1.0f, 1.0f, 1.0f}, {1.0f, 0.4f, 0.3f, 1.0f}, {0.4f, 1.0f, 0.4f, 1.0f},
+        {0.4f, 0.6f, 1.0f, 1.0f}, {1.0f, 0.5f, 1.0f, 1.0f}, {0.4f, 1.0f, 1.0f, 1.0f},
+    };
+    const int num_colors = sizeof(palette) / sizeof(palette[0]);
+    if (count < num_meshes) count = num_meshes;
+    if (count == 1) {
+        mat4 model = mat4_translate(mat4_identity(), meshes[0]->position);
+        return scene_add_instance(scene, 0, 0, model, palette[0]) < 0 ? -1 : 0;
+    }
+
+    int columns = (int)ceilf(sqrtf((float)count));
+    int rows = (count + columns - 1) / columns;
+    float cell = 2.0f / columns;
+    for (int i = 0; i < count; i++) {
+        const Mesh *mesh = meshes[i % num_meshes];
+        float scale = fmaxf(mesh->scale.x, fmaxf(mesh->scale.y, mesh->scale.z));
+        float radius = mesh->bounds_radius * scale;
+        float fit = radius > 0 ? cell * 0.45f / radius : 1.0f;
+        vec3 position = {
+            (i % columns - (columns - 1) * 0.5f) * cell,
+            ((rows - 1) * 0.5f - i / columns) * cell,
+            0.0f
+        };
+        mat4 model = mat4_scale(mat4_translate(mat4_identity(), position), (vec3){fit, fit, fit});
+        if (scene_add_instance(scene, i % num_meshes, 0, model, palette[i % num_colors]) < 0) return -1;
+    }
+    return 0;
+}
+
+// Allocate an empty mesh with the default transform
+Mesh* create_mesh() {
+    Mesh* mesh = (Mesh*)calloc(1, sizeof(Mesh));
+    if (!mesh) {
+        fprintf(stderr, "Failed to allocate mesh memory\n");
+        return NULL;
+    }
+    
+    // Set default position, rotation, scale
+    mesh->position = (vec3){0.0f, 0.0f, 0.0f};
+    mesh->rotation = (vec3){0.0f, 0.0f, 0.0f};
+    mesh->scale = (vec3){3.0f, 3.0f, 3.0f};
+    
+    return mesh;
+}
+
+// Upload the CPU side mesh data into GL buffers
+// Only the GL backend needs this, and it needs a current context
+int upload_mesh(Mesh* mesh) {
+    // Check if OES extension functions are initialized
+    if (!glGenVertexArraysOES || !glBindVertexArrayOES || !glDeleteVertexArraysOES) {
+        fprintf(stderr, "Error: VAO extension functions not initialized!\n");
+        return -1;
+    }
+    
+    // 32 bit indices are an extension in GLES2
+    const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+    if (mesh->index_size == 4 && (!extensions || !strstr(extensions, "GL_OES_element_index_uint"))) {
+        fprintf(stderr, "Error: Mesh needs 32 bit indices but GL_OES_element_index_uint isn't supported\n");
+        return -1;
+    }
+
+    // Create VAO
+    glGenVertexArraysOES(1, &mesh->vao);
+    glBindVertexArrayOES(mesh->vao);
+    
+    // One VBO with all the attributes interleaved
+    GLsizei stride = mesh->vertex_stride * sizeof(float);
+    glGenBuffers(1, &mesh->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)mesh->num_vertices * stride,
+                mesh->vertices, GL_STATIC_DRAW);
+    
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(MESH_NORMAL_OFFSET * sizeof(float)));
+    glEnableVertexAttribArray(1);
+    if (mesh->vertex_stride == MESH_STRIDE_TEXCOORDS) {
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)(MESH_TEXCOORD_OFFSET * sizeof(float)));
+        glEnableVertexAttribArray(2);
+    }
+    
+    // Create element buffer for indices
+    glGenBuffers(1, &mesh->ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (GLsizeiptr)mesh->num_indices * mesh->index_size,
+                mesh->indices, GL_STATIC_DRAW);
+    
+    // Unbind VAO
+    glBindVertexArrayOES(0);
+
+    gl_resources.live_vertex_arrays++;
+    gl_resources.live_buffers += 2;
+    
+    return 0;
+}
+
+// Normal for a vertex the OBJ didn't give one, pointing away from the origin
+static void mesh_outward_normal(const float *position, float *normal) {
+    float len = sqrtf(position[0]*position[0] + position[1]*position[1] + position[2]*position[2]);
+    if (len > 0.0001f) {
+        normal[0] = position[0] / len;
+        normal[1] = position[1] / len;
+        normal[2] = position[2] / len;
+    } else {
+        normal[0] = 0.0f;
+        normal[1] = 1.0f;
+        normal[2] = 0.0f;
+    }
+}
+
+// Builds a mesh from OBJ style triangle corners, (v, vt, vn) index
+// triples with -1 (or anything out of range) for a missing vt or vn.
+// Every distinct triple becomes one vertex of the interleaved stream, in
+// the order they're first used. Finding a triple is a hash lookup keyed
+// on v: every position has a short chain of the (vt, vn) variants seen
+// with it so far, usually just the one. Indices are 16 bit when there
+// are few enough vertices. Returns NULL if a v is out of range
+Mesh* build_obj_mesh(const float *positions, unsigned int num_positions,
+                     const float *texcoords, unsigned int num_texcoords,
+                     const float *normals, unsigned int num_normals,
+                     const int *corners, size_t num_corners) {
+    const unsigned int none = 0xffffffffu;
+    if (num_corners > 0xffffffffu) {
+        fprintf(stderr, "Error: Too many triangles\n");
+        return NULL;
+    }
+
+    typedef struct {
+        int v, vt, vn;
+        unsigned int next; // Next variant of the same position
+    } Variant;
+
+    Mesh *mesh = create_mesh();
+    unsigned int *first = (unsigned int*)malloc((size_t)num_positions * sizeof(unsigned int) + 1);
+    unsigned int *indices = (unsigned int*)malloc(num_corners * sizeof(unsigned int) + 1);
+    size_t capacity = num_positions + 64;
+    Variant *variants = (Variant*)malloc(capacity * sizeof(Variant));
+    if (!mesh || !first || !indices || !variants) {
+        fprintf(stderr, "Failed to allocate mesh buffers\n");
+        free(mesh);
+        free(first);
+        free(indices);
+        free(variants);
+        return NULL;
+    }
+    memset(first, 0xff, (size_t)num_positions * sizeof(unsigned int));
+
+    unsigned int num_vertices = 0;
+    int any_texcoords = 0;
+    int bad_corner = 0;
+    for (size_t i = 0; i < num_corners && !bad_corner; i++) {
+        int v = corners[i * 3];
+        int vt = corners[i * 3 + 1];
+        int vn = corners[i * 3 + 2];
+        if (v < 0 || (unsigned int)v >= num_positions) {
+            bad_corner = 1;
+            break;
+        }
+        if (vt < 0 || (unsigned int)vt >= num_texcoords) vt = -1;
+        if (vn < 0 || (unsigned int)vn >= num_normals) vn = -1;
+        any_texcoords |= vt >= 0;
+
+        unsigned int u = first[v];
+        while (u != none && (variants[u].vt != vt || variants[u].vn != vn)) u = variants[u].next;
+        if (u == none) {
+            if (num_vertices == capacity) {
+                capacity *= 2;
+                Variant *grown = (Variant*)realloc(variants, capacity * sizeof(Variant));
+                if (!grown) {
+                    bad_corner = -1;
+                    break;
+                }
+                variants = grown;
+            }
+            u = num_vertices++;
+            variants[u] = (Variant){v, vt, vn, first[v]};
+            first[v] = u;
+        }
+        indices[i] = u;
+    }
+    free(first);
+
+    unsigned int stride = any_texcoords ? MESH_STRIDE_TEXCOORDS : MESH_STRIDE;
+    float *vertices = bad_corner ? NULL : (float*)malloc((size_t)num_vertices * stride * sizeof(float) + 1);
+    if (!vertices) {
+        if (bad_corner > 0) {
+            fprintf(stderr, "Error: Face refers to a vertex that doesn't exist\n");
+        } else {
+            fprintf(stderr, "Failed to allocate mesh buffers\n");
+        }
+        free(mesh);
+        free(indices);
+        free(variants);
+        return NULL;
+    }
+
+    for (unsigned int u = 0; u < num_vertices; u++) {
+        float *out = &vertices[(size_t)u * stride];
+        const Variant *variant = &variants[u];
+        memcpy(out, &positions[(size_t)variant->v * 3], 3 * sizeof(float));
+        if (variant->vn >= 0) {
+            memcpy(out + MESH_NORMAL_OFFSET, &normals[(size_t)variant->vn * 3], 3 * sizeof(float));
+        } else {
+            mesh_outward_normal(out, out + MESH_NORMAL_OFFSET);
+        }
+        if (any_texcoords) {
+            out[MESH_TEXCOORD_OFFSET] = variant->vt >= 0 ? texcoords[(size_t)variant->vt * 2] : 0.0f;
+            out[MESH_TEXCOORD_OFFSET + 1] = variant->vt >= 0 ? texcoords[(size_t)variant->vt * 2 + 1] : 0.0f;
+        }
+    }
+    free(variants);
+
+#if MESH_OPTIMIZE
+    MeshOptimizeStats stats;
+    if (mesh_optimize(vertices, stride, num_vertices, indices, num_corners, &stats) == 0) {
+        mesh->acmr_before = stats.acmr_before;
+        mesh->acmr_after = stats.acmr_after;
+        printf("  Vertex cache: ACMR %.3f -> %.3f, %u clusters sorted for overdraw\n",
+               stats.acmr_before, stats.acmr_after, stats.num_clusters);
+    } else {
+        fprintf(stderr, "Not enough memory to optimize the mesh, keeping it as is\n");
+    }
+#endif
+
+    // Coarser levels go after the full mesh in the same index buffer
+    mesh->lods[0] = (MeshLod){0, (uint32_t)num_corners, 0.0f, 0};
+    mesh->num_lods = mesh_build_lods(vertices, stride, num_vertices, &indices, mesh->lods,
+                                     MESH_LODS < MESH_MAX_LODS ? MESH_LODS : MESH_MAX_LODS,
+                                     MESH_LOD_REDUCTION, MESH_LOD_MIN_TRIANGLES);
+    size_t num_indices = (size_t)mesh->lods[mesh->num_lods - 1].first_index + mesh->lods[mesh->num_lods - 1].num_indices;
+    if (mesh->num_lods > 1) {
+        printf("  Levels of detail:");
+        for (unsigned int i = 0; i < mesh->num_lods; i++) {
+            printf(" %u (error %.3g)", mesh->lods[i].num_indices / 3, mesh->lods[i].error);
+        }
+        printf(" triangles\n");
+    }
+
+    // Narrow the indices in place when they fit in 16 bits
+    unsigned int index_size = sizeof(unsigned int);
+    if (num_vertices <= 0x10000) {
+        uint16_t *narrow = (uint16_t*)indices;
+        for (size_t i = 0; i < num_indices; i++) narrow[i] = (uint16_t)indices[i];
+        index_size = sizeof(uint16_t);
+    }
+
+    mesh->vertices = vertices;
+    mesh->vertex_stride = stride;
+    mesh->num_vertices = num_vertices;
+    mesh->indices = indices;
+    mesh->index_size = index_size;
+    mesh->num_indices = num_indices;
+
+    printf("  %u unique vertices from %zu corners (%.2fx dedupe), %u bit indices\n",
+           num_vertices, num_corners, num_vertices ? (double)num_corners / num_vertices : 0.0,
+           index_size * 8);
+    return mesh;
+}
+
+// tinyobj asks for the file contents through a callback, and leaves the
+// buffer to us. The OBJ gets mapped, materials aren't used
+typedef struct {
+    void *data;
+    size_t size;
+} ObjFileBuffer;
+
+static void obj_file_reader(void *ctx, const char *filename, int is_mtl, const char *obj_filename,
+                            char **buf, size_t *len) {
+    ObjFileBuffer *file = (ObjFileBuffer*)ctx;
+    (void)obj_filename;
+    *buf = NULL;
+    *len = 0;
+    if (is_mtl || file->data) return;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            file->data = data;
+            file->size = st.st_size;
+            *buf = (char*)data;
+            *len = st.st_size;
+        }
+    }
+    close(fd);
+}
+
+// Load an .obj model
+Mesh* load_obj_model(const char* filename) {
+    // Check if file exists first
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open file '%s': %s\n", 
+                filename, strerror(errno));
+        return NULL;
+    }
+    fclose(file);
+    
+    printf("Loading OBJ file: %s\n", filename);
+    
+    // Initialize tinyobj structures
+    tinyobj_attrib_t attrib;
+    tinyobj_shape_t* shapes = NULL;
+    size_t num_shapes = 0;
+    tinyobj_material_t* materials = NULL;
+    size_t num_materials = 0;
+    
+    memset(&attrib, 0, sizeof(attrib));
+    
+    // Set up file content buffer for safe parsing
+    unsigned int flags = TINYOBJ_FLAG_TRIANGULATE;
+    
+    // Set up error reporting
+    fprintf(stdout, "Starting OBJ parsing...\n");
+    
+    ObjFileBuffer obj_file = {NULL, 0};
+    int ret = tinyobj_parse_obj(&attrib, &shapes, &num_shapes, &materials,
+                         &num_materials, filename, obj_file_reader, &obj_file, flags);
+    if (obj_file.data) munmap(obj_file.data, obj_file.size);
+                         
+    fprintf(stdout, "Parsing completed with result: %d\n", ret);
+    
+    if (ret != TINYOBJ_SUCCESS) {
+        fprintf(stderr, "Failed to load OBJ file: %s (error code %d)\n", filename, ret);
+        return NULL;
+    }
+    
+    // Verify that we have some data
+    if (attrib.num_vertices == 0 || attrib.num_faces == 0) {
+        fprintf(stderr, "Invalid OBJ file: No vertices or faces found\n");
+        tinyobj_attrib_free(&attrib);
+        tinyobj_shapes_free(shapes, num_shapes);
+        tinyobj_materials_free(materials, num_materials);
+        return NULL;
+    }
+    
+    printf("  Vertices: %d\n", (int)attrib.num_vertices);
+    printf("  Normals: %d\n", (int)attrib.num_normals);
+    printf("  Texcoords: %d\n", (int)attrib.num_texcoords);
+    printf("  Faces: %d\n", (int)attrib.num_faces);
+    printf("  Shapes: %d\n", (int)num_shapes);
+    
+    // The faces are triangulated, so every face entry is one corner
+    int *corners = (int*)malloc((size_t)attrib.num_faces * 3 * sizeof(int));
+    Mesh *mesh = NULL;
+    if (corners) {
+        for (size_t i = 0; i < attrib.num_faces; i++) {
+            corners[i * 3] = attrib.faces[i].v_idx;
+            corners[i * 3 + 1] = attrib.faces[i].vt_idx;
+            corners[i * 3 + 2] = attrib.faces[i].vn_idx;
+        }
+        mesh = build_obj_mesh(attrib.vertices, attrib.num_vertices,
+                              attrib.texcoords, attrib.num_texcoords,
+                              attrib.normals, attrib.num_normals,
+                              corners, attrib.num_faces);
+        free(corners);
+    } else {
+        fprintf(stderr, "Failed to allocate mesh buffers\n");
+    }
+    
+    // Clean up tinyobj data
+    tinyobj_attrib_free(&attrib);
+    tinyobj_shapes_free(shapes, num_shapes);
+    tinyobj_materials_free(materials, num_materials);
+    
+    return mesh;
+}
+
+// testing
+// Add this function to create a simple cube
 Mesh* create_debug_cube() {
-    float vertices[] = {
+    // Position, normal
+    static const float vertices[] = {
         // Front face
-        -0.5f, -0.5f,  0.5f,
-         0.5f, -0.5f,  0.5f,
-         0.5f,  0.5f,  0.5f,
-        -0.5f,  0.5f,  0.5f,
+        -0.5f, -0.5f,  0.5f,   0.0f, 0.0f,  1.0f,
+         0.5f, -0.5f,  0.5f,   0.0f, 0.0f,  1.0f,
+         0.5f,  0.5f,  0.5f,   0.0f, 0.0f,  1.0f,
+        -0.5f,  0.5f,  0.5f,   0.0f, 0.0f,  1.0f,
         // Back face
-        -0.5f, -0.5f, -0.5f,
-         0.5f, -0.5f, -0.5f,
-         0.5f,  0.5f, -0.5f,
-        -0.5f,  0.5f, -0.5f
+        -0.5f, -0.5f, -0.5f,   0.0f, 0.0f, -1.0f,
+         0.5f, -0.5f, -0.5f,   0.0f, 0.0f, -1.0f,
+         0.5f,  0.5f, -0.5f,   0.0f, 0.0f, -1.0f,
+        -0.5f,  0.5f, -0.5f,   0.0f, 0.0f, -1.0f
     };
     
-    float normals[] = {
-        // Front face normals
-        0.0f, 0.0f, 1.0f,
-        0.0f, 0.0f, 1.0f,
-        0.0f, 0.0f, 1.0f,
-        0.0f, 0.0f, 1.0f,
-        // Back face normals
-        0.0f, 0.0f, -1.0f,
-        0.0f, 0.0f, -1.0f,
-        0.0f, 0.0f, -1.0f,
-        0.0f, 0.0f, -1.0f
-    };
-    
-    unsigned int indices[] = {
+    static const uint16_t indices[] = {
         // Front face
         0, 1, 2,
         2, 3, 0,
@@ -703,41 +1805,52 @@ Mesh* create_debug_cube() {
         1, 0, 4
     };
     
-    Mesh* mesh = (Mesh*)malloc(sizeof(Mesh));
+    Mesh* mesh = create_mesh();
     if (!mesh) return NULL;
     
-    mesh->position = (vec3){0.0f, 0.0f, 0.0f};
-    mesh->rotation = (vec3){0.0f, 0.0f, 0.0f};
-    mesh->scale = (vec3){3.0f, 3.0f, 3.0f};
-    
-    glGenVertexArraysOES(1, &mesh->vao);
-    glBindVertexArrayOES(mesh->vao);
-    
-    glGenBuffers(1, &mesh->vbo_positions);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo_positions);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-    
-    glGenBuffers(1, &mesh->vbo_normals);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo_normals);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(normals), normals, GL_STATIC_DRAW);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(1);
-    
-    mesh->vbo_texcoords = 0;
-    
-    glGenBuffers(1, &mesh->ebo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
-    
-    mesh->num_indices = sizeof(indices) / sizeof(unsigned int);
-    
-    glBindVertexArrayOES(0);
+    mesh->vertex_stride = MESH_STRIDE;
+    mesh->num_vertices = sizeof(vertices) / (MESH_STRIDE * sizeof(float));
+    mesh->index_size = sizeof(uint16_t);
+    mesh->num_indices = sizeof(indices) / sizeof(uint16_t);
+    mesh->vertices = (float*)malloc(sizeof(vertices));
+    mesh->indices = malloc(sizeof(indices));
+    if (!mesh->vertices || !mesh->indices) {
+        free_mesh(mesh);
+        return NULL;
+    }
+    memcpy(mesh->vertices, vertices, sizeof(vertices));
+    memcpy(mesh->indices, indices, sizeof(indices));
+    if (mesh_build_culling(mesh) < 0) {
+        free_mesh(mesh);
+        return NULL;
+    }
     
     return mesh;
 }
+// Load an .obj model with the parallel parser (see obj_parser.h)
 Mesh* load_simple_obj(const char* filename) {
+    printf("Loading simple OBJ file: %s\n", filename);
+
+    ObjData data;
+    if (obj_parse_file(filename, OBJ_PARSER_THREADS, &data) < 0) {
+        return NULL;
+    }
+    printf("  Vertices: %u\n", data.num_positions);
+    printf("  Normals: %u\n", data.num_normals);
+    printf("  Texcoords: %u\n", data.num_texcoords);
+    printf("  Faces: %zu\n", data.num_triangles);
+
+    Mesh* mesh = build_obj_mesh(data.positions, data.num_positions,
+                                data.texcoords, data.num_texcoords,
+                                data.normals, data.num_normals,
+                                data.corners, data.num_triangles * 3);
+    obj_data_free(&data);
+    return mesh;
+}
+
+// The old two pass fgets/sscanf loader, only kept as the baseline for
+// --load-bench
+Mesh* load_obj_sscanf(const char* filename) {
     FILE* file = fopen(filename, "r");
     if (!file) {
         fprintf(stderr, "Error: Cannot open file '%s': %s\n", 
@@ -745,8 +1858,6 @@ Mesh* load_simple_obj(const char* filename) {
         return NULL;
     }
     
-    printf("Loading simple OBJ file: %s\n", filename);
-    
     // Count vertices and faces
     char line[1024];
     int vertex_count = 0;
@@ -763,9 +1874,8 @@ Mesh* load_simple_obj(const char* filename) {
     rewind(file);
     
     // Allocate arrays
-    float* vertices = (float*)malloc(vertex_count * 3 * sizeof(float));
+    float* vertices = (float*)malloc(vertex_count * MESH_STRIDE * sizeof(float));
     unsigned int* indices = (unsigned int*)malloc(face_count * 3 * sizeof(unsigned int));
-    float* normals = (float*)malloc(vertex_count * 3 * sizeof(float));
     
     // Read vertices and faces
     int v_idx = 0;
@@ -773,21 +1883,9 @@ Mesh* load_simple_obj(const char* filename) {
     
     while (fgets(line, sizeof(line), file)) {
         if (line[0] == 'v' && line[1] == ' ') {
-            sscanf(line, "v %f %f %f", &vertices[v_idx*3], &vertices[v_idx*3+1], &vertices[v_idx*3+2]);
-            
-            // Generate simple normal (point outward)
-            float len = sqrtf(vertices[v_idx*3]*vertices[v_idx*3] + 
-                             vertices[v_idx*3+1]*vertices[v_idx*3+1] + 
-                             vertices[v_idx*3+2]*vertices[v_idx*3+2]);
-            if (len > 0.0001f) {
-                normals[v_idx*3] = vertices[v_idx*3] / len;
-                normals[v_idx*3+1] = vertices[v_idx*3+1] / len;
-                normals[v_idx*3+2] = vertices[v_idx*3+2] / len;
-            } else {
-                normals[v_idx*3] = 0.0f;
-                normals[v_idx*3+1] = 1.0f;
-                normals[v_idx*3+2] = 0.0f;
-            }
+            float *vertex = &vertices[v_idx * MESH_STRIDE];
+            sscanf(line, "v %f %f %f", &vertex[0], &vertex[1], &vertex[2]);
+            mesh_outward_normal(vertex, vertex + MESH_NORMAL_OFFSET);
             
             v_idx++;
         } 
@@ -801,251 +1899,1309 @@ Mesh* load_simple_obj(const char* filename) {
             f_idx++;
         }
     }
-    
-    fclose(file);
-    
-    // Create mesh
-    Mesh* mesh = (Mesh*)malloc(sizeof(Mesh));
-    if (!mesh) {
-        free(vertices);
-        free(indices);
-        free(normals);
-        return NULL;
+    
+    fclose(file);
+    
+    // Create mesh
+    Mesh* mesh = create_mesh();
+    if (!mesh) {
+        free(vertices);
+        free(indices);
+        return NULL;
+    }
+    
+    // The mesh takes ownership of the arrays
+    mesh->vertices = vertices;
+    mesh->vertex_stride = MESH_STRIDE;
+    mesh->num_vertices = vertex_count;
+    mesh->indices = indices;
+    mesh->index_size = sizeof(unsigned int);
+    mesh->num_indices = face_count * 3;
+    
+    printf("  Vertices: %d\n", vertex_count);
+    printf("  Faces: %d\n", face_count);
+    
+    return mesh;
+}
+
+
+// Free mesh resources
+void free_mesh(Mesh* mesh) {
+    if (!mesh) return;
+    
+    // GL objects only exist if the mesh was uploaded
+    if (mesh->vao) {
+        glDeleteVertexArraysOES(1, &mesh->vao);
+        glDeleteBuffers(1, &mesh->vbo);
+        glDeleteBuffers(1, &mesh->ebo);
+        gl_resources.live_vertex_arrays--;
+        gl_resources.live_buffers -= 2;
+    }
+    
+    if (mesh->cache.map) {
+        mesh_cache_unmap(&mesh->cache);
+    } else {
+        free(mesh->vertices);
+        free(mesh->indices);
+        free(mesh->clusters);
+    }
+    free(mesh);
+}
+
+// What config.h says about building meshes, which a cache has to match
+static MeshCacheSettings mesh_cache_settings() {
+    MeshCacheSettings settings = {0};
+    settings.max_lods = MESH_LODS < MESH_MAX_LODS ? MESH_LODS : MESH_MAX_LODS;
+    settings.optimized = MESH_OPTIMIZE;
+    settings.cluster_triangles = CULL_CLUSTER_TRIANGLES;
+    return settings;
+}
+
+// Mesh straight out of a mapped cache, NULL if there's no usable one
+Mesh* load_mesh_cache(const char *cache_path, const MeshCacheSource *source) {
+    Mesh *mesh = create_mesh();
+    if (!mesh) return NULL;
+    MeshCacheSettings settings = mesh_cache_settings();
+    if (mesh_cache_map(cache_path, source, &settings, &mesh->cache) < 0) {
+        free(mesh);
+        return NULL;
+    }
+    // Normals are read at MESH_NORMAL_OFFSET, so only the two layouts
+    // build_obj_mesh() writes will do
+    if (mesh->cache.vertex_stride != MESH_STRIDE && mesh->cache.vertex_stride != MESH_STRIDE_TEXCOORDS) {
+        fprintf(stderr, "Ignoring mesh cache %s: bad vertex stride %u\n", cache_path, mesh->cache.vertex_stride);
+        mesh_cache_unmap(&mesh->cache);
+        free(mesh);
+        return NULL;
+    }
+
+    // Read only pages, nothing writes to a loaded mesh
+    mesh->vertices = (float*)mesh->cache.vertices;
+    mesh->vertex_stride = mesh->cache.vertex_stride;
+    mesh->num_vertices = mesh->cache.num_vertices;
+    mesh->indices = (void*)mesh->cache.indices;
+    mesh->index_size = mesh->cache.index_size;
+    mesh->num_indices = mesh->cache.num_indices;
+    mesh->acmr_before = mesh->cache.acmr_before;
+    mesh->acmr_after = mesh->cache.acmr_after;
+    mesh->num_lods = mesh->cache.num_lods;
+    memcpy(mesh->lods, mesh->cache.lods, sizeof(mesh->lods));
+    mesh->clusters = (CullCluster*)mesh->cache.clusters;
+    mesh->num_clusters = mesh->cache.num_clusters;
+    memcpy(mesh->lod_clusters, mesh->cache.lod_clusters, sizeof(mesh->lod_clusters));
+    mesh_bounds_from_clusters(mesh);
+    return mesh;
+}
+
+// Writes a freshly parsed mesh to its cache
+int save_mesh_cache(const char *cache_path, const MeshCacheSource *source, Mesh *mesh) {
+    MeshCacheData data = {0};
+    data.vertices = mesh->vertices;
+    data.vertex_stride = mesh->vertex_stride;
+    data.num_vertices = mesh->num_vertices;
+    data.indices = mesh->indices;
+    data.index_size = mesh->index_size;
+    data.num_indices = mesh->num_indices;
+    data.acmr_before = mesh->acmr_before;
+    data.acmr_after = mesh->acmr_after;
+    data.num_lods = mesh->num_lods;
+    memcpy(data.lods, mesh->lods, sizeof(data.lods));
+    data.clusters = mesh->clusters;
+    data.num_clusters = mesh->num_clusters;
+    memcpy(data.lod_clusters, mesh->lod_clusters, sizeof(data.lod_clusters));
+    MeshCacheSettings settings = mesh_cache_settings();
+    return mesh_cache_write(cache_path, source, &settings, &data);
+}
+
+// Parses an OBJ as text, with our own parser first since it's a lot
+// faster, and tinyobj for anything it can't handle. Everything the mesh
+// cache holds is built here
+Mesh* load_obj_text(const char *filename) {
+    Mesh *mesh = load_simple_obj(filename);
+    if (!mesh) {
+        fprintf(stderr, "Trying tinyobj instead\n");
+        mesh = load_obj_model(filename);
+    }
+    if (mesh && mesh_build_culling(mesh) < 0) {
+        free_mesh(mesh);
+        return NULL;
+    }
+    return mesh;
+}
+
+// Loads an OBJ through its cache (see mesh_cache.h), parsing the text
+// and writing the cache only if there isn't a valid one yet
+Mesh* load_mesh(const char *filename) {
+    MeshCacheSource source;
+    if (mesh_cache_source_info(filename, &source) < 0) {
+        fprintf(stderr, "Error: Cannot open file '%s': %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    char cache_path[4096];
+    int use_cache = mesh_cache_path(cache_path, sizeof(cache_path), filename) == 0;
+    if (use_cache) {
+        Mesh *mesh = load_mesh_cache(cache_path, &source);
+        if (mesh) {
+            printf("Loaded %s from %s: %u vertices, %u triangles, ACMR %.3f, %u levels of detail\n",
+                   filename, cache_path, mesh->num_vertices, mesh_lod(mesh, 0).num_indices / 3,
+                   mesh->acmr_after, mesh->num_lods ? mesh->num_lods : 1);
+            return mesh;
+        }
+    }
+
+    Mesh *mesh = load_obj_text(filename);
+    if (mesh && use_cache && save_mesh_cache(cache_path, &source, mesh) < 0) {
+        fprintf(stderr, "Couldn't write the mesh cache %s: %s\n", cache_path, strerror(errno));
+    }
+    return mesh;
+}
+
+// Resident set size in KB, from /proc/self/statm
+static long read_rss_kb() {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return -1;
+    long size, resident;
+    int n = fscanf(f, "%ld %ld", &size, &resident);
+    fclose(f);
+    if (n != 2) return -1;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Renders the debug cube offscreen for a lot of frames, and checks that
+// the number of GL objects and the memory we use stay where they started
+int gl_soak_benchmark(int num_frames) {
+    const int width = 320, height = 240;
+    const int num_samples = 10;
+
+    struct render_device dev = {0};
+    if (open_render_device(&dev, 1) < 0) {
+        return 1;
+    }
+    if (init_egl_surfaceless(&dev, width, height) < 0) {
+        if (dev.fd >= 0) close(dev.fd);
+        return 1;
+    }
+    if (setup_3d_rendering(&dev) < 0) {
+        cleanup_egl(&dev);
+        return 1;
+    }
+
+    Mesh *mesh = create_debug_cube();
+    unsigned char *pixels = (unsigned char*)malloc(width * height * 4);
+    GLuint fbo = 0, color_rb = 0, depth_rb = 0;
+    if (!mesh || !pixels || upload_mesh(mesh) < 0 ||
+        create_render_target(&dev, GL_RGBA4, &fbo, &color_rb, &depth_rb) < 0) {
+        fprintf(stderr, "Failed to set up the soak benchmark\n");
+        destroy_render_target(&fbo, &color_rb, &depth_rb);
+        free(pixels);
+        free_mesh(mesh);
+        release_programs();
+        cleanup_egl(&dev);
+        return 1;
+    }
+
+    mat4 projection = mat4_perspective(45.0f * (PI / 180.0f), (float)width / height, 0.1f, 100.0f);
+    vec3 camera_pos = {0, 0, 3.0f};
+    mat4 view = mat4_look_at(camera_pos, (vec3){0, 0, 0}, (vec3){0, 1, 0});
+
+    printf("GL soak benchmark: %d frames at %dx%d\n", num_frames, width, height);
+    printf("%10s %8s %8s %8s %8s %8s %8s %10s %10s\n", "frame", "programs", "shaders",
+           "buffers", "VAOs", "FBOs", "RBOs", "RSS KB", "ms/frame");
+
+    GLResources first = {0};
+    long first_rss = 0;
+    long last_rss = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int frame = 1; frame <= num_frames && !done; frame++) {
+        // Ask for the program like the old render loop did, it should
+        // come straight out of the cache
+        dev.program = get_program(vertex_shader_source, debug_fragment_shader_source);
+
+        mat4 model = mat4_multiply(mat4_rotate_y(frame * 0.01f), mat4_scale(mat4_identity(), mesh->scale));
+        mat4 mvp = mat4_multiply(mat4_multiply(projection, view), model);
+
+        glClearColor(0.2f, 0.2f, 0.4f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        draw_mesh_gl(&dev, mesh, &(DrawRange){0, mesh->num_indices}, 1, mvp, model, view, camera_pos);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+
+        if (frame % (num_frames / num_samples > 0 ? num_frames / num_samples : 1) == 0 || frame == 1) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double ms = ((end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+            last_rss = read_rss_kb();
+            if (frame == 1) {
+                first = gl_resources;
+                first_rss = last_rss;
+            }
+            printf("%10d %8d %8d %8d %8d %8d %8d %10ld %10.3f\n", frame,
+                   gl_resources.live_programs, gl_resources.live_shaders, gl_resources.live_buffers,
+                   gl_resources.live_vertex_arrays, gl_resources.live_framebuffers,
+                   gl_resources.live_renderbuffers, last_rss, ms);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+    }
+
+    int objects_flat = first.live_programs == gl_resources.live_programs &&
+                       first.live_shaders == gl_resources.live_shaders &&
+                       first.live_buffers == gl_resources.live_buffers &&
+                       first.live_vertex_arrays == gl_resources.live_vertex_arrays &&
+                       first.live_framebuffers == gl_resources.live_framebuffers &&
+                       first.live_renderbuffers == gl_resources.live_renderbuffers;
+    // Allow some slack for the driver warming up its own caches
+    int rss_flat = last_rss - first_rss < 4096;
+    printf("GL objects %s, RSS %s (%+ld KB), GL errors: %s\n",
+           objects_flat ? "flat" : "GREW", rss_flat ? "flat" : "GREW", last_rss - first_rss,
+           glGetError() == GL_NO_ERROR ? "none" : "yes");
+
+    destroy_render_target(&fbo, &color_rb, &depth_rb);
+    free(pixels);
+    free_mesh(mesh);
+    release_programs();
+    cleanup_egl(&dev);
+
+    return objects_flat && rss_flat ? 0 : 1;
+}
+
+// Renders the debug cube offscreen and reads it back into a fake
+// framebuffer, with 1 to READBACK_MAX_TARGETS render targets and with
+// RGBA or native readback, to see what overlapping the readback with the
+// next frame and skipping the conversion buy. Falls back to a software
+// context, so it also runs without a GPU
+int readback_benchmark(int num_frames) {
+    const int width = 960, height = 540;
+    static const struct {
+        const char *name;
+        int bpp;
+        struct fb_bitfield red, green, blue;
+    } formats[] = {
+        {"XRGB8888", 32, {16, 8, 0}, {8, 8, 0}, {0, 8, 0}},
+        {"RGB565", 16, {11, 5, 0}, {5, 6, 0}, {0, 5, 0}},
+    };
+    static const struct { int targets; int format; int native; } cases[] = {
+        {1, 0, 0}, {2, 0, 0}, {3, 0, 0}, {1, 0, 1}, {2, 0, 1},
+        {2, 1, 0}, {2, 1, 1},
+    };
+
+    struct render_device dev = {0};
+    if (open_render_device(&dev, 1) < 0) {
+        return 1;
+    }
+    if (init_egl_surfaceless(&dev, width, height) < 0) {
+        if (dev.fd >= 0) close(dev.fd);
+        return 1;
+    }
+    if (setup_3d_rendering(&dev) < 0) {
+        cleanup_egl(&dev);
+        return 1;
+    }
+
+    Mesh *mesh = create_debug_cube();
+    unsigned char *pixels = (unsigned char*)malloc(width * height * 4);
+    char *fb = (char*)malloc(width * height * 4);
+    if (!mesh || !pixels || !fb || upload_mesh(mesh) < 0) {
+        fprintf(stderr, "Failed to set up the readback benchmark\n");
+        free(pixels);
+        free(fb);
+        free_mesh(mesh);
+        release_programs();
+        cleanup_egl(&dev);
+        return 1;
+    }
+
+    mat4 projection = mat4_perspective(45.0f * (PI / 180.0f), (float)width / height, 0.1f, 100.0f);
+    mat4 flipped = mat4_multiply(mat4_scale(mat4_identity(), (vec3){1, -1, 1}), projection);
+    vec3 camera_pos = {0, 0, 3.0f};
+    mat4 view = mat4_look_at(camera_pos, (vec3){0, 0, 0}, (vec3){0, 1, 0});
+
+    printf("Readback benchmark: %d frames at %dx%d on %s\n", num_frames, width, height,
+           (const char*)glGetString(GL_RENDERER));
+    printf("%-10s %-8s %8s %10s %10s %12s %8s\n", "format", "readback", "targets", "fps",
+           "ms/frame", "readback ms", "blit ms");
+
+    int result = 0;
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]) && !done; c++) {
+        struct fb_var_screeninfo vinfo;
+        struct fb_fix_screeninfo finfo;
+        memset(&vinfo, 0, sizeof(vinfo));
+        memset(&finfo, 0, sizeof(finfo));
+        vinfo.xres = width;
+        vinfo.yres = height;
+        vinfo.bits_per_pixel = formats[cases[c].format].bpp;
+        vinfo.red = formats[cases[c].format].red;
+        vinfo.green = formats[cases[c].format].green;
+        vinfo.blue = formats[cases[c].format].blue;
+        finfo.line_length = width * vinfo.bits_per_pixel / 8;
+
+        ReadbackRing ring;
+        Blitter blitter;
+        if (blitter_init(&blitter, &vinfo, &finfo) < 0) {
+            result = 1;
+            break;
+        }
+        if (readback_init(&ring, &dev, cases[c].targets, cases[c].native ? &vinfo : NULL) < 0) {
+            blitter_destroy(&blitter);
+            result = 1;
+            break;
+        }
+        blitter_set_native(&blitter, ring.native);
+        int usable = ring.num_targets == cases[c].targets && ring.native == cases[c].native;
+
+        double readback_ms = 0, blit_ms = 0;
+        unsigned long frames_read = 0;
+        struct timespec start, end, stage_start, stage_end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int frame = 0; usable && frame < num_frames && !done; frame++) {
+            mat4 model = mat4_multiply(mat4_rotate_y(frame * 0.01f), mat4_scale(mat4_identity(), mesh->scale));
+            mat4 mvp = mat4_multiply(mat4_multiply(ring.native ? flipped : projection, view), model);
+
+            readback_begin_frame(&ring, width, height, 1);
+            glClearColor(0.2f, 0.2f, 0.4f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            draw_mesh_gl(&dev, mesh, &(DrawRange){0, mesh->num_indices}, 1, mvp, model, view, camera_pos);
+            readback_end_frame(&ring);
+
+            if (readback_full(&ring)) {
+                int frame_width, frame_height, frame_scale;
+                clock_gettime(CLOCK_MONOTONIC, &stage_start);
+                readback_read(&ring, pixels, &frame_width, &frame_height, &frame_scale);
+                clock_gettime(CLOCK_MONOTONIC, &stage_end);
+                readback_ms += present_queue_ms(stage_start, stage_end);
+
+                stage_start = stage_end;
+                copy_to_framebuffer(&blitter, pixels, frame_width, frame_height, fb);
+                clock_gettime(CLOCK_MONOTONIC, &stage_end);
+                blit_ms += present_queue_ms(stage_start, stage_end);
+                frames_read++;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double total_ms = present_queue_ms(start, end);
+
+        if (!usable) {
+            printf("%-10s %-8s %8d %10s\n", formats[cases[c].format].name,
+                   cases[c].native ? "native" : "RGBA", cases[c].targets, "unsupported");
+        } else if (frames_read > 0) {
+            printf("%-10s %-8s %8d %10.1f %10.3f %12.3f %8.3f\n", formats[cases[c].format].name,
+                   ring.native ? "native" : "RGBA", ring.num_targets, frames_read * 1000.0 / total_ms,
+                   total_ms / frames_read, readback_ms / frames_read, blit_ms / frames_read);
+        }
+        readback_destroy(&ring);
+        blitter_destroy(&blitter);
+    }
+    if (glGetError() != GL_NO_ERROR) {
+        fprintf(stderr, "GL errors during the readback benchmark\n");
+        result = 1;
+    }
+
+    free(pixels);
+    free(fb);
+    free_mesh(mesh);
+    release_programs();
+    cleanup_egl(&dev);
+
+    return result;
+}
+
+static double load_benchmark_ms(struct timespec a, struct timespec b) {
+    return (b.tv_sec - a.tv_sec) * 1e3 + (b.tv_nsec - a.tv_nsec) / 1e6;
+}
+
+static int load_benchmark_compare_hashes(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Sorted hashes of every triangle's corner positions, so two meshes can
+// be compared whatever order their triangles and vertices are in
+static uint64_t *load_benchmark_triangle_hashes(const Mesh *mesh) {
+    size_t num_triangles = mesh_lod(mesh, 0).num_indices / 3;
+    uint64_t *hashes = (uint64_t*)malloc(num_triangles * sizeof(uint64_t) + 1);
+    if (!hashes) return NULL;
+    for (size_t t = 0; t < num_triangles; t++) {
+        uint64_t hash = 1469598103934665603ULL;
+        for (int k = 0; k < 3; k++) {
+            const float *p = &mesh->vertices[(size_t)mesh_index(mesh, t * 3 + k) * mesh->vertex_stride];
+            uint32_t bits[3];
+            memcpy(bits, p, sizeof(bits));
+            for (int c = 0; c < 3; c++) hash = (hash ^ bits[c]) * 1099511628211ULL;
+        }
+        hashes[t] = hash;
+    }
+    qsort(hashes, num_triangles, sizeof(uint64_t), load_benchmark_compare_hashes);
+    return hashes;
+}
+
+// Draws grids of 10, 1000 and 10000 debug cubes offscreen as a scene,
+// with instanced batches, with one draw call per instance and with the
+// software rasterizer, to see what batching buys as the count grows.
+// Falls back to a software context, so it also runs without a GPU
+int scene_benchmark(int num_frames) {
+    const int width = 640, height = 360;
+    static const int counts[] = {10, 1000, 10000};
+    enum { INSTANCED, UNIFORMS, SOFTWARE, NUM_MODES };
+    static const char *mode_names[NUM_MODES] = {"GL instanced", "GL uniforms", "software"};
+
+    struct render_device dev = {0};
+    if (open_render_device(&dev, 1) < 0) {
+        return 1;
+    }
+    if (init_egl_surfaceless(&dev, width, height) < 0) {
+        if (dev.fd >= 0) close(dev.fd);
+        return 1;
+    }
+    if (setup_3d_rendering(&dev) < 0) {
+        cleanup_egl(&dev);
+        return 1;
+    }
+
+    Mesh *mesh = create_debug_cube();
+    unsigned char *pixels[NUM_MODES] = {NULL};
+    for (int m = 0; m < NUM_MODES; m++) pixels[m] = (unsigned char*)malloc(width * height * 4);
+    DrawRange *ranges = mesh ? (DrawRange*)malloc((mesh->num_clusters + 1) * sizeof(DrawRange)) : NULL;
+    Rasterizer *rasterizer = raster_create(width, height, RASTER_THREADS);
+    GLuint fbo = 0, color_rb = 0, depth_rb = 0;
+    if (!mesh || !pixels[0] || !pixels[1] || !pixels[2] || !ranges || !rasterizer || upload_mesh(mesh) < 0 ||
+        create_render_target(&dev, GL_RGBA4, &fbo, &color_rb, &depth_rb) < 0) {
+        fprintf(stderr, "Failed to set up the scene benchmark\n");
+        destroy_render_target(&fbo, &color_rb, &depth_rb);
+        if (rasterizer) raster_destroy(rasterizer);
+        free(ranges);
+        for (int m = 0; m < NUM_MODES; m++) free(pixels[m]);
+        free_mesh(mesh);
+        release_programs();
+        cleanup_egl(&dev);
+        return 1;
+    }
+    glViewport(0, 0, width, height);
+
+    vec3 camera_pos = {0, 0, 3.0f};
+    mat4 view = mat4_look_at(camera_pos, (vec3){0, 0, 0}, (vec3){0, 1, 0});
+    mat4 projection = mat4_perspective(45.0f * (PI / 180.0f), (float)width / height, 0.1f, 100.0f);
+
+    printf("Scene benchmark: %d frames at %dx%d, instancing: %s, %d rasterizer threads\n", num_frames, width, height,
+           dev.instancing ? dev.instancing : "none", rasterizer->pool->num_workers);
+    printf("%10s %14s %10s %12s %12s\n", "instances", "mode", "ms/frame", "draw calls", "batches");
+
+    int result = 0;
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]) && !done; c++) {
+        Scene scene;
+        scene_init(&scene);
+        if (scene_layout_grid(&scene, &mesh, 1, counts[c]) < 0) {
+            fprintf(stderr, "Failed to allocate %d instances\n", counts[c]);
+            scene_destroy(&scene);
+            result = 1;
+            break;
+        }
+
+        for (int mode = 0; mode < NUM_MODES && !done; mode++) {
+            if (mode == INSTANCED && !dev.instancing) continue;
+            mat4 motion;
+            SceneFrame frame = {0};
+            frame.meshes = &mesh;
+            frame.mesh_motion = &motion;
+            frame.view = view;
+            frame.view_projection = mat4_multiply(projection, view);
+            frame.camera_position = camera_pos;
+            frame.pixels_per_unit = height / (2.0f * tanf(45.0f * (PI / 180.0f) / 2.0f));
+            frame.instancing = mode == INSTANCED;
+            frame.ranges = ranges;
+
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int f = 0; f < num_frames; f++) {
+                motion = mat4_multiply(mat4_rotate_y(f * 0.01f), mat4_scale(mat4_identity(), mesh->scale));
+                scene_cull(&scene, &frame);
+                if (mode == SOFTWARE) {
+                    raster_begin_frame(rasterizer, (vec4){0.2f, 0.2f, 0.4f, 1.0f});
+                    draw_scene_cpu(rasterizer, &scene, &frame);
+                    raster_end_frame(rasterizer, pixels[mode]);
+                } else {
+                    glClearColor(0.2f, 0.2f, 0.4f, 1.0f);
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                    draw_scene_gl(&dev, &scene, &frame);
+                    glFinish();
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (mode != SOFTWARE) {
+                glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels[mode]);
+            }
+            double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+            printf("%10d %14s %10.3f %12.1f %12.1f\n", counts[c], mode_names[mode], ms / num_frames,
+                   (double)frame.draw_calls / num_frames, (double)frame.batches / num_frames);
+        }
+
+        // Both GL paths should come out the same, give or take rounding
+        // on the edges of the triangles
+        if (dev.instancing && !done) {
+            size_t differing = 0;
+            for (size_t i = 0; i < (size_t)width * height; i++) {
+                if (memcmp(&pixels[INSTANCED][i * 4], &pixels[UNIFORMS][i * 4], 4) != 0) differing++;
+            }
+            printf("%10s %14s %.3f%% of pixels differ between the GL paths\n", "", "", 100.0 * differing / (width * height));
+            if (differing > (size_t)width * height / 100) result = 1;
+        }
+        scene_destroy(&scene);
+    }
+    printf("GL errors: %s\n", glGetError() == GL_NO_ERROR ? "none" : "yes");
+
+    destroy_render_target(&fbo, &color_rb, &depth_rb);
+    raster_destroy(rasterizer);
+    free(ranges);
+    for (int m = 0; m < NUM_MODES; m++) free(pixels[m]);
+    free_mesh(mesh);
+    release_programs();
+    cleanup_egl(&dev);
+
+    return result;
+}
+
+// Startup cost of a model: parsing the OBJ text like every start used to,
+// against mapping the binary cache (which gets rewritten on the way).
+// Mapping itself is nearly free, so the cached side also reads every
+// byte of the mesh once, like the upload or the first frame would
+int load_benchmark(const char *filename) {
+    struct timespec start, end;
+    MeshCacheSource source;
+    char cache_path[4096];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (mesh_cache_source_info(filename, &source) < 0 ||
+        mesh_cache_path(cache_path, sizeof(cache_path), filename) < 0) {
+        fprintf(stderr, "Error: Cannot open file '%s': %s\n", filename, strerror(errno));
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double source_ms = load_benchmark_ms(start, end);
+
+    printf("Load benchmark: %s, %.1f MB\n", filename, source.size / (1024.0 * 1024.0));
+
+    // The parser on its own, with one thread and with all of them
+    double parse_ms[2] = {0, 0};
+    int thread_counts[2] = {1, thread_pool_default_threads()};
+    for (int i = 0; i < 2; i++) {
+        ObjData data;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int parsed = obj_parse_file(filename, thread_counts[i], &data);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        parse_ms[i] = load_benchmark_ms(start, end);
+        if (parsed < 0) {
+            return 1;
+        }
+        obj_data_free(&data);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Mesh *baseline = load_obj_sscanf(filename);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double sscanf_ms = load_benchmark_ms(start, end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Mesh *text = load_obj_text(filename);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double text_ms = load_benchmark_ms(start, end);
+    if (!text) {
+        fprintf(stderr, "Failed to parse %s\n", filename);
+        return 1;
     }
-    
-    // Set default position, rotation, scale
-    mesh->position = (vec3){0.0f, 0.0f, 0.0f};
-    mesh->rotation = (vec3){0.0f, 0.0f, 0.0f};
-    mesh->scale = (vec3){3.0f, 3.0f, 3.0f};
-    
-    // Create VAO
-    glGenVertexArraysOES(1, &mesh->vao);
-    glBindVertexArrayOES(mesh->vao);
-    
-    // Create position VBO
-    glGenBuffers(1, &mesh->vbo_positions);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo_positions);
-    glBufferData(GL_ARRAY_BUFFER, vertex_count * 3 * sizeof(float), vertices, GL_STATIC_DRAW);
-    
-    // Set up position attribute
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-    
-    // Create normal VBO
-    glGenBuffers(1, &mesh->vbo_normals);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo_normals);
-    glBufferData(GL_ARRAY_BUFFER, vertex_count * 3 * sizeof(float), normals, GL_STATIC_DRAW);
-    
-    // Set up normal attribute
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(1);
-    
-    // No texcoords in simple implementation
-    mesh->vbo_texcoords = 0;
-    
-    // Create element buffer
-    glGenBuffers(1, &mesh->ebo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, face_count * 3 * sizeof(unsigned int), indices, GL_STATIC_DRAW);
-    
-    mesh->num_indices = face_count * 3;
-    
-    // Clean up
-    free(vertices);
-    free(indices);
-    free(normals);
-    
-    // Unbind VAO
-    glBindVertexArrayOES(0);
-    
-    printf("  Vertices: %d\n", vertex_count);
-    printf("  Faces: %d\n", face_count);
-    
-    return mesh;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int saved = save_mesh_cache(cache_path, &source, text);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double write_ms = load_benchmark_ms(start, end);
+    if (saved < 0) {
+        fprintf(stderr, "Couldn't write the mesh cache %s: %s\n", cache_path, strerror(errno));
+        free_mesh(text);
+        return 1;
+    }
+
+    // Drop the cache file from the page cache where we can, for a cold
+    // number. Without privileges this is just a hint
+    int fd = open(cache_path, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    MeshCacheSource check;
+    Mesh *cached = mesh_cache_source_info(filename, &check) == 0 ? load_mesh_cache(cache_path, &check) : NULL;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double map_ms = load_benchmark_ms(start, end);
+    if (!cached) {
+        fprintf(stderr, "Failed to map the cache we just wrote\n");
+        free_mesh(text);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long long sum = 0;
+    const unsigned char *bytes[2] = {(const unsigned char*)cached->vertices, (const unsigned char*)cached->indices};
+    size_t sizes[2] = {(size_t)cached->num_vertices * cached->vertex_stride * sizeof(float),
+                       (size_t)cached->num_indices * cached->index_size};
+    for (int i = 0; i < 2; i++) {
+        for (size_t j = 0; j < sizes[i]; j += 64) sum += bytes[i][j];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double touch_ms = load_benchmark_ms(start, end);
+
+    int same = text->num_vertices == cached->num_vertices && text->num_indices == cached->num_indices &&
+               text->num_lods == cached->num_lods && memcmp(text->lods, cached->lods, sizeof(text->lods)) == 0 &&
+               text->num_clusters == cached->num_clusters &&
+               memcmp(text->clusters, cached->clusters, text->num_clusters * sizeof(CullCluster)) == 0 &&
+               text->vertex_stride == cached->vertex_stride && text->index_size == cached->index_size &&
+               memcmp(text->vertices, cached->vertices, sizes[0]) == 0 &&
+               memcmp(text->indices, cached->indices, sizes[1]) == 0;
+
+    // The old loader only understands "f a b c", so only compare if it
+    // came up with the same number of triangles. The dedupe and the
+    // reordering renumber and move everything, so compare the triangles'
+    // positions as a set
+    size_t differing = 0;
+    int comparable = baseline && mesh_lod(baseline, 0).num_indices == mesh_lod(text, 0).num_indices;
+    if (comparable) {
+        uint64_t *a = load_benchmark_triangle_hashes(baseline);
+        uint64_t *b = load_benchmark_triangle_hashes(text);
+        comparable = a && b;
+        for (size_t t = 0; comparable && t < mesh_lod(text, 0).num_indices / 3; t++) differing += a[t] != b[t];
+        free(a);
+        free(b);
+    }
+
+    double cached_ms = source_ms + map_ms + touch_ms;
+    printf("  %u vertices, %u triangles\n", cached->num_vertices, mesh_lod(cached, 0).num_indices / 3);
+    printf("  sscanf loader:   %10.2f ms\n", sscanf_ms);
+    for (int i = 0; i < 2; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "Parser, %d thread%s:", thread_counts[i], thread_counts[i] == 1 ? "" : "s");
+        printf("  %-17s%10.2f ms (%.1fx the sscanf loader)\n", label, parse_ms[i],
+               sscanf_ms / (parse_ms[i] > 0 ? parse_ms[i] : 1e-3));
+    }
+    if (comparable) {
+        printf("  Same triangles as the sscanf loader, %zu off by rounding\n", differing);
+    } else {
+        printf("  Not comparable with the sscanf loader (it only reads \"f a b c\" faces)\n");
+    }
+    printf("  Text load:       %10.2f ms\n", text_ms);
+    printf("  Cache write:     %10.2f ms (once)\n", write_ms);
+    printf("  Source check:    %10.2f ms\n", source_ms);
+    printf("  Cache map:       %10.2f ms\n", map_ms);
+    printf("  First touch:     %10.2f ms (checksum %llu)\n", touch_ms, sum & 0xff);
+    printf("  Startup: %.2f ms from text, %.2f ms from the cache (%.0fx), cached mesh %s\n",
+           text_ms, cached_ms, text_ms / (cached_ms > 0 ? cached_ms : 1e-3),
+           same ? "matches" : "DIFFERS");
+
+    free_mesh(baseline);
+    free_mesh(text);
+    free_mesh(cached);
+    return same ? 0 : 1;
 }
 
+// One frame of a bench run on the GL or software backend, timed stage
+// by stage. The scene has the one mesh, which spins like in main(), and
+// the camera follows path
+static void bench_scene_frame(BenchRun *run, Framebuffer *fb, Scene *scene, SceneFrame *frame, mat4 *mesh_motion,
+                              const CameraPath *path, float time, struct render_device *dev, ReadbackRing *readback,
+                              Rasterizer *rasterizer, unsigned char *pixels) {
+    long long stage_ns[BENCH_STAGES] = {0};
+    int width = run->width, height = run->height;
+
+    Mesh *mesh = frame->meshes[0];
+
+    long long t0 = bench_now_ns();
+    vec3 camera_position, camera_rotation;
+    camera_path_sample(path, time, &camera_position, &camera_rotation);
+
+    long long t1 = bench_now_ns();
+    vec3 view_dir = {
+        -sinf(camera_rotation.y) * cosf(camera_rotation.x),
+        sinf(camera_rotation.x),
+        -cosf(camera_rotation.y) * cosf(camera_rotation.x)
+    };
+    mat4 view = mat4_look_at(camera_position, add_vec3(camera_position, view_dir), (vec3){0, 1, 0});
+    mat4 projection = mat4_perspective(45.0f * (PI / 180.0f), (float)width / height, 0.1f, 100.0f);
+    if (!rasterizer && readback->native) {
+        projection = mat4_multiply(mat4_scale(mat4_identity(), (vec3){1, -1, 1}), projection);
+    }
+    mat4 motion = mat4_multiply(mat4_rotate_y(mesh->rotation.y + time * 0.5f), mat4_rotate_x(mesh->rotation.x));
+    motion = mat4_multiply(motion, mat4_rotate_z(mesh->rotation.z));
+    *mesh_motion = mat4_scale(motion, mesh->scale);
+    frame->view = view;
+    frame->view_projection = mat4_multiply(projection, view);
+    frame->camera_position = camera_position;
+    frame->pixels_per_unit = height / (2.0f * tanf(45.0f * (PI / 180.0f) / 2.0f));
+    scene_cull(scene, frame);
+
+    long long t2 = bench_now_ns();
+    long long t3;
+    if (rasterizer) {
+        raster_begin_frame(rasterizer, (vec4){0.2f, 0.2f, 0.4f, 1.0f});
+        draw_scene_cpu(rasterizer, scene, frame);
+        raster_end_frame(rasterizer, pixels);
+        t3 = bench_now_ns();
+    } else {
+        readback_begin_frame(readback, width, height, 1);
+        glClearColor(0.2f, 0.2f, 0.4f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        draw_scene_gl(dev, scene, frame);
+        readback_end_frame(readback);
+        // Wait for it here, so the time goes to drawing and not readback
+        glFinish();
+        t3 = bench_now_ns();
+        int frame_width, frame_height, frame_scale;
+        readback_read(readback, pixels, &frame_width, &frame_height, &frame_scale);
+    }
 
-// Free mesh resources
-void free_mesh(Mesh* mesh) {
-    if (!mesh) return;
-    
-    glDeleteVertexArraysOES(1, &mesh->vao);
-    glDeleteBuffers(1, &mesh->vbo_positions);
-    if (mesh->vbo_normals) glDeleteBuffers(1, &mesh->vbo_normals);
-    if (mesh->vbo_texcoords) glDeleteBuffers(1, &mesh->vbo_texcoords);
-    glDeleteBuffers(1, &mesh->ebo);
-    
-    free(mesh);
+    long long t4 = bench_now_ns();
+    framebuffer_present(fb, pixels, width, height);
+    long long t5 = bench_now_ns();
+
+    stage_ns[BENCH_INPUT] = t1 - t0;
+    stage_ns[BENCH_TRANSFORM] = t2 - t1;
+    stage_ns[BENCH_DRAW] = t3 - t2;
+    stage_ns[BENCH_READBACK] = t4 - t3;
+    stage_ns[BENCH_BLIT] = t5 - t4;
+    bench_run_record(run, stage_ns, fb->bytes_written);
 }
 
-// Copy rendered pixels to framebuffer with proper format conversion
-void copy_to_framebuffer(unsigned char *pixels, int width, int height, struct fb_var_screeninfo vinfo, struct fb_fix_screeninfo finfo, char *fbp) {
-    int fb_width = vinfo.xres;
-    int fb_height = vinfo.yres;
-    int bpp = vinfo.bits_per_pixel;
-    
-    // Calculate how much of the image to draw (don't exceed framebuffer dimensions)
-    int draw_width = (width < fb_width) ? width : fb_width;
-    int draw_height = (height < fb_height) ? height : fb_height;
-    
-    if (bpp == 32) { // 32 bits per pixel (RGBA or ARGB)
-        for (int y = 0; y < draw_height; y++) {
-            for (int x = 0; x < draw_width; x++) {
-                int fb_offset = (y * finfo.line_length) + (x * (bpp / 8));
-                int pixels_offset = ((height - 1 - y) * width + x) * 4; // Flip vertically
-                
-                // Map RGBA to framebuffer format
-                *((uint8_t*)(fbp + fb_offset + vinfo.red.offset/8)) = pixels[pixels_offset];
-                *((uint8_t*)(fbp + fb_offset + vinfo.green.offset/8)) = pixels[pixels_offset + 1];
-                *((uint8_t*)(fbp + fb_offset + vinfo.blue.offset/8)) = pixels[pixels_offset + 2];
-                
-                if (vinfo.transp.length > 0) {
-                    *((uint8_t*)(fbp + fb_offset + vinfo.transp.offset/8)) = pixels[pixels_offset + 3];
-                }
+// One frame of the raycaster, which only has a CPU version
+static void bench_raycaster_frame(BenchRun *run, Framebuffer *fb, Raycaster *raycaster, const CameraPath *path,
+                                  float time, unsigned char *pixels) {
+    long long stage_ns[BENCH_STAGES] = {0};
+
+    long long t0 = bench_now_ns();
+    vec3 camera_position, camera_rotation;
+    camera_path_sample(path, time, &camera_position, &camera_rotation);
+
+    // Orbit instead of flying, the cube turns the way the meshes do and
+    // the path only tilts the view and moves it in and out
+    long long t1 = bench_now_ns();
+    raycaster_orbit(raycaster, time * 0.5f + camera_rotation.y, camera_rotation.x,
+                    SIDE_LENGTH * length_vec3(camera_position));
+
+    long long t2 = bench_now_ns();
+    raycaster_render(raycaster, pixels);
+
+    long long t3 = bench_now_ns();
+    framebuffer_present(fb, pixels, run->width, run->height);
+    long long t4 = bench_now_ns();
+
+    stage_ns[BENCH_INPUT] = t1 - t0;
+    stage_ns[BENCH_TRANSFORM] = t2 - t1;
+    stage_ns[BENCH_DRAW] = t3 - t2;
+    stage_ns[BENCH_BLIT] = t4 - t3;
+    bench_run_record(run, stage_ns, fb->bytes_written);
+}
+
+// --bench: fixed scenes (the debug cube, the OBJ file if there is one,
+// a grid of 1000 cubes, and the old cube raycaster) for num_frames frames
+// each, on GL (falling back to a software context) and on the software
+// rasterizer, along the built in camera path. Frames go to a framebuffer
+// in memory with output_mode, rendered DOWNSCALING_FACTOR times smaller
+// like main() starts out. Progress goes to stderr, the report (format
+// "json" or "csv") to output_path, or stdout if that's NULL
+int bench_suite(const char *obj_path, const char *output_mode, int num_frames, int cpu_only,
+                const char *format, const char *output_path) {
+    enum { BENCH_MAX_RUNS = 8 };
+    if (num_frames < 1) num_frames = 1;
+    int csv = strcmp(format, "csv") == 0;
+    if (!csv && strcmp(format, "json") != 0) {
+        fprintf(stderr, "Unknown benchmark format: %s (json or csv)\n", format);
+        return 1;
+    }
+
+    struct fb_var_screeninfo mode;
+    if (framebuffer_parse_mode(output_mode, &mode) < 0) {
+        fprintf(stderr, "Bad output mode: %s (WIDTHxHEIGHT[xBPP][:R,G,B[,A]])\n", output_mode);
+        return 1;
+    }
+
+    // Whatever setup prints goes to stderr, so a report on stdout can be
+    // piped straight into something that parses it
+    fflush(stdout);
+    int report_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    Framebuffer fb;
+    if (framebuffer_open_virtual(&fb, FB_TARGET_MEMORY, NULL, &mode, DAMAGE_TRACKING) < 0) {
+        dup2(report_fd, STDOUT_FILENO);
+        close(report_fd);
+        return 1;
+    }
+    int scale = DOWNSCALING_FACTOR;
+    int width = (mode.xres + scale - 1) / scale;
+    int height = (mode.yres + scale - 1) / scale;
+    framebuffer_set_scale(&fb, scale, UPSCALE_FILTER);
+
+    // GL is optional, the software runs go ahead without it
+    struct render_device dev = {0};
+    ReadbackRing readback = {0};
+    int has_gl = 0;
+    if (!cpu_only && open_render_device(&dev, 1) == 0) {
+        if (init_egl_surfaceless(&dev, width, height) < 0) {
+            if (dev.fd >= 0) close(dev.fd);
+        } else if (setup_3d_rendering(&dev) < 0) {
+            cleanup_egl(&dev);
+        } else {
+            int native = GL_NATIVE_READBACK && UPSCALE_FILTER != BLIT_FILTER_BILINEAR;
+            if (readback_init(&readback, &dev, 1, native ? &fb.vinfo : NULL) < 0) {
+                release_programs();
+                cleanup_egl(&dev);
+            } else {
+                glViewport(0, 0, width, height);
+                has_gl = 1;
             }
         }
-    } else if (bpp == 24) { // 24 bits per pixel (RGB)
-        for (int y = 0; y < draw_height; y++) {
-            for (int x = 0; x < draw_width; x++) {
-                int fb_offset = (y * finfo.line_length) + (x * (bpp / 8));
-                int pixels_offset = ((height - 1 - y) * width + x) * 4; // Flip vertically
-                
-                // Map RGB to framebuffer
-                *((uint8_t*)(fbp + fb_offset + vinfo.red.offset/8)) = pixels[pixels_offset];
-                *((uint8_t*)(fbp + fb_offset + vinfo.green.offset/8)) = pixels[pixels_offset + 1];
-                *((uint8_t*)(fbp + fb_offset + vinfo.blue.offset/8)) = pixels[pixels_offset + 2];
+    }
+
+    Rasterizer *rasterizer = raster_create(width, height, RASTER_THREADS);
+    unsigned char *pixels = (unsigned char*)malloc((size_t)width * height * 4);
+    Mesh *cube = create_debug_cube();
+    // Small enough to stay whole in view along the path, at its usual
+    // size the camera ends up inside it
+    if (cube) cube->scale = (vec3){1.0f, 1.0f, 1.0f};
+    Mesh *obj = obj_path ? load_mesh(obj_path) : NULL;
+    CameraPath path = {0};
+    int failed = !rasterizer || !pixels || !cube || (obj_path && !obj) || camera_path_default(&path) < 0;
+    if (!failed && has_gl) {
+        failed = upload_mesh(cube) < 0 || (obj && upload_mesh(obj) < 0);
+    }
+    unsigned int max_clusters = cube ? cube->num_clusters : 0;
+    if (obj && obj->num_clusters > max_clusters) max_clusters = obj->num_clusters;
+    DrawRange *ranges = failed ? NULL : (DrawRange*)malloc((max_clusters + 1) * sizeof(DrawRange));
+    if (!ranges) {
+        fprintf(stderr, "Failed to set up the benchmark\n");
+        failed = 1;
+    }
+    if (!failed) rasterizer->hiz_enabled = RASTER_HIZ;
+
+    const struct { const char *name; Mesh *mesh; int instances; } scenes[] = {
+        {"cube", cube, 1},
+        {"obj", obj, 1},
+        {"instances", cube, 1000},
+        {"raycaster", NULL, 0},
+    };
+    BenchRun runs[BENCH_MAX_RUNS];
+    int num_runs = 0;
+    float step = 1.0f / (FRAME_LIMIT > 0 ? FRAME_LIMIT : 60);
+
+    for (size_t s = 0; s < sizeof(scenes) / sizeof(scenes[0]) && !failed && !done; s++) {
+        int is_raycaster = scenes[s].mesh == NULL && scenes[s].instances == 0;
+        if (!is_raycaster && !scenes[s].mesh) continue;
+
+        for (int backend = 0; backend < 2 && !done; backend++) {
+            int gl = backend == 0;
+            if (gl && (!has_gl || is_raycaster)) continue;
+            BenchRun *run = &runs[num_runs];
+            if (bench_run_init(run, scenes[s].name, gl ? "gl" : "software", width, height, num_frames) < 0) {
+                failed = 1;
+                break;
             }
-        }
-    } else if (bpp == 16) { // 16 bits per pixel (RGB565 usually)
-        for (int y = 0; y < draw_height; y++) {
-            for (int x = 0; x < draw_width; x++) {
-                int fb_offset = (y * finfo.line_length) + (x * (bpp / 8));
-                int pixels_offset = ((height - 1 - y) * width + x) * 4; // Flip vertically
-                
-                // Convert RGB to RGB565 or other 16-bit format
-                uint16_t color = 
-                    ((pixels[pixels_offset] >> (8 - vinfo.red.length)) << vinfo.red.offset) |
-                    ((pixels[pixels_offset + 1] >> (8 - vinfo.green.length)) << vinfo.green.offset) |
-                    ((pixels[pixels_offset + 2] >> (8 - vinfo.blue.length)) << vinfo.blue.offset);
-                
-                *((uint16_t*)(fbp + fb_offset)) = color;
+            num_runs++;
+            fprintf(stderr, "Benchmark: %s on %s, %d frames at %dx%d\n", run->scene, run->backend,
+                    num_frames, width, height);
+
+            // Each run starts from a clean framebuffer, in the format its
+            // backend hands over
+            framebuffer_set_native(&fb, gl && readback.native);
+            blitter_invalidate(&fb.blitters[0]);
+            blitter_invalidate(&fb.blitters[1]);
+
+            if (is_raycaster) {
+                Raycaster raycaster;
+                raycaster_init(&raycaster, width, height);
+                for (int f = 0; f < num_frames && !done; f++) {
+                    bench_raycaster_frame(run, &fb, &raycaster, &path, f * step, pixels);
+                }
+                raycaster_destroy(&raycaster);
+                continue;
+            }
+
+            Mesh *meshes[1] = {scenes[s].mesh};
+            mat4 mesh_motion[1];
+            Scene scene;
+            scene_init(&scene);
+            if (scene_layout_grid(&scene, meshes, 1, scenes[s].instances) < 0) {
+                fprintf(stderr, "Failed to allocate %d instances\n", scenes[s].instances);
+                scene_destroy(&scene);
+                failed = 1;
+                break;
             }
+            SceneFrame frame = {0};
+            frame.meshes = meshes;
+            frame.mesh_motion = mesh_motion;
+            frame.instancing = 1;
+            frame.ranges = ranges;
+            for (int f = 0; f < num_frames && !done; f++) {
+                bench_scene_frame(run, &fb, &scene, &frame, mesh_motion, &path, f * step, &dev, &readback,
+                                  gl ? NULL : rasterizer, pixels);
+            }
+            scene_destroy(&scene);
+        }
+    }
+
+    fflush(stdout);
+    dup2(report_fd, STDOUT_FILENO);
+    close(report_fd);
+
+    if (!failed) {
+        char framebuffer[64], scale_text[16], threads[64];
+        snprintf(framebuffer, sizeof(framebuffer), "%ux%u, %u bpp, %s blit", mode.xres, mode.yres,
+                 mode.bits_per_pixel, fb.blitters[0].name);
+        snprintf(scale_text, sizeof(scale_text), "%d", scale);
+        snprintf(threads, sizeof(threads), "%d threads, %s kernel", rasterizer->pool->num_workers,
+                 rasterizer->kernel_name);
+        const char *info[] = {
+            "gl_renderer", has_gl ? (const char*)glGetString(GL_RENDERER) : "none",
+            "framebuffer", framebuffer,
+            "downscaling", scale_text,
+            "rasterizer", threads,
+            "obj", obj_path ? obj_path : "none",
+            NULL, NULL
+        };
+
+        FILE *out = output_path ? fopen(output_path, "w") : stdout;
+        if (!out) {
+            perror("Error opening benchmark output");
+            failed = 1;
+        } else {
+            if (csv) bench_write_csv(out, runs, num_runs);
+            else bench_write_json(out, info, runs, num_runs);
+            if (out != stdout) fclose(out);
         }
     }
+
+    for (int r = 0; r < num_runs; r++) bench_run_destroy(&runs[r]);
+    camera_path_destroy(&path);
+    free(ranges);
+    free_mesh(obj);
+    free_mesh(cube);
+    free(pixels);
+    if (rasterizer) raster_destroy(rasterizer);
+    if (has_gl) {
+        readback_destroy(&readback);
+        release_programs();
+        cleanup_egl(&dev);
+    }
+    framebuffer_close(&fb);
+    return failed;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <obj_file.obj> [input_device_path]\n", argv[0]);
+    // Options can go anywhere, everything else is positional
+    int use_cpu = CPU_RENDERING;
+    int readback_targets = GL_READBACK_TARGETS;
+    int load_bench = 0;
+    int num_instances = 1;
+    const char *model_paths[SCENE_MAX_MODELS] = {NULL}; // The first one is the positional OBJ file
+    int num_models = 1;
+    const char *output = FB_DEVICE; // fbdev device, "memory", "memfd" or a file
+    const char *output_mode = VIRTUAL_FB_MODE;
+    const char *camera_path_name = NULL; // A file, or "default" for the built in path
+    unsigned long max_frames = 0; // 0 for no limit
+    int bench = 0;
+    int bench_frames = 300;
+    const char *bench_format = "json";
+    const char *bench_output = NULL; // stdout
+    const char *trace_path = NULL;
+    int stats_mode = STATS_OFF;
+    const char *stats_log = NULL; // stderr
+    const char *positional[2] = {NULL, NULL};
+    int num_positional = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu") == 0) {
+            use_cpu = 1;
+        } else if (strcmp(argv[i], "--sync-readback") == 0) {
+            readback_targets = 1;
+        } else if (strcmp(argv[i], "--raster-bench") == 0) {
+            raster_benchmark(1920, 1080, RASTER_THREADS);
+            return 0;
+        } else if (strcmp(argv[i], "--blit-bench") == 0) {
+            blit_benchmark();
+            return 0;
+        } else if (strcmp(argv[i], "--raycaster-bench") == 0) {
+            raycaster_benchmark();
+            return 0;
+        } else if (strcmp(argv[i], "--gl-soak") == 0) {
+            return gl_soak_benchmark(100000);
+        } else if (strcmp(argv[i], "--load-bench") == 0) {
+            load_bench = 1;
+        } else if (strcmp(argv[i], "--readback-bench") == 0) {
+            return readback_benchmark(500);
+        } else if (strcmp(argv[i], "--scene-bench") == 0) {
+            return scene_benchmark(200);
+        } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            num_instances = atoi(argv[++i]);
+            if (num_instances < 1) num_instances = 1;
+        } else if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) {
+            if (num_models < SCENE_MAX_MODELS) model_paths[num_models++] = argv[++i];
+            else i++;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--output-mode") == 0 && i + 1 < argc) {
+            output_mode = argv[++i];
+        } else if (strcmp(argv[i], "--camera-path") == 0 && i + 1 < argc) {
+            camera_path_name = argv[++i];
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            max_frames = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "--bench-frames") == 0 && i + 1 < argc) {
+            bench_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-format") == 0 && i + 1 < argc) {
+            bench_format = argv[++i];
+        } else if (strcmp(argv[i], "--bench-output") == 0 && i + 1 < argc) {
+            bench_output = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "overlay") == 0) stats_mode = STATS_OVERLAY;
+            else if (strcmp(argv[i], "log") == 0) stats_mode = STATS_LOG;
+            else if (strcmp(argv[i], "off") == 0) stats_mode = STATS_OFF;
+            else {
+                fprintf(stderr, "Unknown stats mode: %s (overlay, log or off)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--stats-log") == 0 && i + 1 < argc) {
+            stats_log = argv[++i];
+            stats_mode = STATS_LOG;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        } else if (num_positional < 2) {
+            positional[num_positional++] = argv[i];
+        }
+    }
+
+    trace_thread_name("render");
+    if (trace_path && (!TRACING || trace_start() < 0)) {
+        if (!TRACING) fprintf(stderr, "--trace needs TRACING in config.h\n");
+        return 1;
+    }
+    if (bench) {
+        int result = bench_suite(positional[0], output_mode, bench_frames, use_cpu, bench_format, bench_output);
+        if (trace_path) trace_write(trace_path);
+        return result;
+    }
+    if (num_positional < 1) {
+        fprintf(stderr, "Usage: %s [--cpu] [--sync-readback] [--raster-bench] [--blit-bench] [--raycaster-bench] [--gl-soak] [--readback-bench] [--load-bench] [--scene-bench] [--instances N] [--model extra.obj]... [--output fbdev_path|memory|memfd|file] [--output-mode WxH[xBPP][:R,G,B[,A]]] [--camera-path file|default] [--frames N] [--stats overlay|log] [--stats-log file] [--trace file] <obj_file.obj> [input_device_path]\n", argv[0]);
+        fprintf(stderr, "       %s --bench [--cpu] [--bench-frames N] [--bench-format json|csv] [--bench-output file] [--output-mode mode] [--trace file] [obj_file.obj]\n", argv[0]);
         return 1;
     }
+    const char *obj_path = positional[0];
+    model_paths[0] = obj_path;
+    if (load_bench) {
+        return load_benchmark(obj_path);
+    }
 
     struct sigaction action;
     memset(&action, 0, sizeof(struct sigaction));
     action.sa_handler = term;
     sigaction(SIGINT, &action, NULL);
-
-    // Open the framebuffer device
-    int fbfd = open("/dev/fb0", O_RDWR);
-    if (fbfd == -1) {
-        perror("Error opening framebuffer device");
-        exit(1);
+    if (trace_path) {
+        // kill -USR1 writes the trace so far without stopping
+        action.sa_handler = trace_request_dump;
+        sigaction(SIGUSR1, &action, NULL);
     }
 
-    struct fb_var_screeninfo vinfo;
-    if (ioctl(fbfd, FBIOGET_VSCREENINFO, &vinfo)) {
-        perror("Error reading variable information");
-        exit(1);
+    // Open the framebuffer: a device, or somewhere in memory or a file
+    // with a made up screen
+    Framebuffer fb;
+    struct stat output_stat;
+    int output_target = strcmp(output, "memory") == 0 ? FB_TARGET_MEMORY :
+                        strcmp(output, "memfd") == 0 ? FB_TARGET_MEMFD :
+                        stat(output, &output_stat) == 0 && S_ISCHR(output_stat.st_mode) ? FB_TARGET_DEVICE :
+                        FB_TARGET_FILE;
+    if (output_target == FB_TARGET_DEVICE) {
+        if (framebuffer_open(&fb, output, FB_DOUBLE_BUFFER, FB_WAIT_VSYNC, DAMAGE_TRACKING) < 0) {
+            exit(1);
+        }
+    } else {
+        struct fb_var_screeninfo mode;
+        if (framebuffer_parse_mode(output_mode, &mode) < 0) {
+            fprintf(stderr, "Bad output mode: %s (WIDTHxHEIGHT[xBPP][:R,G,B[,A]])\n", output_mode);
+            return 1;
+        }
+        if (framebuffer_open_virtual(&fb, output_target, output, &mode, DAMAGE_TRACKING) < 0) {
+            exit(1);
+        }
     }
-
-    struct fb_fix_screeninfo finfo;
-    if (ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo)) {
-        perror("Error reading fixed information");
-        exit(1);
+    struct fb_var_screeninfo vinfo = fb.vinfo;
+    printf("Framebuffer: %dx%d, %d bpp, %s blit, %s\n", vinfo.xres, vinfo.yres, vinfo.bits_per_pixel,
+           fb.blitters[0].name, fb.num_pages == 2 ? (fb.wait_vsync ? "page flipping on vsync" : "page flipping") : "single buffer");
+    if (output_target != FB_TARGET_DEVICE) {
+        printf("Framebuffer: %s, red at %u, green at %u, blue at %u\n",
+               output_target == FB_TARGET_MEMORY ? "in memory" : output_target == FB_TARGET_MEMFD ? "memfd" : output,
+               vinfo.red.offset, vinfo.green.offset, vinfo.blue.offset);
     }
 
-    long screensize = vinfo.yres_virtual * finfo.line_length;
-    char* fbp = (char*)mmap(0, screensize, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
-
-    if ((intptr_t)fbp == -1) {
-        perror("Error mapping framebuffer to memory");
-        exit(1);
+    // Either the camera follows a script, with a fixed time step so every
+    // run draws the same frames, or the keyboard moves it
+    CameraPath camera_path = {0};
+    int scripted = camera_path_name != NULL;
+    if (scripted && (strcmp(camera_path_name, "default") == 0 ? camera_path_default(&camera_path) :
+                     camera_path_load(&camera_path, camera_path_name)) < 0) {
+        fprintf(stderr, "Could not set up the camera path: %s\n", camera_path_name);
+        framebuffer_close(&fb);
+        return 1;
     }
 
     // Check for input device argument
     const char *input_device = "/dev/input/event3"; // Default
-    if (argc > 2) {
-        input_device = argv[2];
+    if (positional[1]) {
+        input_device = positional[1];
     }
     
     // Initialize input
-    if (!setup_input(input_device)) {
+    if (!scripted && !setup_input(input_device)) {
         fprintf(stderr, "Could not initialize input. Try providing your input device path as argument.\n");
-        fprintf(stderr, "For example: %s %s /dev/input/event3\n", argv[0], argv[1]);
+        fprintf(stderr, "For example: %s %s /dev/input/event3\n", argv[0], obj_path);
         fprintf(stderr, "Find your keyboard device with: cat /proc/bus/input/devices\n");
-        munmap(fbp, screensize);
-        close(fbfd);
+        fprintf(stderr, "Or render without one: %s --camera-path default --frames 300 %s\n", argv[0], obj_path);
+        camera_path_destroy(&camera_path);
+        framebuffer_close(&fb);
         return 1;
     }
 
+    // Both backends render at a fraction of the framebuffer resolution,
+    // the blitter scales it back up (rounded up, so the screen is covered).
+    // With dynamic resolution the fraction changes as we go, so everything
+    // is allocated for the finest one and smaller frames use part of it
+    // Scripted runs stay at one resolution, the frames shouldn't depend on
+    // how fast the machine is
+    int dynamic_resolution = DYNAMIC_RESOLUTION && !scripted;
+    ResolutionController resolution;
+    resolution_init(&resolution, dynamic_resolution, DOWNSCALING_FACTOR,
+                    dynamic_resolution ? 1 : DOWNSCALING_FACTOR,
+                    dynamic_resolution ? MAX_DOWNSCALING_FACTOR : DOWNSCALING_FACTOR,
+                    FRAME_BUDGET_MS);
+    int max_render_width = (vinfo.xres + resolution.min_scale - 1) / resolution.min_scale;
+    int max_render_height = (vinfo.yres + resolution.min_scale - 1) / resolution.min_scale;
+    int render_width = (vinfo.xres + resolution.scale - 1) / resolution.scale;
+    int render_height = (vinfo.yres + resolution.scale - 1) / resolution.scale;
+    framebuffer_set_scale(&fb, resolution.scale, UPSCALE_FILTER);
+    if (resolution.enabled) {
+        printf("Dynamic resolution: 1/%d to 1/%d of %dx%d, %.1f ms budget, %s upscaling\n",
+               resolution.min_scale, resolution.max_scale, vinfo.xres, vinfo.yres, resolution.budget_ms,
+               UPSCALE_FILTER == BLIT_FILTER_BILINEAR ? "bilinear" : "nearest");
+    } else if (resolution.scale > 1) {
+        printf("Rendering at %dx%d, scaled up %dx (%s)\n", render_width, render_height, resolution.scale,
+               UPSCALE_FILTER == BLIT_FILTER_BILINEAR ? "bilinear" : "nearest");
+    }
+
     // Initialize GL rendering
+    // Anything going wrong here drops us to the software rasterizer
     struct render_device gl_dev = {0};
     
-    // Find and open a DRM render node
-    if (find_drm_render_node(&gl_dev) < 0) {
-        munmap(fbp, screensize);
-        close(fbfd);
-        return 1;
-    }
+    if (!use_cpu) {
+        // Find and open a DRM render node
+        if (open_render_device(&gl_dev, GL_SOFTWARE_FALLBACK) < 0) {
+            use_cpu = 1;
+        }
+        // Initialize EGL for surfaceless rendering
+        else if (init_egl_surfaceless(&gl_dev, max_render_width, max_render_height) < 0) {
+            if (gl_dev.fd >= 0) close(gl_dev.fd);
+            use_cpu = 1;
+        }
+        // Setup 3D rendering
+        else if (setup_3d_rendering(&gl_dev) < 0) {
+            cleanup_egl(&gl_dev);
+            use_cpu = 1;
+        }
+        else {
+            printf("Initialized surfaceless rendering context: %dx%d\n", gl_dev.width, gl_dev.height);
+        }
 
-    // Initialize EGL for surfaceless rendering
-    if (init_egl_surfaceless(&gl_dev, vinfo.xres, vinfo.yres) < 0) {
-        close(gl_dev.fd);
-        munmap(fbp, screensize);
-        close(fbfd);
-        return 1;
+        if (use_cpu) {
+            fprintf(stderr, "GL initialization failed, falling back to the software rasterizer\n");
+        }
     }
 
-    printf("Initialized surfaceless rendering context: %dx%d\n", gl_dev.width, gl_dev.height);
-
-    // Setup 3D rendering
-    if (setup_3d_rendering(&gl_dev) < 0) {
-        cleanup_egl(&gl_dev);
-        munmap(fbp, screensize);
-        close(fbfd);
-        return 1;
+    Rasterizer *rasterizer = NULL;
+    if (use_cpu) {
+        rasterizer = raster_create(max_render_width, max_render_height, RASTER_THREADS);
+        if (!rasterizer) {
+            fprintf(stderr, "Failed to create the software rasterizer\n");
+            camera_path_destroy(&camera_path);
+            framebuffer_close(&fb);
+            return 1;
+        }
+        raster_resize(rasterizer, render_width, render_height);
+        rasterizer->hiz_enabled = RASTER_HIZ;
+        printf("Using the software rasterizer: %dx%d, %d threads, %s kernel\n",
+               render_width, render_height, rasterizer->pool->num_workers, rasterizer->kernel_name);
     }
 
-    if (!glGenVertexArraysOES || !glBindVertexArrayOES || !glDeleteVertexArraysOES) {
-        fprintf(stderr, "Error: OpenGL ES VAO extensions were not properly initialized!\n");
-        cleanup_egl(&gl_dev);
-        munmap(fbp, screensize);
-        close(fbfd);
-        return 1;
+    // Load the OBJ models, and lay out instances of them
+    Mesh *meshes[SCENE_MAX_MODELS] = {NULL};
+    Scene scene;
+    scene_init(&scene);
+    unsigned int max_clusters = 0;
+    int loaded = 1;
+    for (int i = 0; i < num_models && loaded; i++) {
+        meshes[i] = load_mesh(model_paths[i]);
+        if (!meshes[i] || (!use_cpu && upload_mesh(meshes[i]) < 0)) {
+            fprintf(stderr, "Failed to load OBJ model: %s\n", model_paths[i]);
+            loaded = 0;
+        } else if (meshes[i]->num_clusters > max_clusters) {
+            max_clusters = meshes[i]->num_clusters;
+        }
     }
-
-    // Load OBJ model
-    Mesh* mesh = create_debug_cube();
-    if (!mesh) {
-        fprintf(stderr, "Failed to load OBJ model: %s\n", argv[1]);
-        cleanup_egl(&gl_dev);
-        munmap(fbp, screensize);
-        close(fbfd);
+    if (loaded && scene_layout_grid(&scene, meshes, num_models, num_instances) < 0) {
+        fprintf(stderr, "Failed to allocate %d instances\n", num_instances);
+        loaded = 0;
+    }
+    // What's left of a mesh after culling, at most one range per cluster
+    DrawRange *draw_ranges = loaded ? (DrawRange*)malloc((max_clusters + 1) * sizeof(DrawRange)) : NULL;
+    if (!draw_ranges) {
+        scene_destroy(&scene);
+        for (int i = 0; i < num_models; i++) free_mesh(meshes[i]);
+        if (use_cpu) raster_destroy(rasterizer);
+        else {
+            release_programs();
+            cleanup_egl(&gl_dev);
+        }
+        camera_path_destroy(&camera_path);
+        framebuffer_close(&fb);
         return 1;
     }
 
-    // Allocate pixels buffer for reading back the rendered image
-    unsigned char *pixels = (unsigned char *)malloc(gl_dev.width * gl_dev.height * 4);
-    if (!pixels) {
+    // Ring of buffers for rendered frames, presented from another thread
+    PresentQueue queue;
+    if (present_queue_init(&queue, &fb, max_render_width, max_render_height, PRESENT_QUEUE_DEPTH) < 0) {
         fprintf(stderr, "Failed to allocate memory for pixels\n");
-        free_mesh(mesh);
-        cleanup_egl(&gl_dev);
-        munmap(fbp, screensize);
-        close(fbfd);
+        free(draw_ranges);
+        scene_destroy(&scene);
+        for (int i = 0; i < num_models; i++) free_mesh(meshes[i]);
+        if (use_cpu) raster_destroy(rasterizer);
+        else {
+            release_programs();
+            cleanup_egl(&gl_dev);
+        }
+        camera_path_destroy(&camera_path);
+        framebuffer_close(&fb);
         return 1;
     }
 
+    // Statistics are kept by the present thread, as frames go out
+    Stats stats;
+    int stats_fd = -1;
+    if (stats_mode != STATS_OFF) {
+        stats_fd = STDERR_FILENO;
+        if (stats_log && (stats_fd = open(stats_log, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            perror("Error opening the stats log, using stderr");
+            stats_fd = STDERR_FILENO;
+        }
+        stats_init(&stats, stats_mode, stats_fd, STATS_INTERVAL_MS);
+        queue.stats = &stats;
+    }
+
     // Time for timing/animation
     float time = 0;
     struct timespec start, end;
@@ -1059,47 +3215,87 @@ int main(int argc, char *argv[])
     float move_speed = 2.0f;
     float rotation_speed = 1.0f;
 
-    printf("Rendering OBJ model: %s\n", argv[1]);
-    printf("Controls: WASD = move, HJKL = rotate camera, SPACE = up, SHIFT = down, Q = quit\n");
+    // Software rasterizer counters, summed over every frame
+    RasterStats raster_totals = {0};
+    // Everything a frame of the scene needs, and the counters for all of them
+    mat4 mesh_motion[SCENE_MAX_MODELS];
+    SceneFrame scene_frame = {0};
+    scene_frame.meshes = meshes;
+    scene_frame.mesh_motion = mesh_motion;
+    scene_frame.ranges = draw_ranges;
+    scene_frame.instancing = 1;
+    double render_ms = 0, readback_ms = 0; // Time spent in each stage
+    unsigned long frames = 0;
+
+    printf("Rendering OBJ model: %s\n", obj_path);
+    if (num_models > 1 || scene.num_instances > 1) {
+        printf("Scene: %u instances of %d meshes, %s\n", scene.num_instances, num_models,
+               use_cpu ? "software rasterizer" :
+               gl_dev.instancing ? "instanced batches" : "one draw per instance");
+        if (!use_cpu && gl_dev.instancing) printf("Instancing: %s\n", gl_dev.instancing);
+    }
+    if (scripted) {
+        printf("Camera path: %s, %u keys over %.1f s, ", camera_path_name, camera_path.num_keys, camera_path.duration);
+        if (max_frames) printf("%lu frames\n", max_frames);
+        else printf("until it ends\n");
+    } else {
+        printf("Controls: WASD = move, HJKL = rotate camera, SPACE = up, SHIFT = down, Q = quit\n");
+    }
 
-    // Frame buffer to use with renderbuffers
-    GLuint fbo, color_rb, depth_rb;
-    glGenFramebuffers(1, &fbo);
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-    
-    // Create color renderbuffer
-    glGenRenderbuffers(1, &color_rb);
-    glBindRenderbuffer(GL_RENDERBUFFER, color_rb);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA4, gl_dev.width, gl_dev.height);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_rb);
-    
-    // Create depth renderbuffer
-    glGenRenderbuffers(1, &depth_rb);
-    glBindRenderbuffer(GL_RENDERBUFFER, depth_rb);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, gl_dev.width, gl_dev.height);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_rb);
-    
-    // Check framebuffer completeness
-    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (status != GL_FRAMEBUFFER_COMPLETE) {
-        fprintf(stderr, "Framebuffer not complete: %d\n", status);
-        free(pixels);
-        free_mesh(mesh);
+    // Render targets the GL frames are drawn into and read back from
+    ReadbackRing readback = {0};
+    // Bilinear upscaling filters RGBA, so it can't take native frames
+    int native_readback = GL_NATIVE_READBACK && UPSCALE_FILTER != BLIT_FILTER_BILINEAR;
+    if (!use_cpu && readback_init(&readback, &gl_dev, readback_targets, native_readback ? &vinfo : NULL) < 0) {
+        present_queue_destroy(&queue);
+        free(draw_ranges);
+        scene_destroy(&scene);
+        for (int i = 0; i < num_models; i++) free_mesh(meshes[i]);
+        release_programs();
         cleanup_egl(&gl_dev);
-        munmap(fbp, screensize);
-        close(fbfd);
+        camera_path_destroy(&camera_path);
+        framebuffer_close(&fb);
         return 1;
     }
-    
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    if (!use_cpu) {
+        glViewport(0, 0, render_width, render_height);
+        if (readback.num_targets > 1) {
+            printf("GL readback: %d render targets with fences, %d frame(s) of latency\n",
+                   readback.num_targets, readback.num_targets - 1);
+        } else {
+            printf("GL readback: synchronous\n");
+        }
+        if (readback.native) {
+            printf("GL readback: %s in the framebuffer's format, no conversion\n",
+                   readback.read_format == GL_BGRA_EXT ? "BGRA" :
+                   readback.read_type == GL_UNSIGNED_SHORT_5_6_5 ? "RGB565" :
+                   readback.read_format == GL_RGB ? "RGB" : "RGBA");
+        }
+        framebuffer_set_native(&fb, readback.native);
+    }
+
+    // Nobody is watching anything but a device, so only that is paced
+    FramePacer pacer;
+    frame_pacer_init(&pacer, output_target == FB_TARGET_DEVICE ? FRAME_LIMIT : 0, FRAME_SPIN_US);
+    float scripted_step = 1.0f / (FRAME_LIMIT > 0 ? FRAME_LIMIT : 60);
 
     while (!done)
     {
+        TRACE_ZONE("frame");
         clock_gettime(CLOCK_MONOTONIC_RAW, &start);
         time += delta;
 
+        if (trace_dump_requested) {
+            trace_dump_requested = 0;
+            trace_write(trace_path);
+        }
+
         // Process input events
-        process_input_events();
+        if (scripted) {
+            camera_path_sample(&camera_path, time, &camera_position, &camera_rotation);
+        } else {
+            process_input_events();
+        }
         
         // Check if quit key pressed
         if (key_state.q) { 
@@ -1134,10 +3330,11 @@ int main(int argc, char *argv[])
         if (key_state.shift) { camera_position.y -= move_speed * delta; } // Move down (y-)
 
         // Compute view direction based on rotation
+        // (same heading as the forward vector used for movement)
         vec3 view_dir = {
-            sin(camera_rotation.y) * cos(camera_rotation.x),
+            -sin(camera_rotation.y) * cos(camera_rotation.x),
             sin(camera_rotation.x),
-            cos(camera_rotation.y) * cos(camera_rotation.x)
+            -cos(camera_rotation.y) * cos(camera_rotation.x)
         };
         
         // Calculate look-at target
@@ -1147,183 +3344,215 @@ int main(int argc, char *argv[])
         mat4 view_matrix = mat4_look_at(camera_position, target, up);
         
         // Create projection matrix
-        float aspect_ratio = (float)gl_dev.width / (float)gl_dev.height;
+        float aspect_ratio = (float)render_width / (float)render_height;
         mat4 projection_matrix = mat4_perspective(45.0f * (PI / 180.0f), aspect_ratio, 0.1f, 100.0f);
+        if (!use_cpu && readback.native) {
+            // Upside down, so the rows GL reads back first are the top ones
+            projection_matrix = mat4_multiply(mat4_scale(mat4_identity(), (vec3){1, -1, 1}), projection_matrix);
+        }
         
-        // Create model matrix for the mesh
-        mat4 model_matrix = mat4_identity();
-        model_matrix = mat4_translate(model_matrix, mesh->position);
-        
-        // Apply rotations in order: Y, X, Z
-        mat4 rot_y = mat4_rotate_y(mesh->rotation.y + time * 0.5f); // Add animation
-        mat4 rot_x = mat4_rotate_x(mesh->rotation.x);
-        mat4 rot_z = mat4_rotate_z(mesh->rotation.z);
-        
-        model_matrix = mat4_multiply(model_matrix, rot_y);
-        model_matrix = mat4_multiply(model_matrix, rot_x);
-        model_matrix = mat4_multiply(model_matrix, rot_z);
-        
-        model_matrix = mat4_scale(model_matrix, mesh->scale);
-        
-        // Compute MVP matrix
-        mat4 mvp = mat4_multiply(projection_matrix, view_matrix);
-        mvp = mat4_multiply(mvp, model_matrix);
-        
-        // Clear framebuffer
-        glClearColor(0.2f, 0.2f, 0.4f, 1.0f); // Dark blue instead of red
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        
-        // Use shader program
-        // Super minimal rendering test
-glUseProgram(0); // Disable any existing program
-
-// Create absolute minimal shaders
-const char *min_vs = 
-    "attribute vec4 position;\n"
-    "void main() {\n"
-    "  gl_Position = position;\n"
-    "}\n";
+        // Every mesh spins the same way, under each instance's own placement
+        for (int i = 0; i < num_models; i++) {
+            Mesh *mesh = meshes[i];
+            // Apply rotations in order: Y, X, Z
+            mat4 rot_y = mat4_rotate_y(mesh->rotation.y + time * 0.5f); // Add animation
+            mat4 rot_x = mat4_rotate_x(mesh->rotation.x);
+            mat4 rot_z = mat4_rotate_z(mesh->rotation.z);
+
+            mat4 motion = mat4_multiply(rot_y, rot_x);
+            motion = mat4_multiply(motion, rot_z);
+            mesh_motion[i] = mat4_scale(motion, mesh->scale);
+        }
 
-const char *min_fs =
-    "precision mediump float;\n"
-    "void main() {\n"
-    "  gl_FragColor = vec4(0.0, 1.0, 0.0, 1.0);\n" // Green
-    "}\n";
+        scene_frame.view = view_matrix;
+        scene_frame.view_projection = mat4_multiply(projection_matrix, view_matrix);
+        scene_frame.camera_position = camera_position;
+        // Level of detail from how big each instance is on screen
+        scene_frame.pixels_per_unit = render_height / (2.0f * tanf(45.0f * (PI / 180.0f) / 2.0f));
+
+        // Instances out of view are dropped, the rest sorted into batches
+        scene_cull(&scene, &scene_frame);
+
+        struct timespec stage_start, stage_end;
+        StatsFrame frame_stats = {0, 0, 0};
+        unsigned long long triangles_before = scene_frame.triangles_submitted;
+        if (use_cpu) {
+            // Next free buffer in the ring
+            unsigned char *pixels = present_queue_acquire(&queue);
+
+            clock_gettime(CLOCK_MONOTONIC, &stage_start);
+            // Tiles are written straight into pixels, no separate readback
+            raster_begin_frame(rasterizer, (vec4){0.2f, 0.2f, 0.4f, 1.0f});
+            draw_scene_cpu(rasterizer, &scene, &scene_frame);
+            raster_end_frame(rasterizer, pixels);
+            clock_gettime(CLOCK_MONOTONIC, &stage_end);
+            render_ms += present_queue_ms(stage_start, stage_end);
+            frame_stats.render_ms = present_queue_ms(stage_start, stage_end);
+            frame_stats.triangles = scene_frame.triangles_submitted - triangles_before;
+
+            raster_totals.triangles_rejected += rasterizer->stats.triangles_rejected;
+            raster_totals.blocks_tested += rasterizer->stats.blocks_tested;
+            raster_totals.blocks_rejected += rasterizer->stats.blocks_rejected;
+            raster_totals.fragments_shaded += rasterizer->stats.fragments_shaded;
+            raster_totals.triangles_dropped += rasterizer->stats.triangles_dropped;
+
+            // Hand it to the present thread
+            present_queue_submit(&queue, render_width, render_height, resolution.scale,
+                                 queue.stats ? &frame_stats : NULL);
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &stage_start);
+            readback_begin_frame(&readback, render_width, render_height, resolution.scale);
+
+            // Clear framebuffer
+            glClearColor(0.2f, 0.2f, 0.4f, 1.0f); // Dark blue instead of red
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+            draw_scene_gl(&gl_dev, &scene, &scene_frame);
+            readback_end_frame(&readback);
+            clock_gettime(CLOCK_MONOTONIC, &stage_end);
+            render_ms += present_queue_ms(stage_start, stage_end);
+            // Goes out with the frame read back below, which is a few
+            // frames older with more than one target, close enough
+            frame_stats.render_ms = present_queue_ms(stage_start, stage_end);
+            frame_stats.triangles = scene_frame.triangles_submitted - triangles_before;
+
+            // Read back the oldest frame once every target is in use
+            // This is also where we end up waiting for the GPU to finish it
+            if (readback_full(&readback)) {
+                unsigned char *pixels = present_queue_acquire(&queue);
+
+                int frame_width, frame_height, frame_scale;
+                clock_gettime(CLOCK_MONOTONIC, &stage_start);
+                readback_read(&readback, pixels, &frame_width, &frame_height, &frame_scale);
+                clock_gettime(CLOCK_MONOTONIC, &stage_end);
+                readback_ms += present_queue_ms(stage_start, stage_end);
+                frame_stats.render_ms += present_queue_ms(stage_start, stage_end);
+
+                present_queue_submit(&queue, frame_width, frame_height, frame_scale,
+                                     queue.stats ? &frame_stats : NULL);
+            }
+        }
 
-// Compile with extensive error checking
-GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-glShaderSource(vs, 1, &min_vs, NULL);
-glCompileShader(vs);
+        // Pick the resolution for the next frame from how long this one
+        // took, not counting the time the pacer is about to sleep
+        struct timespec work_end;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &work_end);
+        if (resolution_update(&resolution, present_queue_ms(start, work_end))) {
+            render_width = (vinfo.xres + resolution.scale - 1) / resolution.scale;
+            render_height = (vinfo.yres + resolution.scale - 1) / resolution.scale;
+            if (use_cpu) {
+                raster_resize(rasterizer, render_width, render_height);
+            } else {
+                glViewport(0, 0, render_width, render_height);
+            }
+            // Nothing printed here, this is drawn over. --stats shows the
+            // scale, and the changes are summed up at the end
+        }
 
-GLint success;
-GLchar infoLog[512];
-glGetShaderiv(vs, GL_COMPILE_STATUS, &success);
-printf("Vertex shader compile status: %d\n", success);
-if (!success) {
-    glGetShaderInfoLog(vs, 512, NULL, infoLog);
-    printf("VS error: %s\n", infoLog);
-}
+        // Wait for this frame's slot, so delta covers the whole period
+        frame_pacer_wait(&pacer);
+        
+        // Frame timing
+        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+        delta_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+        delta = scripted ? scripted_step : delta_us / 1000000.0f;
+        frames++;
 
-GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-glShaderSource(fs, 1, &min_fs, NULL);
-glCompileShader(fs);
-glGetShaderiv(fs, GL_COMPILE_STATUS, &success);
-printf("Fragment shader compile status: %d\n", success);
-if (!success) {
-    glGetShaderInfoLog(fs, 512, NULL, infoLog);
-    printf("FS error: %s\n", infoLog);
-}
+        if ((max_frames && frames >= max_frames) || (scripted && !max_frames && time >= camera_path.duration)) {
+            done = 1;
+        }
+        
+    }
 
-GLuint program = glCreateProgram();
-glAttachShader(program, vs);
-glAttachShader(program, fs);
-glLinkProgram(program);
-glGetProgramiv(program, GL_LINK_STATUS, &success);
-printf("Program link status: %d\n", success);
-if (!success) {
-    glGetProgramInfoLog(program, 512, NULL, infoLog);
-    printf("Program error: %s\n", infoLog);
-}
+    // Frames still on the GPU get read back and shown too, so the last
+    // frame on screen is the last one rendered
+    while (!use_cpu && readback.read < readback.drawn) {
+        unsigned char *pixels = present_queue_acquire(&queue);
+        int frame_width, frame_height, frame_scale;
+        readback_read(&readback, pixels, &frame_width, &frame_height, &frame_scale);
+        StatsFrame drained = {0, 0, 0};
+        present_queue_submit(&queue, frame_width, frame_height, frame_scale, queue.stats ? &drained : NULL);
+    }
 
-glUseProgram(program);
+    // Show whatever is still queued
+    present_queue_destroy(&queue);
+    if (trace_path) trace_write(trace_path);
+    if (stats_fd >= 0 && stats_fd != STDERR_FILENO) close(stats_fd);
+    if (output_target != FB_TARGET_DEVICE && queue.frames_presented > 0) {
+        printf("Last frame: %016llx (FNV-1a of the framebuffer)\n", (unsigned long long)framebuffer_checksum(&fb));
+    }
 
-        
-        // Set uniforms
-        if (gl_dev.u_mvp != -1) {
-            glUniformMatrix4fv(gl_dev.u_mvp, 1, GL_FALSE, mvp.m);
-        }
-        
-        if (gl_dev.u_model != -1) {
-            glUniformMatrix4fv(gl_dev.u_model, 1, GL_FALSE, model_matrix.m);
+    if (use_cpu && frames > 0) {
+        printf("\nSoftware rasterizer, per frame over %lu frames:\n", frames);
+        printf("  Fragments shaded: %llu\n", raster_totals.fragments_shaded / frames);
+        printf("  8x8 blocks rejected: %llu of %llu\n",
+               raster_totals.blocks_rejected / frames, raster_totals.blocks_tested / frames);
+        printf("  Triangles rejected per tile: %llu\n", raster_totals.triangles_rejected / frames);
+        if (raster_totals.triangles_dropped > 0) {
+            printf("  Triangles dropped, out of memory: %llu in all\n", raster_totals.triangles_dropped);
         }
-        
-        if (gl_dev.u_view != -1) {
-            glUniformMatrix4fv(gl_dev.u_view, 1, GL_FALSE, view_matrix.m);
-        }
-        
-        if (gl_dev.u_light_dir != -1) {
-            // Light direction (normalized)
-            vec3 light_dir = {1.0f, 1.0f, 1.0f};
-            light_dir = normalize_vec3(light_dir);
-            glUniform3f(gl_dev.u_light_dir, light_dir.x, light_dir.y, light_dir.z);
+    }
+    if (frames > 0 && queue.frames_presented > 0) {
+        printf("\nPipeline with %d queued frames, ms per frame:\n", queue.depth);
+        printf("  Render: %.2f\n", render_ms / frames);
+        printf("  Readback: %.2f\n", readback_ms / frames);
+        printf("  Present: %.2f\n", queue.present_ms / queue.frames_presented);
+        printf("  Waiting for a free buffer: %.2f\n", queue.wait_ms / frames);
+
+        size_t full_frame = (size_t)vinfo.xres * fb.blitters[0].bytes_per_pixel * vinfo.yres;
+        printf("Framebuffer bytes written per frame: %llu (%.1f%% of a full frame)\n",
+               queue.bytes_written / queue.frames_presented,
+               100.0 * queue.bytes_written / queue.frames_presented / full_frame);
+    }
+    if (frames > 0) {
+        unsigned int max_lods = 0;
+        for (int i = 0; i < num_models; i++) {
+            if (meshes[i]->num_lods > max_lods) max_lods = meshes[i]->num_lods;
         }
-        
-        if (gl_dev.u_light_color != -1) {
-            // Light color
-            glUniform3f(gl_dev.u_light_color, 1.0f, 1.0f, 1.0f);
+        printf("Triangles submitted per frame: %llu, %llu without culling and levels of detail",
+               scene_frame.triangles_submitted / frames, scene_frame.triangles_full_detail / frames);
+        if (max_lods > 1) {
+            printf(", draws at level");
+            for (unsigned int i = 0; i < max_lods; i++) printf(" %u: %lu", i, scene_frame.draws_per_lod[i]);
         }
-        
-        if (gl_dev.u_camera_pos != -1) {
-            // Camera position for specular calculations
-            glUniform3f(gl_dev.u_camera_pos, camera_position.x, camera_position.y, camera_position.z);
+        printf("\n");
+        printf("Draw calls per frame: %.1f in %.1f batches\n",
+               (double)scene_frame.draw_calls / frames, (double)scene_frame.batches / frames);
+    }
+    if (FRUSTUM_CULLING && frames > 0) {
+        printf("Frustum culling: instances in view %llu of %llu tested, clusters drawn %llu of %llu tested\n",
+               scene_frame.cull.meshes_drawn, scene_frame.cull.meshes_tested,
+               scene_frame.cull.clusters_drawn, scene_frame.cull.clusters_tested);
+    }
+    if (resolution.enabled && frames > 0) {
+        printf("Dynamic resolution: %lu changes, frames at", resolution.changes);
+        for (int scale = resolution.min_scale; scale <= resolution.max_scale; scale++) {
+            if (resolution.frames_per_scale[scale]) {
+                printf(" 1/%d: %lu", scale, resolution.frames_per_scale[scale]);
+            }
         }
-        
-// Clear previous errors
-while(glGetError() != GL_NO_ERROR);
-
-// Create minimal working example with proper VBO
-float triangle[] = {
-    0.0f, 0.8f, 0.0f,   // top
-   -0.8f, -0.8f, 0.0f,  // bottom left
-    0.8f, -0.8f, 0.0f   // bottom right
-};
-
-// Create and bind VBO
-GLuint vbo;
-glGenBuffers(1, &vbo);
-glBindBuffer(GL_ARRAY_BUFFER, vbo);
-glBufferData(GL_ARRAY_BUFFER, sizeof(triangle), triangle, GL_STATIC_DRAW);
-
-// Use position attribute from the shader
-GLint posAttrib = glGetAttribLocation(program, "position");
-printf("Position attribute location: %d\n", posAttrib);
-glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, 0, 0);
-glEnableVertexAttribArray(posAttrib);
-
-// Draw with error checking
-GLenum err = glGetError();
-printf("Before draw GL error: %d\n", err);
-
-glDrawArrays(GL_TRIANGLES, 0, 3);
-
-err = glGetError();
-printf("After draw GL error: %d\n", err);
-
-// Make sure we read pixels after drawing
-glReadPixels(0, 0, gl_dev.width, gl_dev.height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-
-// Check a few pixel values directly
-printf("Center pixel: R=%d G=%d B=%d A=%d\n", 
-       pixels[(gl_dev.height/2 * gl_dev.width + gl_dev.width/2) * 4],
-       pixels[(gl_dev.height/2 * gl_dev.width + gl_dev.width/2) * 4 + 1],
-       pixels[(gl_dev.height/2 * gl_dev.width + gl_dev.width/2) * 4 + 2],
-       pixels[(gl_dev.height/2 * gl_dev.width + gl_dev.width/2) * 4 + 3]);
-        
-        // Copy to framebuffer
-        // For some reason, the fb doesn't update fast enough
-        // unless we print something first
-        printf("\r");
-        fflush(stdout);
-
-        copy_to_framebuffer(pixels, gl_dev.width, gl_dev.height, vinfo, finfo, fbp);
-        
-        // Frame timing
-        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-        delta_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
-        delta = delta_us / 1000000.0f;
-        
+        printf("\n");
+    }
+    if (pacer.frames + pacer.late_frames > 0) {
+        printf("Frame pacing at %d fps: %lu late frames of %lu, jitter %.0f us average, %.0f us max\n",
+               FRAME_LIMIT, pacer.late_frames, pacer.frames + pacer.late_frames,
+               pacer.frames ? pacer.jitter_total_us / pacer.frames : 0.0, pacer.jitter_max_us);
     }
 
     // Cleanup
-    glDeleteRenderbuffers(1, &color_rb);
-    glDeleteRenderbuffers(1, &depth_rb);
-    glDeleteFramebuffers(1, &fbo);
-    free(pixels);
-    free_mesh(mesh);
-    glDeleteProgram(gl_dev.program);
-    cleanup_egl(&gl_dev);
-    munmap(fbp, screensize);
-    close(fbfd);
+    resolution_destroy(&resolution);
+    camera_path_destroy(&camera_path);
+    free(draw_ranges);
+    scene_destroy(&scene);
+    for (int i = 0; i < num_models; i++) free_mesh(meshes[i]);
+    if (use_cpu) {
+        raster_destroy(rasterizer);
+    } else {
+        readback_destroy(&readback);
+        release_programs();
+        cleanup_egl(&gl_dev);
+    }
+    framebuffer_close(&fb);
 
     return 0;
 }
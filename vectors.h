@@ -243,16 +243,17 @@ mat4 mat4_identity() {
     return result;
 }
 
+// Matrices are column-major (like GL), so this is a * b
 mat4 mat4_multiply(mat4 a, mat4 b) {
     mat4 result;
     
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 4; j++) {
-            result.m[i * 4 + j] = 
-                a.m[i * 4 + 0] * b.m[0 * 4 + j] +
-                a.m[i * 4 + 1] * b.m[1 * 4 + j] +
-                a.m[i * 4 + 2] * b.m[2 * 4 + j] +
-                a.m[i * 4 + 3] * b.m[3 * 4 + j];
+    for (int col = 0; col < 4; col++) {
+        for (int row = 0; row < 4; row++) {
+            result.m[col * 4 + row] = 
+                a.m[0 * 4 + row] * b.m[col * 4 + 0] +
+                a.m[1 * 4 + row] * b.m[col * 4 + 1] +
+                a.m[2 * 4 + row] * b.m[col * 4 + 2] +
+                a.m[3 * 4 + row] * b.m[col * 4 + 3];
         }
     }
     